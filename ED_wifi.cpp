@@ -1,10 +1,24 @@
 #include "ED_wifi.h"
 #include "ED_PC_wrapper.h"
 #include "ED_sys.h"
+#include "esp_attr.h"
 #include "esp_check.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_netif_net_stack.h"
+#include "esp_sleep.h"
+#include "lwip/dhcp.h"
+#include "lwip/etharp.h"
+#include "lwip/sockets.h"
+#include "mbedtls/pkcs5.h"
+#include "mbedtls/version.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include <esp_http_server.h>
+#include <cinttypes>
+#include <cstdarg>
+#include <ctime>
+#include <type_traits>
 
 // #include "ED_alloc_profiler.h"
 
@@ -88,66 +102,277 @@ WiFiService::APCredential
 size_t WiFiService::APCredentialManager::count = 0;
 
 WiFiService::APCredential::APCredential()
-    : ssid{""}, password{""}, type(AP_CONNECTABLE), RSSI(0), chann(0),
-      lastSeen(0) {};
+    : ssid(""), password(""), ssidLen(0), pwdLen(0), type(AP_CONNECTABLE),
+      RSSI(0), chann(0), lastSeen(0), radios{}, detectedInSession(0),
+      rank(INT8_MIN), persistent(false), authmode(WIFI_AUTH_MAX), stats{} {};
 WiFiService::APCredential::APCredential(const char *s, const char *p,
                                         bool canConnect)
-    : ssid{""}, password{""},
+    : ssid(s), password(p), ssidLen(strnlen(s, ED_WIFI_SSID_SIZE - 1)),
+      pwdLen(strnlen(p, ED_WIFI_PWD_SIZE - 1)),
       type(canConnect ? AP_CONNECTABLE : AP_UNCONNECTABLE), RSSI(0), chann(0),
-      lastSeen(0) {
-  strncpy(ssid, s, sizeof(ssid) - 1);
-  ssid[sizeof(ssid) - 1] = '\0';
+      lastSeen(0), radios{}, detectedInSession(0), rank(INT8_MIN),
+      persistent(false), authmode(WIFI_AUTH_MAX), stats{} {}
 
-  strncpy(password, p, sizeof(password) - 1);
-  password[sizeof(password) - 1] = '\0';
+bool WiFiService::APCredential::matches(const char *targetSsid) const {
+  // the length is stored: no scan of the strings beyond it
+  return strnlen(targetSsid, ED_WIFI_SSID_SIZE) == ssidLen &&
+         memcmp(ssid, targetSsid, ssidLen) == 0;
 }
 
-bool WiFiService::APCredential::matches(const char *targetSsid) const {
-  return strncmp(ssid, targetSsid, sizeof(ssid)) == 0;
+void WiFiService::APCredential::updateRadio(const uint8_t bssid[6],
+                                            int8_t rssi, uint8_t chann,
+                                            uint32_t now) {
+  // the same radio, restored with its history before its detection too,
+  // else a free slot, else the least recently seen radio is replaced
+  Radio *target = nullptr;
+  for (Radio &r : radios)
+    if (!r.unused() && memcmp(r.bssid, bssid, sizeof(r.bssid)) == 0) {
+      target = &r;
+      break;
+    }
+  for (size_t i = 0; target == nullptr && i < maxRadios; ++i)
+    if (radios[i].unused())
+      target = &radios[i];
+  if (target == nullptr) {
+    target = &radios[0];
+    for (Radio &r : radios)
+      if (r.lastSeen < target->lastSeen)
+        target = &r;
+  }
+  bool sameRadio = memcmp(target->bssid, bssid, sizeof(target->bssid)) == 0;
+  target->RSSIest = smoothRSSI(target->RSSIest,
+                               sameRadio ? target->lastSeen : 0, rssi, now);
+  if (!sameRadio) {
+    // the history of the replaced radio does not apply to the new one
+    target->attempts = 0;
+    target->successes = 0;
+    target->meanTimeToIP_ms = 0;
+  }
+  memcpy(target->bssid, bssid, sizeof(target->bssid));
+  target->RSSI = rssi;
+  target->chann = chann;
+  target->failed = false;
+  target->lastSeen = now ? now : 1; // 0 is reserved for unused entries
 }
 
-bool WiFiService::APCredentialManager::remove(const char *ssid) {
-  for (size_t i = 0; i < count; ++i) {
-    if (credentials[i].matches(ssid)) {
-      // Shift remaining entries
-      for (size_t j = i; j < count - 1; ++j) {
-        credentials[j] = credentials[j + 1];
-      }
-      --count;
-      return true;
+const WiFiService::APCredential::Radio *
+WiFiService::APCredential::bestRadio() const {
+  uint32_t now = ED_WIFI_NOW_US() / 1000000;
+  const Radio *best = nullptr;
+  int8_t bestEst = INT8_MIN;
+  for (const Radio &r : radios) {
+    if (r.lastSeen == 0 || r.failed || now - r.lastSeen > radioFreshness_s)
+      continue;
+    int8_t est = radioScore(r, now);
+    if (best == nullptr || est > bestEst) {
+      best = &r;
+      bestEst = est;
     }
   }
-  return false;
+  return best;
+}
+
+int16_t WiFiService::APCredential::smoothRSSI(int16_t est_q4,
+                                              uint32_t lastSeen, int8_t sample,
+                                              uint32_t now) {
+  if (lastSeen == 0 || now - lastSeen > estimateReset_s)
+    return sample * 16; // no estimate, or too old to be blended
+  return est_q4 + (sample * 16 - est_q4) / 4;
+}
+
+int8_t WiFiService::APCredential::agedRSSI(int16_t est_q4, uint32_t lastSeen,
+                                           uint32_t now) {
+  int32_t rssi = est_q4 / 16;
+  uint32_t age = now - lastSeen;
+  if (age > decayGrace_s)
+    rssi -= (age - decayGrace_s) / decayPeriod_s;
+  return rssi < INT8_MIN ? INT8_MIN : (int8_t)rssi;
+}
+
+int8_t WiFiService::APCredential::signalEstimate(uint32_t now) const {
+  if (lastSeen == 0 || now - lastSeen > maxCandidateAge_s)
+    return INT8_MIN;
+  bool anyRadio = false;
+  int8_t best = INT8_MIN;
+  for (const Radio &r : radios) {
+    if (r.lastSeen == 0 || now - r.lastSeen > maxCandidateAge_s)
+      continue;
+    int8_t est = agedRSSI(r.RSSIest, r.lastSeen, now);
+    if (!anyRadio || est > best)
+      best = est;
+    anyRadio = true;
+  }
+  // no radio known (update without BSSID): the raw latest sample, aged
+  return anyRadio ? best : agedRSSI(RSSI * 16, lastSeen, now);
+}
+
+int32_t WiFiService::APCredential::historyPenalty(uint32_t attempts,
+                                                  uint32_t successes,
+                                                  uint32_t meanTimeToIP_ms) {
+  // success rate with a prior of one success out of two attempts, so that a
+  // new SSID or radio is neither favoured nor penalised: up to -20 dB
+  int32_t rate_pct = (successes + 1) * 100 / (attempts + 2);
+  int32_t penalty = (100 - rate_pct) / 5;
+  // slow DHCP/handshake: -1 dB every 500 ms above 1 s, up to -10 dB
+  if (meanTimeToIP_ms > 1000)
+    penalty += std::min<int32_t>(10, (meanTimeToIP_ms - 1000) / 500);
+  return penalty;
+}
+
+int8_t WiFiService::APCredential::radioScore(const Radio &r,
+                                             uint32_t now) const {
+  int32_t s = agedRSSI(r.RSSIest, r.lastSeen, now);
+  s -= r.attempts > 0 ? historyPenalty(r.attempts, r.successes,
+                                       r.meanTimeToIP_ms)
+                      : historyPenalty(stats.attempts, stats.successes,
+                                       stats.meanTimeToIP_ms);
+  return s <= INT8_MIN ? INT8_MIN + 1 : (int8_t)s;
+}
+
+int8_t WiFiService::APCredential::score(uint32_t now) const {
+  if (signalEstimate(now) == INT8_MIN)
+    return INT8_MIN;
+  bool anyRadio = false;
+  int32_t s = INT8_MIN;
+  for (const Radio &r : radios) {
+    if (r.lastSeen == 0 || now - r.lastSeen > maxCandidateAge_s)
+      continue;
+    int32_t radio = radioScore(r, now);
+    if (!anyRadio || radio > s)
+      s = radio;
+    anyRadio = true;
+  }
+  // no radio known (update without BSSID): the history of the SSID
+  if (!anyRadio)
+    s = signalEstimate(now) - historyPenalty(stats.attempts, stats.successes,
+                                             stats.meanTimeToIP_ms);
+  // recent authentication failures: -5 dB each, up to -20 dB
+  s -= std::min<int32_t>(20, 5 * stats.authFailures);
+  return s <= INT8_MIN ? INT8_MIN + 1 : (int8_t)s;
+}
+
+uint32_t WiFiService::APCredentialManager::ssidHash(const char *ssid,
+                                                   size_t len) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (uint8_t)ssid[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void WiFiService::APCredentialManager::indexInsert(size_t pos) {
+  size_t len = credentials[pos].ssidLen;
+  uint32_t hash = ssidHash(credentials[pos].ssid, len);
+  for (size_t i = 0; i < indexSlots; ++i) {
+    IndexSlot &slot = ssidIndex[(hash + i) & (indexSlots - 1)];
+    if (slot.pos == 0) {
+      slot = {hash, (uint8_t)len, (uint8_t)(pos + 1)};
+      return;
+    }
+  }
+}
+
+void WiFiService::APCredentialManager::rebuildIndex() {
+  memset(ssidIndex, 0, sizeof(ssidIndex));
+  for (size_t i = 0; i < count; ++i)
+    indexInsert(i);
+}
+
+int WiFiService::APCredentialManager::lookup(const char *ssid) {
+  size_t len = strnlen(ssid, ED_WIFI_SSID_SIZE - 1);
+  uint32_t hash = ssidHash(ssid, len);
+  // linear probing: stops at the first empty slot
+  for (size_t i = 0; i < indexSlots; ++i) {
+    const IndexSlot &slot = ssidIndex[(hash + i) & (indexSlots - 1)];
+    if (slot.pos == 0)
+      return -1;
+    if (slot.hash == hash && slot.len == len &&
+        credentials[slot.pos - 1].matches(ssid))
+      return slot.pos - 1;
+  }
+  return -1;
+}
+
+esp_err_t WiFiService::APCredentialManager::erase(const char *ssid,
+                                                  bool addedOnly) {
+  if (!onOwnerTask()) {
+    CommandMsg msg = {Command::RemoveCredential};
+    strncpy(msg.data.credential.ssid, ssid,
+            sizeof(msg.data.credential.ssid) - 1);
+    msg.data.credential.persist = addedOnly;
+    esp_err_t status = ESP_FAIL;
+    msg.status = &status;
+    return call(msg) ? status : ESP_FAIL;
+  }
+  int i = lookup(ssid);
+  if (i < 0)
+    return ESP_ERR_NOT_FOUND;
+  const APCredential *removed = &credentials[i];
+  if (addedOnly && isDefault(*removed))
+    return ESP_ERR_NOT_SUPPORTED; // no removal marker in the blob
+  // the station only lets its AP go while idle in AP fallback
+  if (removed == curAP && !apFallbackActive())
+    return ESP_ERR_INVALID_STATE;
+  // the pointers into credentials[] follow the entries shifted below
+  auto shifted = [removed](const APCredential *p) {
+    return p > removed ? p - 1 : p;
+  };
+  curAP = curAP == removed ? nullptr : shifted(curAP);
+  size_t kept = 0;
+  for (size_t j = 0; j < detectedCount; ++j) {
+    if (activeSSIDs[j] == removed) {
+      if (j < nextActive)
+        --nextActive;
+      continue;
+    }
+    activeSSIDs[kept++] = shifted(activeSSIDs[j]);
+  }
+  detectedCount = kept;
+  activeSSIDs[kept] = nullptr;
+  if (credentials[i].persistent)
+    scheduleCredentialSave();
+  invalidatePMK(credentials[i]);
+  // Shift remaining entries
+  for (size_t j = i; j < count - 1; ++j) {
+    credentials[j] = credentials[j + 1];
+  }
+  --count;
+  rebuildIndex(); // positions after i moved
+  return ESP_OK;
 }
 
 const WiFiService::APCredential *
 WiFiService::APCredentialManager::findAndUpdateInfo(char *ssid, int strength,
                                                     uint8_t chann,
-                                                    int8_t index) {
+                                                    int8_t index,
+                                                    const uint8_t *bssid) {
   // checks if the suggested index actually matches the sid otherwise falls back
-  // to the normal search
-  int8_t idx = index;
-  if (!(index >= 0 && index < count && credentials[index].matches(ssid)))
-    for (size_t i = 0; i < count; ++i)
-      if (credentials[i].matches(ssid)) {
-        idx = i;
-        break;
-      }
+  // to the indexed search
+  int idx = index;
+  if (!(index >= 0 && (size_t)index < count &&
+        credentials[index].matches(ssid)))
+    idx = lookup(ssid);
   if (idx >= 0) {
-    credentials[idx].RSSI = strength;
-    credentials[idx].chann = chann;
-    credentials[idx].lastSeen = esp_timer_get_time() / 1E6;
-    return &credentials[idx];
+    APCredential &cred = credentials[idx];
+    uint32_t now = ED_WIFI_NOW_US() / 1E6;
+    if (bssid != nullptr)
+      cred.updateRadio(bssid, strength, chann, now);
+    // when several radios of the SSID answer in the same scan session, the
+    // strongest one defines the signal of the SSID
+    if (cred.detectedInSession != sessionId || strength > cred.RSSI) {
+      cred.RSSI = strength;
+      cred.chann = chann;
+    }
+    cred.lastSeen = now;
+    return &cred;
   }
   return nullptr;
 }
 const WiFiService::APCredential *
 WiFiService::APCredentialManager::retrieve(const char *ssid) {
-  for (size_t i = 0; i < count; ++i) {
-    if (credentials[i].matches(ssid))
-      return &credentials[i];
-  }
-  return nullptr;
+  int i = lookup(ssid);
+  return i < 0 ? nullptr : &credentials[i];
 }
 
 const WiFiService::APCredential
@@ -160,16 +385,26 @@ void WiFiService::APCredentialManager::loadDefaultAPs() {
   // rawCredential is used to load at startup the SIID and PWD defined in the
   // Secrets.h
   count = 0;
+  arenaUsed = 0;
   static const char *rawCredentials[][3] = {ED_WIFI_CREDENTIALS};
   static const size_t rawCredentialCount =
       sizeof(rawCredentials) / sizeof(rawCredentials[0]);
   for (size_t i = 0; i < rawCredentialCount && count < maxTrackedSSIDs; ++i) {
+    if (strnlen(rawCredentials[i][0], ED_WIFI_SSID_SIZE) >= ED_WIFI_SSID_SIZE ||
+        strnlen(rawCredentials[i][1], ED_WIFI_PWD_SIZE) >= ED_WIFI_PWD_SIZE) {
+      ESP_LOGE(TAG, "firmware credential %u skipped: SSID or password too long",
+               (unsigned)i);
+      continue;
+    }
+    // the literals are referenced in place, not copied in the arena
     credentials[count++] = APCredential(
         rawCredentials[i][0], rawCredentials[i][1],
         !(rawCredentials[i][2][0] == '0' || rawCredentials[i][2][0] == 'u' ||
           rawCredentials[i][2][0] == 'U'));
   }
-  ESP_LOGI(TAG, "loadDefaultAPs loads %d credentials from firmware", count);
+  rebuildIndex();
+  ESP_LOGI(TAG, "loadDefaultAPs loads %u credentials from firmware",
+           (unsigned)count);
   initialized = true;
 };
 /*
@@ -190,7 +425,18 @@ void WiFiService::retry_sta_mode_task(void *arg)
 TimerHandle_t WiFiService::staRetryTimer = nullptr;
 
 void WiFiService::sta_retry_callback(TimerHandle_t xTimer) {
-  ESP_LOGI(TAG, "Retrying STA mode from AP fallback");
+  submit({Command::STARetry}, 0);
+}
+
+void WiFiService::leave_ap_fallback() { restart_sta(); }
+
+void WiFiService::restart_sta() {
+  WebInterfaace::stop();
+  CaptiveDNS::stop();
+  if (probeTimer != nullptr)
+    xTimerStop(probeTimer, 0);
+  if (staRetryTimer != nullptr)
+    xTimerStop(staRetryTimer, 0);
 
   esp_wifi_stop();
   esp_wifi_set_mode(WIFI_MODE_STA);
@@ -205,23 +451,48 @@ void WiFiService::sta_retry_callback(TimerHandle_t xTimer) {
   // vTaskDelete(nullptr); //delete on success, driven by event
 }
 
-void WiFiService::init_sta_retry_timer() {
-  const TickType_t retry_interval = pdMS_TO_TICKS(
+WiFiService::Backoff WiFiService::retryBackoff(1000, 8000);
+WiFiService::Backoff WiFiService::apBackoff(30 * 1000,
 #ifdef DEBUG_BUILD
-      5
+                                            5
 #else
-      15
+                                            15
 #endif
-      * 60 * 1000); // 15 minutes
+                                                * 60 * 1000);
+
+uint32_t WiFiService::Backoff::next() {
+  uint32_t delay = base_ms;
+  for (uint8_t i = 0; i < step && delay < cap_ms; ++i)
+    delay *= 2;
+  if (delay > cap_ms)
+    delay = cap_ms;
+  if (step < UINT8_MAX)
+    step++;
+  // upper half jitter: keeps the exponential growth while decorrelating the
+  // devices
+  uint32_t half = delay / 2;
+  return half + (half ? ED_WIFI_RANDOM() % half : 0);
+}
 
-  staRetryTimer = xTimerCreate("STA Retry Timer", retry_interval, pdTRUE,
-                               nullptr, sta_retry_callback);
+void WiFiService::init_sta_retry_timer() {
+  // one-shot: the period is set by apBackoff every time the AP fallback is
+  // entered
+  staRetryTimer = xTimerCreate("STA Retry Timer", pdMS_TO_TICKS(30 * 1000),
+                               pdFALSE, nullptr, sta_retry_callback);
   if (staRetryTimer == nullptr) {
     ESP_LOGE(TAG, "Failed to create STA retry timer");
     return;
   }
   // xTimerStart(staRetryTimer, 0);
   // the timer will be started by the event manager when needed.
+  probeTimer = xTimerCreate("STA Probe Timer", pdMS_TO_TICKS(PROBE_INTERVAL_MS),
+                            pdTRUE, nullptr, probe_callback);
+  if (probeTimer == nullptr)
+    ESP_LOGE(TAG, "Failed to create STA probe timer");
+}
+
+void WiFiService::probe_callback(TimerHandle_t xTimer) {
+  submit({Command::Probe}, 0);
 }
 
 /**
@@ -240,14 +511,19 @@ esp_err_t WiFiService::wifi_conn_AP() {
   ap_config.ap.max_connection = 4;
   ap_config.ap.authmode = WIFI_AUTH_OPEN;
 
+  // the AP interface carries the DHCP server and the portal address
+  if (ap_netif == nullptr)
+    ap_netif = esp_netif_create_default_wifi_ap();
   esp_wifi_stop();
   ESP_LOGI(TAG, "Wifi stopped, stating as AP...");
-  RETURN_ON_ERROR(esp_wifi_set_mode(WIFI_MODE_AP), TAG, "AP setmode");
+  // the STA interface stays up, idle, for the quick probe scans
+  RETURN_ON_ERROR(esp_wifi_set_mode(WIFI_MODE_APSTA), TAG, "AP setmode");
   RETURN_ON_ERROR(esp_wifi_set_config(WIFI_IF_AP, &ap_config), TAG,
                   "AP set config");
   RETURN_ON_ERROR(esp_wifi_start(), TAG, "AP start");
 
   ESP_LOGW(TAG, "Switched to AP mode");
+  NetEvents::post(NetEvents::Event::APMode);
   return ESP_OK;
 }
 
@@ -287,33 +563,923 @@ const char *WiFiService::wifi_reason_to_string(uint8_t reason) {
 TimerHandle_t WiFiService::staRetryDelayed = nullptr;
 
 void WiFiService::reconnectCallback(TimerHandle_t xTimer) {
+  submit({Command::Reconnect}, 0);
+}
+
+void WiFiService::start_owner_task() {
+  if (commandQueue != nullptr)
+    return;
+  commandQueue = xQueueCreateStatic(COMMAND_QUEUE_DEPTH, sizeof(CommandMsg),
+                                    commandQueueStorage, &commandQueueBuf);
+  ownerTask = xTaskCreateStaticPinnedToCore(
+      owner_task, "ED_wifi", sizeof(ownerTaskStack), nullptr,
+      taskConfig.priority, ownerTaskStack, &ownerTaskBuf, taskConfig.core);
+}
+
+void WiFiService::owner_task(void *arg) {
+  CommandMsg msg;
+  while (true) {
+    if (xQueueReceive(commandQueue, &msg, portMAX_DELAY) == pdTRUE)
+      execute(msg);
+  }
+}
+
+bool WiFiService::submit(const CommandMsg &msg, TickType_t wait) {
+  if (onOwnerTask()) {
+    execute(msg);
+    return true;
+  }
+  if (xQueueSend(commandQueue, &msg, wait) == pdTRUE)
+    return true;
+  droppedCommands++;
+  ESP_LOGE(TAG, "command %d dropped, ED_wifi queue full", (int)msg.cmd);
+  return false;
+}
+
+bool WiFiService::call(CommandMsg &msg) {
+  if (onOwnerTask()) {
+    execute(msg);
+    return true;
+  }
+  StaticSemaphore_t doneBuf;
+  msg.done = xSemaphoreCreateBinaryStatic(&doneBuf);
+  if (!submit(msg, portMAX_DELAY))
+    return false;
+  xSemaphoreTake(msg.done, portMAX_DELAY);
+  return true;
+}
+
+size_t WiFiService::getStateTrace(ConnectionFsm::Transition *out,
+                                  size_t max) {
+  size_t count = 0;
+  CommandMsg msg = {};
+  msg.cmd = Command::StateTrace;
+  msg.data.trace.out = out;
+  msg.data.trace.max = max;
+  msg.data.trace.count = &count;
+  call(msg);
+  return count;
+}
+
+bool WiFiService::transition(ConnectionFsm::Input input) {
+  return fsm.dispatch(input, (uint32_t)(ED_WIFI_NOW_US() / 1000));
+}
+
+void WiFiService::trace_transition(const ConnectionFsm::Transition &t) {
+  if (t.accepted)
+    ESP_LOGD(TAG, "state %s -[%s]-> %s", ConnectionFsm::name(t.from),
+             ConnectionFsm::name(t.input), ConnectionFsm::name(t.to));
+  else
+    ESP_LOGW(TAG, "state %s: %s ignored", ConnectionFsm::name(t.from),
+             ConnectionFsm::name(t.input));
+}
+
+void WiFiService::execute(const CommandMsg &msg) {
+  switch (msg.cmd) {
+  case Command::WifiEvent:
+    handle_event(WIFI_EVENT, msg.eventId, (void *)&msg.data);
+    break;
+  case Command::IPEvent:
+    handle_event(IP_EVENT, msg.eventId, (void *)&msg.data);
+    break;
+  case Command::Reconnect:
+    if (transition(ConnectionFsm::Input::RetryDue)) // not after a forced one
+      start_attempt();
+    break;
+  case Command::STARetry:
+    if (!transition(ConnectionFsm::Input::LeaveFallback))
+      break;
+    ESP_LOGI(TAG, "Retrying STA mode from AP fallback");
+    leave_ap_fallback();
+    break;
+  case Command::Probe:
+    if (apFallbackActive() && !scanSessionActive)
+      scan_wifi_networks(ScanPurpose::Probe);
+    break;
+  case Command::Survey:
+    WebInterfaace::surveyPending = true;
+    WebInterfaace::runPendingSurvey(); // or once the current session ends
+    break;
+  case Command::RoamCheck:
+    check_roam();
+    break;
+  case Command::ForceReconnect:
+    force_reconnect();
+    break;
+  case Command::SetRoamConfig: {
+    RoamConfig config;
+    memcpy(&config, msg.data.roamConfig, sizeof(config));
+    apply_roam_config(config);
+    break;
+  }
+  case Command::SetFastConnect:
+    fastConnectEnabled = msg.data.fastConnect;
+    break;
+  case Command::SetLeaseReuse:
+    leaseReuse = msg.data.leaseReuse;
+    break;
+  case Command::AddCredential: {
+    const auto &cred = msg.data.credential;
+    bool ok = cred.persist
+                  ? APCredentialManager::addOrUpdateToNVS(
+                        cred.ssid, cred.password) == ESP_OK
+                  : APCredentialManager::addOrUpdate(cred.ssid, cred.password,
+                                                     cred.canConnect);
+    if (msg.result != nullptr)
+      *msg.result = ok;
+    break;
+  }
+  case Command::SaveCredentials:
+    APCredentialManager::flushCredentials();
+    break;
+  case Command::LeaseTimer:
+    lease_timer_expired();
+    break;
+  case Command::RemoveCredential: {
+    esp_err_t err = APCredentialManager::erase(msg.data.credential.ssid,
+                                               msg.data.credential.persist);
+    if (msg.status != nullptr)
+      *msg.status = err;
+    break;
+  }
+  case Command::PortalView: {
+    const auto &view = msg.data.portal;
+    *view.length = WebInterfaace::render((WebInterfaace::View)view.view,
+                                         view.buf, view.size);
+    break;
+  }
+  case Command::StateTrace:
+    *msg.data.trace.count =
+        fsm.getTrace(msg.data.trace.out, msg.data.trace.max);
+    break;
+  }
+  if (msg.done != nullptr)
+    xSemaphoreGive(msg.done);
+}
 
+bool WiFiService::start_attempt() {
+  if (!transition(ConnectionFsm::Input::Connect))
+    return false;
+  attemptPending = true;
+  attemptStart_us = ED_WIFI_NOW_US();
+  timeline.assocStart_us = attemptStart_us;
+  timeline.attempts++;
+  APCredentialManager::recordAttempt(bssidPinned ? pinnedBSSID : nullptr);
   esp_wifi_connect();
+  return true;
+}
+
+void WiFiService::recordPhase(ConnPhase phase, int64_t from_us,
+                              int64_t to_us) {
+  if (from_us == 0 || to_us < from_us)
+    return; // the phase did not occur in this connection
+  uint32_t ms = (uint32_t)((to_us - from_us) / 1000);
+  LatencyHistogram &h = latencyHist[(size_t)phase];
+  size_t i = 0;
+  while (ms > latencyBucketBound_ms(i))
+    ++i; // the last bound is UINT32_MAX
+  h.buckets[i]++;
+  if (h.count == 0 || ms < h.min_ms)
+    h.min_ms = ms;
+  if (ms > h.max_ms)
+    h.max_ms = ms;
+  h.count++;
+  h.total_ms += ms;
+}
+
+void WiFiService::resetLatencyHistograms() {
+  for (LatencyHistogram &h : latencyHist)
+    h = {};
+}
+
+uint32_t WiFiService::Metrics::recordDisconnect(uint8_t reason) {
+  byReason[reasonSlot(reason)].fetch_add(1, std::memory_order_relaxed);
+  return disconnects.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void WiFiService::Metrics::recordScan(uint32_t duration_ms) {
+  scans.fetch_add(1, std::memory_order_relaxed);
+  scanTotal_ms.fetch_add(duration_ms, std::memory_order_relaxed);
+  uint32_t max = scanMax_ms.load(std::memory_order_relaxed);
+  while (duration_ms > max &&
+         !scanMax_ms.compare_exchange_weak(max, duration_ms,
+                                           std::memory_order_relaxed))
+    ;
+}
+
+void WiFiService::Metrics::recordRSSI(int8_t rssi) {
+  rssiSum.fetch_add(rssi, std::memory_order_relaxed);
+  rssiSamples.fetch_add(1, std::memory_order_relaxed);
+  int32_t cur = rssiMin.load(std::memory_order_relaxed);
+  while (rssi < cur && !rssiMin.compare_exchange_weak(
+                           cur, rssi, std::memory_order_relaxed))
+    ;
+  cur = rssiMax.load(std::memory_order_relaxed);
+  while (rssi > cur && !rssiMax.compare_exchange_weak(
+                           cur, rssi, std::memory_order_relaxed))
+    ;
+}
+
+void WiFiService::Metrics::snapshot(Snapshot &out) {
+  constexpr auto r = std::memory_order_relaxed;
+  out.uptime_s = (uint32_t)(ED_WIFI_NOW_US() / 1000000);
+  out.connects = connects.load(r);
+  out.disconnects = disconnects.load(r);
+  out.retries = retries.load(r);
+  out.apFallbacks = apFallbacks.load(r);
+  out.scans = scans.load(r);
+  out.scanTotal_ms = scanTotal_ms.load(r);
+  out.scanMax_ms = scanMax_ms.load(r);
+  out.roams = roams.load(r);
+  out.roamFailures = roamFailures.load(r);
+  out.rssiSamples = rssiSamples.load(r);
+  int32_t sum = rssiSum.load(r);
+  if (out.rssiSamples > 0) {
+    out.rssiMin = (int8_t)rssiMin.load(r);
+    out.rssiMax = (int8_t)rssiMax.load(r);
+    out.rssiAvg = (int8_t)(sum / (int32_t)out.rssiSamples);
+  } else {
+    out.rssiMin = out.rssiAvg = out.rssiMax = 0;
+  }
+  for (size_t i = 0; i < REASON_SLOTS; ++i) {
+    uint32_t n = byReason[i].load(r);
+    out.byReason[i] = n > UINT16_MAX ? UINT16_MAX : (uint16_t)n;
+  }
+}
+
+void WiFiService::Metrics::reset() {
+  constexpr auto r = std::memory_order_relaxed;
+  for (std::atomic<uint32_t> *c :
+       {&connects, &disconnects, &retries, &apFallbacks, &scans,
+        &scanTotal_ms, &scanMax_ms, &roams, &roamFailures, &rssiSamples})
+    c->store(0, r);
+  rssiSum.store(0, r);
+  rssiMin.store(INT8_MAX, r);
+  rssiMax.store(INT8_MIN, r);
+  for (std::atomic<uint32_t> &c : byReason)
+    c.store(0, r);
+}
+
+WiFiService::RoamConfig WiFiService::roamConfig;
+
+void WiFiService::setRoamConfig(const RoamConfig &config) {
+  CommandMsg msg = {Command::SetRoamConfig};
+  static_assert(std::is_trivially_copyable_v<RoamConfig>);
+  memcpy(msg.data.roamConfig, &config, sizeof(config));
+  submit(msg, portMAX_DELAY);
+}
+
+void WiFiService::setFastConnect(bool enabled) {
+  CommandMsg msg = {Command::SetFastConnect};
+  msg.data.fastConnect = enabled;
+  submit(msg, portMAX_DELAY);
+}
+
+void WiFiService::setLeaseReuse(LeaseReuse mode) {
+  CommandMsg msg = {Command::SetLeaseReuse};
+  msg.data.leaseReuse = mode;
+  submit(msg, portMAX_DELAY);
+}
+
+void WiFiService::apply_roam_config(const RoamConfig &config) {
+  roamConfig = config;
+  // a timer period of 0 is rejected by FreeRTOS
+  if (roamConfig.checkInterval_s == 0)
+    roamConfig.checkInterval_s = 1;
+  roamSustained = 0;
+  if (roamTimer != nullptr)
+    xTimerChangePeriod(roamTimer,
+                       pdMS_TO_TICKS(roamConfig.checkInterval_s * 1000), 0);
+}
+
+void WiFiService::roam_check_callback(TimerHandle_t xTimer) {
+  submit({Command::RoamCheck}, 0);
+}
+
+void WiFiService::check_roam() {
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+    return; // not connected
+  Metrics::recordRSSI(ap_info.rssi); // the check doubles as RSSI sampler
+  if (!roamConfig.enabled || scanSessionActive ||
+      roamStage != RoamStage::Idle)
+    return;
+  if (ap_info.rssi >= roamConfig.rssiThreshold) {
+    roamSustained = 0;
+    return;
+  }
+  int64_t now = ED_WIFI_NOW_US();
+  if (lastRoamScan_us != 0 &&
+      now - lastRoamScan_us < (int64_t)roamConfig.scanInterval_s * 1000000)
+    return;
+  lastRoamScan_us = now;
+  roamStats.backgroundScans++;
+  ESP_LOGI(TAG, "roaming: RSSI %d below %d dBm, background scan",
+           ap_info.rssi, roamConfig.rssiThreshold);
+  scan_wifi_networks(ScanPurpose::Roam);
+}
+
+void WiFiService::evaluate_roam() {
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+    return; // connection lost meanwhile, the disconnect flow takes over
+  // best radio detected by this scan among the connectable AP, the connected
+  // one excluded. Both sides compare smoothed estimates, so that a single
+  // noisy sample does not trigger a roam.
+  uint32_t now = ED_WIFI_NOW_US() / 1000000;
+  const APCredential *bestCred = nullptr;
+  const APCredential::Radio *best = nullptr;
+  int8_t bestEst = INT8_MIN;
+  int8_t currentEst = ap_info.rssi;
+  for (size_t i = 0;; ++i) {
+    const APCredential *cred = APCredentialManager::getActiveAP(i);
+    if (cred == nullptr)
+      break;
+    for (const APCredential::Radio &r : cred->radios) {
+      if (r.lastSeen == 0 || now - r.lastSeen > 10)
+        continue;
+      int8_t est = APCredential::agedRSSI(r.RSSIest, r.lastSeen, now);
+      if (memcmp(r.bssid, ap_info.bssid, sizeof(r.bssid)) == 0) {
+        currentEst = est;
+        continue;
+      }
+      if (!r.failed && (best == nullptr || est > bestEst)) {
+        best = &r;
+        bestEst = est;
+        bestCred = cred;
+      }
+    }
+  }
+  if (best == nullptr || bestEst < currentEst + roamConfig.margin_dB) {
+    roamSustained = 0;
+    return;
+  }
+  // the same candidate has to confirm its advantage over consecutive scans
+  if (memcmp(best->bssid, roamCandidate.bssid, sizeof(best->bssid)) != 0)
+    roamSustained = 0;
+  roamCandidate = *best;
+  strncpy(roamSSID, bestCred->ssid, sizeof(roamSSID) - 1);
+  char bssidStr[18];
+  MacAddress(best->bssid).toString(bssidStr, sizeof(bssidStr));
+  ESP_LOGI(TAG, "roaming: candidate {%s} [%s] RSSI %d vs %d (%d/%d)",
+           roamSSID, bssidStr, bestEst, currentEst, roamSustained + 1,
+           roamConfig.sustainedScans);
+  if (++roamSustained < roamConfig.sustainedScans)
+    return;
+  roamSustained = 0;
+  roamStage = RoamStage::Leaving;
+  roamStart_us = ED_WIFI_NOW_US();
+  s_retry_num = 0;
+  esp_wifi_disconnect(); // the disconnect event joins the candidate
+}
+
+RTC_NOINIT_ATTR WiFiService::FastConnectRecord WiFiService::fastConnectRecord;
+
+uint32_t WiFiService::fastConnectCrc(const FastConnectRecord &rec) {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&rec),
+                          offsetof(FastConnectRecord, crc));
+}
+
+bool WiFiService::fastConnectValid() {
+  return fastConnectRecord.magic == FAST_CONNECT_MAGIC &&
+         fastConnectRecord.crc == fastConnectCrc(fastConnectRecord);
+}
+
+void WiFiService::loadFastConnectRecord() {
+  if (fastConnectValid())
+    return; // RTC copy survived (soft reset / deep sleep)
+  nvs_handle_t nvs_handle;
+  FastConnectRecord rec = {};
+  size_t len = sizeof(rec);
+  if (nvs_open(APCredentialManager::NVS_AREA_NAME.data, NVS_READONLY,
+               &nvs_handle) == ESP_OK) {
+    if (nvs_get_blob(nvs_handle, FAST_CONNECT_NVS_KEY, &rec, &len) == ESP_OK &&
+        len == sizeof(rec))
+      fastConnectRecord = rec;
+    nvs_close(nvs_handle);
+  }
+  if (!fastConnectValid())
+    fastConnectRecord.magic = 0;
+  else
+    ESP_LOGI(TAG, "fast connect record restored from NVS: {%s} channel %d",
+             fastConnectRecord.ssid, fastConnectRecord.chann);
+}
+
+void WiFiService::saveFastConnectRecord(uint32_t timeToIP_ms) {
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+    return;
+  FastConnectRecord rec = {};
+  rec.magic = FAST_CONNECT_MAGIC;
+  // the driver SSID fills the 32 bytes without terminator at most, rec is
+  // zeroed: the copy stays terminated
+  memcpy(rec.ssid, ap_info.ssid,
+         strnlen((const char *)ap_info.ssid, sizeof(rec.ssid) - 1));
+  memcpy(rec.bssid, ap_info.bssid, sizeof(rec.bssid));
+  rec.chann = ap_info.primary;
+  rec.authmode = ap_info.authmode;
+  rec.scanPathTimeToIP_ms = fastConnectValid()
+                                ? fastConnectRecord.scanPathTimeToIP_ms
+                                : 0;
+  if (!fastConnectPending && timeToIP_ms > 0)
+    rec.scanPathTimeToIP_ms = timeToIP_ms;
+
+  // flash is written only when the AP changes, not at every connection
+  bool apChanged = !fastConnectValid() ||
+                   strncmp(rec.ssid, fastConnectRecord.ssid,
+                           sizeof(rec.ssid)) != 0 ||
+                   memcmp(rec.bssid, fastConnectRecord.bssid,
+                          sizeof(rec.bssid)) != 0 ||
+                   rec.chann != fastConnectRecord.chann;
+  rec.crc = fastConnectCrc(rec);
+  fastConnectRecord = rec;
+  if (!apChanged)
+    return;
+  nvs_handle_t nvs_handle;
+  if (nvs_open(APCredentialManager::NVS_AREA_NAME.data, NVS_READWRITE,
+               &nvs_handle) != ESP_OK)
+    return;
+  if (nvs_set_blob(nvs_handle, FAST_CONNECT_NVS_KEY, &rec, sizeof(rec)) ==
+      ESP_OK)
+    nvs_commit(nvs_handle);
+  nvs_close(nvs_handle);
+}
+
+bool WiFiService::tryFastConnect() {
+  if (!fastConnectEnabled || !fastConnectValid())
+    return false;
+  return connect_direct(fastConnectRecord.ssid, fastConnectRecord.bssid,
+                        fastConnectRecord.chann,
+                        (wifi_auth_mode_t)fastConnectRecord.authmode);
+}
+
+bool WiFiService::connect_direct(const char *ssid, const uint8_t bssid[6],
+                                 uint8_t chann, wifi_auth_mode_t authmode) {
+  if (!APCredentialManager::selectAP(ssid)) {
+    ESP_LOGI(TAG, "fast connect: {%s} is no longer a connectable credential",
+             ssid);
+    return false;
+  }
+  wifi_config_t sta_config = {};
+  setStaCredentials(sta_config, authmode);
+  sta_config.sta.bssid_set = true;
+  memcpy(sta_config.sta.bssid, bssid, sizeof(sta_config.sta.bssid));
+  bssidPinned = true;
+  memcpy(pinnedBSSID, bssid, sizeof(pinnedBSSID));
+  sta_config.sta.channel = chann;
+  sta_config.sta.scan_method = WIFI_FAST_SCAN;
+  sta_config.sta.threshold.authmode = authmode;
+  sta_config.sta.failure_retry_cnt = 1; // a failure falls back to the scan
+
+  if (esp_wifi_set_config(WIFI_IF_STA, &sta_config) != ESP_OK) {
+    ESP_LOGW(TAG, "fast connect: could not launch the direct connection");
+    return false;
+  }
+  if (!start_attempt()) {
+    ESP_LOGW(TAG, "fast connect: connection refused in state %s",
+             ConnectionFsm::name(fsm.current()));
+    bssidPinned = false;
+    return false;
+  }
+  char bssidStr[18];
+  MacAddress(bssid).toString(bssidStr, sizeof(bssidStr));
+  ESP_LOGI(TAG, "fast connect: direct connection to {%s} [%s] channel %d",
+           ssid, bssidStr, chann);
+  fastConnectPending = true;
+  return true;
+}
+
+WiFiService::Lease *WiFiService::findLease(const APCredential &cred) {
+  uint32_t hash = APCredentialManager::ssidHash(cred.ssid, cred.ssidLen);
+  for (Lease &l : leases)
+    if (l.valid && l.ssidHash == hash)
+      return &l;
+  return nullptr;
+}
+
+uint32_t WiFiService::leaseAge_s(const Lease &lease) {
+  time_t now = time(nullptr);
+  // the wall clock counts only once synchronized (after 2023)
+  if (lease.obtainedEpoch != 0 && now > 1672531200)
+    return (uint32_t)now - lease.obtainedEpoch;
+  if (lease.thisBoot)
+    return (uint32_t)(ED_WIFI_NOW_US() / 1000000) - lease.obtainedUptime_s;
+  return UINT32_MAX;
+}
+
+namespace {
+// lwIP state is only touched from its tcpip thread
+struct LeaseCtx {
+  esp_netif_t *netif;
+  esp_netif_ip_info_t ip;
+  uint32_t lease_s;
+  bool found;
+};
+struct dhcp *dhcpOf(esp_netif_t *netif) {
+  struct netif *n = (struct netif *)esp_netif_get_netif_impl(netif);
+  return n ? netif_dhcp_data(n) : nullptr;
+}
+} // namespace
+
+void WiFiService::record_lease() {
+  const APCredential *cred = APCredentialManager::curAP;
+  if (cred == nullptr || sta_netif == nullptr || leaseStatic)
+    return;
+  Lease lease = {};
+  lease.ssidHash = APCredentialManager::ssidHash(cred->ssid, cred->ssidLen);
+  if (esp_netif_get_ip_info(sta_netif, &lease.ip) != ESP_OK)
+    return;
+  esp_netif_dns_info_t dns;
+  if (esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK)
+    lease.dns = dns.ip.u_addr.ip4;
+  LeaseCtx ctx = {sta_netif, {}, 0, false};
+  esp_netif_tcpip_exec(
+      [](void *arg) -> esp_err_t {
+        LeaseCtx *c = (LeaseCtx *)arg;
+        // read only: the lease time is in struct dhcp since lwIP 2.0
+        // (ESP-IDF 4.x and 5.x), esp_netif does not report it
+        struct dhcp *d = dhcpOf(c->netif);
+        c->lease_s = d ? d->offered_t0_lease : 0;
+        return ESP_OK;
+      },
+      &ctx);
+  lease.lease_s = ctx.lease_s;
+  time_t now = time(nullptr);
+  lease.obtainedEpoch = now > 1672531200 ? (uint32_t)now : 0;
+  lease.obtainedUptime_s = (uint32_t)(ED_WIFI_NOW_US() / 1000000);
+  lease.thisBoot = true;
+  lease.valid = true;
+
+  Lease *slot = findLease(*cred);
+  if (slot == nullptr) {
+    slot = &leases[leaseNext];
+    leaseNext = (leaseNext + 1) % ED_WIFI_LEASE_SLOTS;
+  }
+  // flash is written when the lease changes, or when the stored copy would
+  // be past its first half at the next boot
+  bool changed = !slot->valid || slot->ssidHash != lease.ssidHash ||
+                 memcmp(&slot->ip, &lease.ip, sizeof(lease.ip)) != 0 ||
+                 slot->dns.addr != lease.dns.addr ||
+                 slot->lease_s != lease.lease_s ||
+                 (lease.obtainedEpoch != 0 &&
+                  lease.obtainedEpoch - slot->obtainedEpoch > lease.lease_s / 2);
+  *slot = lease;
+  if (changed)
+    saveLeases();
+}
+
+void WiFiService::reuse_lease() {
+  const APCredential *cred = APCredentialManager::curAP;
+  if (leaseReuse == LeaseReuse::Off || cred == nullptr || sta_netif == nullptr)
+    return;
+  Lease *lease = findLease(*cred);
+  if (lease == nullptr)
+    return;
+  uint32_t age = leaseAge_s(*lease);
+  if (leaseReuse == LeaseReuse::Reboot) {
+    // lwIP has no public call to request a given address: the INIT-REBOOT
+    // is the one of the ESP-IDF port, which restores the last address of
+    // the interface when esp_netif starts the DHCP client
+#if CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+    ESP_LOGI(TAG, "DHCP: INIT-REBOOT by lwIP, recorded " IPSTR " on {%s}",
+             IP2STR(&lease->ip.ip), cred->ssid);
+#else
+    static bool warned = false;
+    if (!warned) {
+      warned = true;
+      ESP_LOGW(TAG, "DHCP: LeaseReuse::Reboot needs "
+                    "CONFIG_LWIP_DHCP_RESTORE_LAST_IP, full exchange");
+    }
+#endif
+    return;
+  }
+  // static: only a lease of known age, within its first half (T1)
+  if (age == UINT32_MAX || lease->lease_s == 0 || age >= lease->lease_s / 2)
+    return;
+  pendingLease = *lease;
+  esp_netif_dhcpc_stop(sta_netif);
+  leaseStatic = true;
+  LeaseCtx ctx = {sta_netif, lease->ip, 0, false};
+  esp_netif_tcpip_exec(
+      [](void *arg) -> esp_err_t {
+        LeaseCtx *c = (LeaseCtx *)arg;
+        struct netif *n = (struct netif *)esp_netif_get_netif_impl(c->netif);
+        if (n == nullptr)
+          return ESP_ERR_INVALID_STATE;
+        ip4_addr_t ip;
+        ip4_addr_set_u32(&ip, c->ip.ip.addr);
+        // a pending ARP entry, so that an answer from a holder is recorded
+        etharp_query(n, &ip, nullptr);
+        return ESP_OK;
+      },
+      &ctx);
+  if (leaseTimer == nullptr)
+    leaseTimer = xTimerCreate("LeaseTimer", pdMS_TO_TICKS(LEASE_PROBE_MS),
+                              pdFALSE, nullptr, lease_timer_callback);
+  leaseProbing = true;
+  if (leaseTimer == nullptr ||
+      xTimerChangePeriod(leaseTimer, pdMS_TO_TICKS(LEASE_PROBE_MS), 0) !=
+          pdPASS) {
+    leaseProbing = false;
+    resume_dhcp();
+    return;
+  }
+  ESP_LOGI(TAG, "DHCP: probing " IPSTR " before reusing the lease of {%s}",
+           IP2STR(&lease->ip.ip), cred->ssid);
+}
+
+void WiFiService::lease_timer_callback(TimerHandle_t xTimer) {
+  submit({Command::LeaseTimer}, 0);
+}
+
+void WiFiService::lease_timer_expired() {
+  if (!leaseStatic)
+    return; // disconnected meanwhile, DHCP already resumed
+  if (!leaseProbing) {
+    ESP_LOGI(TAG, "DHCP: half of the reused lease elapsed, renewing");
+    resume_dhcp(); // T1 reached: the server takes over
+    return;
+  }
+  leaseProbing = false;
+  uint32_t age_s = leaseAge_s(pendingLease);
+  if (age_s >= pendingLease.lease_s / 2) {
+    ESP_LOGI(TAG, "DHCP: T1 passed during the probe, renewing");
+    resume_dhcp();
+    return;
+  }
+  LeaseCtx ctx = {sta_netif, pendingLease.ip, 0, false};
+  esp_netif_tcpip_exec(
+      [](void *arg) -> esp_err_t {
+        LeaseCtx *c = (LeaseCtx *)arg;
+        struct netif *n = (struct netif *)esp_netif_get_netif_impl(c->netif);
+        if (n == nullptr)
+          return ESP_ERR_INVALID_STATE;
+        ip4_addr_t ip;
+        ip4_addr_set_u32(&ip, c->ip.ip.addr);
+        struct eth_addr *mac;
+        const ip4_addr_t *found;
+        c->found = etharp_find_addr(n, &ip, &mac, &found) >= 0;
+        return ESP_OK;
+      },
+      &ctx);
+  if (ctx.found) {
+    ESP_LOGW(TAG, "DHCP: " IPSTR " is in use by another host, lease dropped",
+             IP2STR(&pendingLease.ip.ip));
+    for (Lease &l : leases)
+      if (l.valid && l.ssidHash == pendingLease.ssidHash)
+        l = {};
+    saveLeases();
+    resume_dhcp();
+    return;
+  }
+  leaseApplied = true;
+  esp_netif_set_ip_info(sta_netif, &pendingLease.ip); // posts GOT_IP
+  if (pendingLease.dns.addr != 0) {
+    esp_netif_dns_info_t dns = {};
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    dns.ip.u_addr.ip4 = pendingLease.dns;
+    esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+  }
+  // the address is held until T1, then DHCP renews it (capped at 1 day)
+  uint32_t left_s = pendingLease.lease_s / 2 - age_s;
+  left_s = std::min<uint32_t>(std::max<uint32_t>(left_s, 1), 86400);
+  xTimerChangePeriod(leaseTimer, pdMS_TO_TICKS(left_s * 1000), 0);
+  ESP_LOGI(TAG, "DHCP: lease " IPSTR " reused, renewal in %u s",
+           IP2STR(&pendingLease.ip.ip), left_s);
+}
+
+void WiFiService::resume_dhcp() {
+  leaseStatic = false;
+  leaseProbing = false;
+  leaseApplied = false;
+  if (leaseTimer != nullptr)
+    xTimerStop(leaseTimer, 0);
+  if (sta_netif != nullptr)
+    esp_netif_dhcpc_start(sta_netif);
+}
+
+void WiFiService::loadLeases() {
+  nvs_handle_t nvs_handle;
+  if (nvs_open(APCredentialManager::NVS_AREA_NAME.data, NVS_READONLY,
+               &nvs_handle) != ESP_OK)
+    return;
+  size_t len = sizeof(leases);
+  if (nvs_get_blob(nvs_handle, LEASE_NVS_KEY, leases, &len) != ESP_OK ||
+      len != sizeof(leases))
+    memset(leases, 0, sizeof(leases)); // missing or other slot count
+  nvs_close(nvs_handle);
+  for (Lease &l : leases)
+    l.thisBoot = false; // the uptime of a previous boot tells nothing
+}
+
+void WiFiService::saveLeases() {
+  if (!storeLoaded)
+    return;
+  nvs_handle_t nvs_handle;
+  if (nvs_open(APCredentialManager::NVS_AREA_NAME.data, NVS_READWRITE,
+               &nvs_handle) != ESP_OK)
+    return;
+  if (nvs_set_blob(nvs_handle, LEASE_NVS_KEY, leases, sizeof(leases)) ==
+      ESP_OK)
+    nvs_commit(nvs_handle);
+  nvs_close(nvs_handle);
+}
+
+RTC_NOINIT_ATTR WiFiService::WakeRecord WiFiService::wakeRecord;
+
+bool WiFiService::wakeRecordValid() {
+  return wakeRecord.magic == WAKE_MAGIC &&
+         wakeRecord.crc ==
+             esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&wakeRecord),
+                              offsetof(WakeRecord, crc));
+}
+
+void WiFiService::sealWakeRecord() {
+  wakeRecord.magic = WAKE_MAGIC;
+  wakeRecord.crc =
+      esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&wakeRecord),
+                       offsetof(WakeRecord, crc));
+}
+
+WiFiService::WakeStats WiFiService::getWakeStats() {
+  return wakeRecordValid() ? wakeRecord.stats : WakeStats{};
+}
+
+void WiFiService::load_store() {
+  if (storeLoaded)
+    return;
+  storeLoaded = true;
+  loadFastConnectRecord();
+  APCredentialManager::loadCredentials(); // before the statistics, keyed by
+                                          // SSID
+  APCredentialManager::loadStats();
+  APCredentialManager::loadPMKs();
+  loadLeases();
+}
+
+void WiFiService::restore_wake_record() {
+  for (uint8_t i = 0; i < wakeRecord.count; ++i) {
+    const WakeRecord::Candidate &c = wakeRecord.candidates[i];
+    if (!APCredentialManager::addOrUpdate(c.ssid, c.password, true))
+      continue;
+    const APCredential *cred = APCredentialManager::retrieve(c.ssid);
+    if (c.pmkValid)
+      APCredentialManager::seedPMK(*cred, c.pmk);
+  }
+  wakeNext = 0;
+  ESP_LOGI(TAG, "wake: %u candidates restored from RTC memory",
+           wakeRecord.count);
+}
+
+bool WiFiService::try_wake_candidate() {
+  while (wakeFast && wakeNext < wakeRecord.count) {
+    uint8_t slot = wakeNext++;
+    if (slot == wakeRecord.fastSlot)
+      continue; // already tried by the fast connect
+    const WakeRecord::Candidate &c = wakeRecord.candidates[slot];
+    if (connect_direct(c.ssid, c.bssid, c.chann, (wifi_auth_mode_t)c.authmode))
+      return true;
+  }
+  return false;
+}
+
+void WiFiService::capture_wake_record() {
+  if (!wakeRecordValid())
+    wakeRecord = {};
+  if (!wakeReported && esp_sleep_get_wakeup_cause() !=
+                           ESP_SLEEP_WAKEUP_UNDEFINED) {
+    // esp_timer counts from the boot, i.e. from the wake
+    uint32_t wake_ms = (uint32_t)(ED_WIFI_NOW_US() / 1000);
+    WakeStats &st = wakeRecord.stats;
+    if (wakeFast)
+      st.fastWakes++;
+    st.lastWakeToIP_ms = wake_ms;
+    st.meanWakeToIP_ms =
+        st.meanWakeToIP_ms == 0
+            ? wake_ms
+            : st.meanWakeToIP_ms +
+                  ((int32_t)wake_ms - (int32_t)st.meanWakeToIP_ms) / 4;
+    ESP_LOGI(TAG, "wake-to-IP %u ms (%s), mean %u ms over %u wakes", wake_ms,
+             wakeFast ? "retained state" : "scan path", st.meanWakeToIP_ms,
+             st.wakes);
+  }
+  wakeReported = true;
+  wakeRecord.failedWakes = 0;
+  // the connected AP first, then the best ranked candidates of the latest scan.
+  // Without a scan in this boot (a fast wake), activeSSIDs is empty: the
+  // candidates retained by the previous wakes are carried forward instead.
+  WakeRecord::Candidate previous[ED_WIFI_WAKE_CANDIDATES];
+  uint8_t previousCount = rankedThisBoot ? 0 : wakeRecord.count;
+  memcpy(previous, wakeRecord.candidates, sizeof(previous));
+  wakeRecord.count = 0;
+  wakeRecord.fastSlot = WAKE_NO_SLOT;
+  auto retain = [](const APCredential *cred, const uint8_t *bssid,
+                   uint8_t chann, wifi_auth_mode_t authmode) {
+    if (cred == nullptr || wakeRecord.count >= ED_WIFI_WAKE_CANDIDATES)
+      return;
+    WakeRecord::Candidate &c = wakeRecord.candidates[wakeRecord.count++];
+    c = {};
+    memcpy(c.ssid, cred->ssid, cred->ssidLen);
+    memcpy(c.password, cred->password, cred->pwdLen);
+    memcpy(c.bssid, bssid, sizeof(c.bssid));
+    c.chann = chann;
+    c.authmode = authmode;
+    c.pmkValid = APCredentialManager::cachedPMK(*cred, c.pmk);
+  };
+  const APCredential *cur = APCredentialManager::curAP;
+  retain(cur, fastConnectRecord.bssid, fastConnectRecord.chann,
+         (wifi_auth_mode_t)fastConnectRecord.authmode);
+  if (wakeRecord.count > 0)
+    wakeRecord.fastSlot = 0;
+  for (uint8_t k = 0;
+       k < previousCount && wakeRecord.count < ED_WIFI_WAKE_CANDIDATES; ++k)
+    if (cur == nullptr || !cur->matches(previous[k].ssid))
+      wakeRecord.candidates[wakeRecord.count++] = previous[k];
+  const APCredential *cred;
+  for (size_t i = 0; (cred = APCredentialManager::getActiveAP(i)) != nullptr;
+       ++i) {
+    const APCredential::Radio *radio = cred->bestRadio();
+    if (cred != cur && radio != nullptr &&
+        cred->type == APCredential::AP_CONNECTABLE)
+      retain(cred, radio->bssid, radio->chann, cred->authmode);
+  }
+  sealWakeRecord();
 }
 
 void WiFiService::event_handler(void *arg, esp_event_base_t event_base,
                                 int32_t event_id, void *event_data) {
-  static int disconnect_count = 0;
+  int64_t start = ED_WIFI_NOW_US();
+  // the event is only copied to the owner task, which handles it
+  CommandMsg msg = {};
+  msg.eventId = event_id;
+  size_t size = 0;
+  if (event_base == WIFI_EVENT) {
+    msg.cmd = Command::WifiEvent;
+    switch (event_id) {
+    case WIFI_EVENT_STA_START:
+    case WIFI_EVENT_STA_CONNECTED:
+      break;
+    case WIFI_EVENT_SCAN_DONE:
+      size = sizeof(msg.data.scanDone);
+      break;
+    case WIFI_EVENT_STA_DISCONNECTED:
+      size = sizeof(msg.data.disconnected);
+      break;
+    default:
+      return; // AP side events and the like, not handled
+    }
+  } else {
+    msg.cmd = Command::IPEvent;
+    if (event_id == IP_EVENT_STA_GOT_IP)
+      size = sizeof(msg.data.gotIP);
+  }
+  if (size > 0 && event_data != nullptr)
+    memcpy(&msg.data, event_data, size);
+  // waits at most the budget: dropping a wifi event would stall the logic
+  submit(msg, pdMS_TO_TICKS(EVENT_LOOP_BUDGET_US / 1000));
+  uint32_t held = (uint32_t)(ED_WIFI_NOW_US() - start);
+
+  eventLoopStats.events++;
+  eventLoopStats.totalHold_us += held;
+  if (held > eventLoopStats.maxHold_us) {
+    eventLoopStats.maxHold_us = held;
+    eventLoopStats.maxHoldEventId = event_id;
+  }
+  if (held > EVENT_LOOP_BUDGET_US) {
+    eventLoopStats.overBudget++;
+    ESP_LOGW(TAG, "%s event %d held the event loop for %u us",
+             event_base == WIFI_EVENT ? "wifi" : "IP", (int)event_id, held);
+  }
+}
+
+void WiFiService::handle_event(esp_event_base_t event_base, int32_t event_id,
+                               void *event_data) {
   static int64_t last_disconnect_time = 0;
 
   if (event_base == WIFI_EVENT) {
     switch (event_id) {
     case WIFI_EVENT_STA_START:
-      ESP_LOGI(TAG, "STA start completed. Scanning WiFi networks...");
 #ifdef DEBUG_BUILD
       ed_heaptrace_pause(true);
 #endif
+      if (apFallbackActive())
+        break; // STA side of the AP fallback: only used by the probe scans
+      connectStart_us = ED_WIFI_NOW_US();
+      timeline = {};
+      timeline.start_us = connectStart_us;
+      if (tryFastConnect())
+        break; // the scan runs only if the direct connection fails
+      ESP_LOGI(TAG, "STA start completed. Scanning WiFi networks...");
       scan_wifi_networks();
       break;
     case WIFI_EVENT_SCAN_DONE:
-      ESP_LOGI(TAG, "SCAN_DONE connecting...");
-      // initializes the internal station ID
-      APCredentialManager::setNextActiveAP();
-      wifi_conn_STA();
-#ifdef DEBUG_BUILD
-      ed_heaptrace_pause(false);
-#endif
-      esp_wifi_connect();
+      on_scan_done(((wifi_event_sta_scan_done_t *)event_data)->status);
+      break;
+    case WIFI_EVENT_STA_CONNECTED:
+      timeline.connected_us = ED_WIFI_NOW_US();
+      recordPhase(ConnPhase::Assoc, timeline.assocStart_us,
+                  timeline.connected_us);
+      reuse_lease();
       break;
     case WIFI_EVENT_STA_DISCONNECTED:
 #ifdef DEBUG_BUILD
@@ -329,26 +1495,95 @@ void WiFiService::event_handler(void *arg, esp_event_base_t event_base,
                  ap_info.ssid, ap_info.rssi, ap_info.primary);
       }
       ESP_LOGW(TAG, "Uptime: %u sec (low 32 bits), Free heap: %u",
-               (uint32_t)(esp_timer_get_time() / 1000000),
+               (uint32_t)(ED_WIFI_NOW_US() / 1000000),
                esp_get_free_heap_size());
       esp_netif_dns_info_t dns;
       if (sta_netif && esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN,
                                               &dns) == ESP_OK) {
         ESP_LOGW(TAG, "Current DNS: " IPSTR, IP2STR(&dns.ip.u_addr.ip4));
       }
-      disconnect_count++;
-      last_disconnect_time = esp_timer_get_time() / 1000000;
+      if (leaseStatic)
+        resume_dhcp(); // the next network gets its own lease
+      uint32_t disconnect_count = Metrics::recordDisconnect(disconn->reason);
+      last_disconnect_time = ED_WIFI_NOW_US() / 1000000;
+      if (timeline.start_us == 0) {
+        // the connection was up: the reconnection timeline starts here
+        timeline = {};
+        timeline.start_us = ED_WIFI_NOW_US();
+        if (roamStage != RoamStage::Leaving)
+          NetEvents::post(NetEvents::Event::Disconnected, disconn->reason);
+      }
+      timeline.connected_us = 0;
+
+      if (attemptPending) {
+        attemptPending = false;
+        APCredentialManager::recordOutcome(
+            false, 0, disconn->reason, bssidPinned ? pinnedBSSID : nullptr);
+      } else if (roamStage != RoamStage::Leaving)
+        APCredentialManager::recordDrop(disconn->reason);
+
+      if (roamStage == RoamStage::Leaving) {
+        // left the old radio on purpose: joins the candidate
+        roamStage = RoamStage::Joining;
+        if (APCredentialManager::selectAP(roamSSID) &&
+            wifi_conn_STA(&roamCandidate) == ESP_OK) {
+          start_attempt();
+          break;
+        }
+      }
+      if (roamStage != RoamStage::Idle) {
+        // the candidate did not grant an IP: normal retry flow from here
+        roamStage = RoamStage::Idle;
+        roamStats.roamFailures++;
+        Metrics::roamFailures.fetch_add(1, std::memory_order_relaxed);
+        ESP_LOGW(TAG, "roam to {%s} failed", roamSSID);
+      }
+
+      if (fastConnectPending) {
+        // the recorded AP did not answer: back to the scan-and-rank flow,
+        // without consuming retries
+        fastConnectPending = false;
+        if (try_wake_candidate())
+          break; // next AP retained across deep sleep, still without scan
+        if (wakeFast) {
+          wakeFast = false;
+          wakeRecord.stats.fallbacks++;
+          wakeRecord.failedWakes++;
+          sealWakeRecord();
+        }
+        ESP_LOGW(TAG, "fast connect to {%s} failed, falling back to scan",
+                 fastConnectRecord.ssid);
+        scan_wifi_networks();
+        break;
+      }
 
       // Convert to seconds, then keep low 32 bits
-      ESP_LOGW(TAG, "Disconnect #%d at %u sec (low 32 bits)", disconnect_count,
+      ESP_LOGW(TAG, "Disconnect #%u at %u sec (low 32 bits)", disconnect_count,
                (uint32_t)(last_disconnect_time / 1000000));
 
-      if (s_retry_num++ < MAX_RETRY) {
-        ESP_LOGW(TAG, "Disconnected. Retry #%d with SAME AP %s", s_retry_num,
-                 APCredentialManager::curAP->ssid);
-        xTimerStart(staRetryDelayed, 0);
+      // no curAP when the scan found no known network: nothing to retry
+      if (s_retry_num < MAX_RETRY && APCredentialManager::curAP != nullptr) {
+        if (!transition(ConnectionFsm::Input::RetryLater))
+          break; // stale disconnection, e.g. while a scan selects the AP
+        ++s_retry_num; // only retries actually scheduled count
+        Metrics::retries.fetch_add(1, std::memory_order_relaxed);
+        uint32_t delay_ms = retryBackoff.next();
+        ESP_LOGW(TAG, "Disconnected. Retry #%d with SAME AP %s in %u ms",
+                 s_retry_num, APCredentialManager::curAP->ssid, delay_ms);
+        xTimerChangePeriod(staRetryDelayed, pdMS_TO_TICKS(delay_ms), 0);
       } else {
+        retryBackoff.reset(); // the next AP starts from the base delay
         // ESP_LOGI(TAG, "Disconnected. exceeded MAX_RETRY");
+        if (bssidPinned && APCredentialManager::markRadioFailed(pinnedBSSID)) {
+          // another radio of the same SSID is in range: tries it before
+          // switching network
+          ESP_LOGW(TAG, "Max retries reached. Switching radio of SSID: (%s).",
+                   APCredentialManager::curAP->ssid);
+          s_retry_num = 0;
+          wifi_conn_STA();
+          start_attempt();
+          break;
+        }
         bool networkAvailable = false;
         networkAvailable = APCredentialManager::setNextActiveAP();
         if (networkAvailable &&
@@ -361,7 +1596,13 @@ void WiFiService::event_handler(void *arg, esp_event_base_t event_base,
           wifi_conn_STA(); // there is an alternative valid connectable AP in
                            // reach, tries to switch to it. here, reconfigures
                            // the sta to use new AP
-          esp_wifi_connect();
+          start_attempt();
+        } else if (APCredentialManager::detectionStale()) {
+          // the candidates come from an old scan: refreshes them before
+          // giving up on STA mode
+          ESP_LOGW(TAG, "Max retries reached, candidates are stale. Rescan.");
+          s_retry_num = 0;
+          scan_wifi_networks();
         } else { // no alternative or no network, switches to AP mode and
                  // schedules a retry to connect back to STA
           ESP_LOGI(TAG,
@@ -369,10 +1610,18 @@ void WiFiService::event_handler(void *arg, esp_event_base_t event_base,
                    "connection.",
                    networkAvailable ? "Max retries reached"
                                     : "No Network available");
+          APCredentialManager::saveStats(true);
+          transition(ConnectionFsm::Input::Fallback);
+          Metrics::apFallbacks.fetch_add(1, std::memory_order_relaxed);
           wifi_conn_AP();
-          // WebInterfaace::init(); //launches the interface to allow user to
-          // add AP credential or modify existing ones
-          xTimerStart(staRetryTimer, 0); //
+          // lets the user add AP credentials or modify existing ones
+          WebInterfaace::start();
+          CaptiveDNS::start(ap_netif);
+          uint32_t delay_ms = apBackoff.next();
+          ESP_LOGI(TAG, "AP fallback #%u, full STA retry in %u s",
+                   apBackoff.attempts(), delay_ms / 1000);
+          xTimerChangePeriod(staRetryTimer, pdMS_TO_TICKS(delay_ms), 0);
+          xTimerStart(probeTimer, 0);
         }
       }
       break;
@@ -380,6 +1629,9 @@ void WiFiService::event_handler(void *arg, esp_event_base_t event_base,
       // default:
       //     break;
     }
+  } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_LOST_IP) {
+    ESP_LOGW(TAG, "IP lost");
+    NetEvents::post(NetEvents::Event::LostIP);
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
 #ifdef DEBUG_BUILD
     ed_heaptrace_pause(false);
@@ -399,8 +1651,85 @@ void WiFiService::event_handler(void *arg, esp_event_base_t event_base,
                "], DNS [ error ]",
                APCredentialManager::curAP->ssid, station_ID,
                IP2STR(&event->ip_info.ip));
-    runGotIPsubscribers();
+    if (connectStart_us != 0) {
+      uint32_t timeToIP_ms =
+          (uint32_t)((ED_WIFI_NOW_US() - connectStart_us) / 1000);
+      if (fastConnectPending && fastConnectRecord.scanPathTimeToIP_ms > 0)
+        ESP_LOGI(TAG,
+                 "fast connect: time-to-IP %u ms, saved %d ms against the "
+                 "scan path (%u ms)",
+                 timeToIP_ms,
+                 (int)fastConnectRecord.scanPathTimeToIP_ms - (int)timeToIP_ms,
+                 fastConnectRecord.scanPathTimeToIP_ms);
+      else
+        ESP_LOGI(TAG, "%s: time-to-IP %u ms",
+                 fastConnectPending ? "fast connect" : "scan path",
+                 timeToIP_ms);
+      saveFastConnectRecord(timeToIP_ms);
+      connectStart_us = 0;
+    } else
+      saveFastConnectRecord(0);
+    fastConnectPending = false;
+    if (leaseApplied)
+      leaseApplied = false; // nothing new to record
+    else
+      record_lease();
+    if (wakeMode)
+      capture_wake_record();
+    if (attemptPending) {
+      attemptPending = false;
+      APCredentialManager::recordOutcome(
+          true, (uint32_t)((ED_WIFI_NOW_US() - attemptStart_us) / 1000), 0,
+          bssidPinned ? pinnedBSSID : nullptr);
+      APCredentialManager::saveStats();
+    }
+    bool roamed = roamStage != RoamStage::Idle;
+    if (roamed) {
+      uint32_t latency_ms =
+          (uint32_t)((ED_WIFI_NOW_US() - roamStart_us) / 1000);
+      roamStage = RoamStage::Idle;
+      roamStats.roams++;
+      Metrics::roams.fetch_add(1, std::memory_order_relaxed);
+      roamStats.lastLatency_ms = latency_ms;
+      roamStats.totalLatency_ms += latency_ms;
+      if (latency_ms > roamStats.maxLatency_ms)
+        roamStats.maxLatency_ms = latency_ms;
+      ESP_LOGI(TAG, "roam #%u completed in %u ms", roamStats.roams,
+               latency_ms);
+    }
+    timeline.gotIP_us = ED_WIFI_NOW_US();
+    recordPhase(ConnPhase::DHCP, timeline.connected_us, timeline.gotIP_us);
+    recordPhase(ConnPhase::Total, timeline.start_us, timeline.gotIP_us);
+    lastTimeline = timeline;
+    timeline = {}; // start_us = 0 marks the connection as up
+    ESP_LOGI(TAG,
+             "timeline: scan %d ms, assoc %d ms, DHCP %d ms, total %d ms, "
+             "%u attempts",
+             lastTimeline.scanStart_us
+                 ? (int)((lastTimeline.scanEnd_us - lastTimeline.scanStart_us) /
+                         1000)
+                 : 0,
+             lastTimeline.connected_us
+                 ? (int)((lastTimeline.connected_us -
+                          lastTimeline.assocStart_us) /
+                         1000)
+                 : 0,
+             lastTimeline.connected_us
+                 ? (int)((lastTimeline.gotIP_us - lastTimeline.connected_us) /
+                         1000)
+                 : 0,
+             lastTimeline.start_us
+                 ? (int)((lastTimeline.gotIP_us - lastTimeline.start_us) / 1000)
+                 : 0,
+             lastTimeline.attempts);
+    transition(ConnectionFsm::Input::GotIP);
+    Metrics::connects.fetch_add(1, std::memory_order_relaxed);
+    NetEvents::post(NetEvents::Event::GotIP, 0, event->ip_info.ip.addr);
+    if (roamed)
+      NetEvents::post(NetEvents::Event::Roamed, 0, event->ip_info.ip.addr);
     s_retry_num = 0;
+    retryBackoff.reset();
+    apBackoff.reset();
     if (staRetryTimer != nullptr) {
       xTimerStop(staRetryTimer, 0); // Stops the timer}
     }
@@ -416,93 +1745,720 @@ int WiFiService::APCredential::compare_rssi_desc(const void *a, const void *b) {
     return 1;
   if (apB == nullptr)
     return -1;
-  return apB->RSSI - apA->RSSI;
+  return apB->rank - apA->rank;
+}
+
+void WiFiService::ScanPlanner::begin(bool targeted, bool sweep) {
+  APCredentialManager::ScanTarget found[maxTargets];
+  targetCount =
+      targeted ? APCredentialManager::getScanTargets(found, maxTargets) : 0;
+  for (size_t i = 0; i < targetCount; ++i) {
+    strncpy(targets[i].ssid, found[i].ssid, sizeof(targets[i].ssid) - 1);
+    targets[i].ssid[sizeof(targets[i].ssid) - 1] = '\0';
+    targets[i].chann = found[i].chann;
+  }
+  nextTarget = 0;
+  matchedAny = false;
+  fullSweepDone = false;
+  sweepAllowed = sweep;
+}
+
+bool WiFiService::ScanPlanner::nextPass(wifi_scan_config_t &config) {
+  config = {};
+  config.show_hidden = true; // a directed probe also reveals hidden SSIDs
+  config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+  config.home_chan_dwell_time = 100;
+  config.coex_background_scan =
+      false; // a bit more aggressive, might impact bluetooth
+  // every target is probed, so that the ranking and the failover see all the
+  // known networks in range
+  if (nextTarget < targetCount) {
+    // directed probe on a single channel: the AP answers within a few tens
+    // of ms, no need for the long dwell of the discovery sweep
+    Target &t = targets[nextTarget++];
+    config.ssid = (uint8_t *)t.ssid;
+    config.channel = t.chann;
+    config.scan_time.active.min = 30;
+    config.scan_time.active.max = 120;
+    ESP_LOGI(TAG, "scan pass: directed probe for {%s} on channel %d", t.ssid,
+             t.chann);
+    return true;
+  }
+  if (matchedAny || fullSweepDone || !sweepAllowed)
+    return false;
+  fullSweepDone = true;
+  config.scan_time.active.min = 150;
+  config.scan_time.active.max = 500;
+  ESP_LOGI(TAG, "scan pass: full sweep of all channels%s",
+           targetCount ? ", targeted passes found nothing" : "");
+  return true;
+}
+
+void WiFiService::ScanPlanner::passDone(uint16_t matched) {
+  if (matched > 0)
+    matchedAny = true;
+}
+
+void WiFiService::scan_wifi_networks(ScanPurpose purpose) {
+  ESP_LOGI(TAG, "in scan_wifi_networks");
+  // background scans (roam, probe) do not change the connection state
+  if (purpose == ScanPurpose::Connect &&
+      !transition(ConnectionFsm::Input::ScanStart))
+    return;
+  load_store(); // a fast wake defers it until a scan is needed
+  APCredentialManager::beginDetection();
+  // a roaming scan looks for other radios, which directed passes on the
+  // known channels would miss, a survey lists all the networks in range
+  // a probe only checks the channels where the networks were seen: a full
+  // sweep would take the AP off its channel for seconds
+  bool sweepOnly =
+      purpose == ScanPurpose::Roam || purpose == ScanPurpose::Survey;
+  ScanPlanner::begin(!sweepOnly, purpose != ScanPurpose::Probe);
+  if (purpose == ScanPurpose::Survey)
+    WebInterfaace::clearSeen();
+  scanPurpose = purpose;
+  scanSessionActive = true;
+  scanSessionStart_us = ED_WIFI_NOW_US();
+  if (purpose == ScanPurpose::Connect)
+    timeline.scanStart_us = ED_WIFI_NOW_US();
+  if (!start_scan_pass()) {
+    // nothing could be launched: closes the session as an empty one
+    on_scan_done(1);
+  }
+}
+
+bool WiFiService::start_scan_pass() {
+  wifi_scan_config_t scan_config;
+  while (ScanPlanner::nextPass(scan_config)) {
+    esp_err_t err = esp_wifi_scan_start(&scan_config, false); // non blocking
+    if (err == ESP_OK)
+      return true;
+    ESP_LOGE(TAG, "scan pass could not start: %s", esp_err_to_name(err));
+    ScanPlanner::passDone(0);
+  }
+  return false;
+}
+
+void WiFiService::on_scan_done(uint32_t status) {
+  if (!scanSessionActive) {
+    ESP_LOGI(TAG, "SCAN_DONE outside of a scan session, ignored");
+    return;
+  }
+  uint16_t matched = 0;
+  if (status == 0) {
+    // streams the records out of the driver list one at a time: a single
+    // record (~80 bytes) on the stack and no heap, whatever the number of AP
+    // in range. Each call pops and frees the record from the driver list.
+    wifi_ap_record_t record;
+    uint16_t number = 0;
+    while (esp_wifi_scan_get_ap_record(&record) == ESP_OK) {
+      ++number;
+      if (WebInterfaace::running())
+        WebInterfaace::noteSeen(record);
+      if (APCredentialManager::ingestDetectedAP(record))
+        ++matched;
+    }
+    ESP_LOGI(TAG, "scan pass detected %d APs", number);
+  } else
+    ESP_LOGW(TAG, "scan pass failed");
+  esp_wifi_clear_ap_list(); // releases the driver list in any case
+  ScanPlanner::passDone(matched);
+  if (start_scan_pass())
+    return; // more passes in this session
+
+  scanSessionActive = false;
+  Metrics::recordScan(
+      (uint32_t)((ED_WIFI_NOW_US() - scanSessionStart_us) / 1000));
+  APCredentialManager::endDetection();
+  rankedThisBoot = true;
+  if (scanPurpose == ScanPurpose::Roam) {
+    evaluate_roam();
+    return;
+  }
+  if (scanPurpose == ScanPurpose::Probe) {
+    if (apFallbackActive() && APCredentialManager::getActiveAP(0) != nullptr &&
+        transition(ConnectionFsm::Input::LeaveFallback)) {
+      ESP_LOGI(TAG, "probe: {%s} is back, leaving AP mode",
+               APCredentialManager::getActiveAP(0)->ssid);
+      leave_ap_fallback();
+    } else
+      WebInterfaace::runPendingSurvey(); // requested during the probe
+    return;
+  }
+  if (scanPurpose == ScanPurpose::Survey)
+    return; // listed by the portal, the probes decide to leave AP mode
+  timeline.scanEnd_us = ED_WIFI_NOW_US();
+  recordPhase(ConnPhase::Scan, timeline.scanStart_us, timeline.scanEnd_us);
+  ESP_LOGI(TAG, "SCAN_DONE connecting...");
+  // initializes the internal station ID
+  APCredentialManager::setNextActiveAP();
+  wifi_conn_STA();
+#ifdef DEBUG_BUILD
+  ed_heaptrace_pause(false);
+#endif
+  start_attempt();
+}
+
+void WiFiService::APCredentialManager::beginDetection() {
+  if (!initialized)
+    loadDefaultAPs();
+  detectedCount = 0;
+  activeSSIDs[0] = nullptr;
+  nextActive = 0; // the new list is tried from its strongest candidate
+  if (++sessionId == 0)
+    sessionId = 1; // 0 marks credentials never detected
+}
+
+bool WiFiService::APCredentialManager::ingestDetectedAP(
+    const wifi_ap_record_t &record) {
+  // sanitizes the SSID, which fills the 32 bytes without terminator at most
+  char ssid_str[ED_WIFI_SSID_SIZE]; // One extra byte for null terminator
+  memcpy(ssid_str, record.ssid, ED_WIFI_SSID_SIZE - 1);
+
+  ssid_str[ED_WIFI_SSID_SIZE - 1] = '\0'; // Ensure null-termination
+  ESP_LOGI(TAG, "processing {%s} rssi %d", ssid_str, record.rssi);
+  int j = lookup(ssid_str);
+  if (j < 0)
+    return false;
+  bool firstInSession = credentials[j].detectedInSession != sessionId;
+  credentials[j].authmode = record.authmode;
+  const APCredential *cred = findAndUpdateInfo(
+      ssid_str, record.rssi, record.primary, j, record.bssid);
+  // further radios of an SSID already listed only update its radio table
+  if (firstInSession) {
+    credentials[j].detectedInSession = sessionId;
+    if (detectedCount < maxTrackedSSIDs)
+      activeSSIDs[detectedCount++] = cred;
+  }
+  ESP_LOGI(TAG, "updateDetectedAPs matches %s with RSSI %d", ssid_str,
+           record.rssi);
+  return true;
+}
+
+void WiFiService::APCredentialManager::endDetection() {
+  activeSSIDs[detectedCount] = nullptr; // terminates the list with nullpt
+  // ranks on the smoothed estimate rather than on the single latest sample,
+  // weighted by the connection history
+  lastDetection_s = ED_WIFI_NOW_US() / 1000000;
+  for (size_t i = 0; i < count; ++i)
+    credentials[i].rank = credentials[i].score(lastDetection_s);
+  qsort(activeSSIDs, detectedCount, sizeof(const APCredential *),
+        APCredential::compare_rssi_desc);
+}
+
+void WiFiService::APCredentialManager::updateDetectedAPs(
+    uint16_t number, wifi_ap_record_t *ap_records) {
+  beginDetection();
+  for (uint16_t i = 0; i < number; ++i)
+    ingestDetectedAP(ap_records[i]);
+  endDetection();
+}
+
+size_t WiFiService::APCredentialManager::getScanTargets(ScanTarget targets[],
+                                                        size_t max) {
+  if (!initialized)
+    loadDefaultAPs();
+  size_t n = 0;
+  auto add = [&](const char *ssid, uint8_t chann) {
+    if (chann == 0 || n >= max)
+      return;
+    for (size_t k = 0; k < n; ++k)
+      if (targets[k].ssid == ssid && targets[k].chann == chann)
+        return;
+    targets[n++] = {ssid, chann};
+  };
+  // best ranked first: when the targets are capped, the likely candidates
+  // are the ones probed
+  uint8_t order[maxTrackedSSIDs];
+  size_t ranked = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (credentials[i].type != APCredential::AP_CONNECTABLE)
+      continue;
+    size_t k = ranked++;
+    for (; k > 0 && credentials[order[k - 1]].rank < credentials[i].rank; --k)
+      order[k] = order[k - 1];
+    order[k] = (uint8_t)i;
+  }
+  for (size_t j = 0; j < ranked && n < max; ++j) {
+    const APCredential &cred = credentials[order[j]];
+    add(cred.ssid, cred.chann); // channel of the strongest radio first
+    for (const APCredential::Radio &r : cred.radios)
+      if (r.lastSeen != 0)
+        add(cred.ssid, r.chann);
+  }
+  return n;
+}
+
+bool WiFiService::APCredentialManager::markRadioFailed(const uint8_t bssid[6]) {
+  if (curAP == nullptr)
+    return false;
+  APCredential &cred = credentials[curAP - credentials];
+  for (APCredential::Radio &r : cred.radios)
+    if (r.lastSeen != 0 && memcmp(r.bssid, bssid, sizeof(r.bssid)) == 0)
+      r.failed = true;
+  return cred.bestRadio() != nullptr;
+}
+
+WiFiService::APCredential::Radio *
+WiFiService::APCredentialManager::findRadio(APCredential &cred,
+                                            const uint8_t *bssid) {
+  if (bssid == nullptr)
+    return nullptr;
+  for (APCredential::Radio &r : cred.radios)
+    if (!r.unused() && memcmp(r.bssid, bssid, sizeof(r.bssid)) == 0)
+      return &r;
+  return nullptr;
+}
+
+void WiFiService::APCredentialManager::recordAttempt(const uint8_t *bssid) {
+  APCredential *cred = current();
+  if (cred == nullptr)
+    return;
+  if (cred->stats.attempts >= 1000) {
+    // halves the history so that recent behaviour keeps its weight
+    cred->stats.attempts /= 2;
+    cred->stats.successes /= 2;
+  }
+  cred->stats.attempts++;
+  if (APCredential::Radio *radio = findRadio(*cred, bssid)) {
+    if (radio->attempts >= 200) {
+      radio->attempts /= 2;
+      radio->successes /= 2;
+    }
+    radio->attempts++;
+  }
+  statsDirty = true;
+}
+
+// moving average, weight 1/4 to the new sample
+static uint16_t blendTimeToIP(uint16_t mean_ms, uint32_t sample_ms) {
+  if (sample_ms > UINT16_MAX)
+    sample_ms = UINT16_MAX;
+  return mean_ms == 0 ? sample_ms
+                      : mean_ms + ((int32_t)sample_ms - mean_ms) / 4;
+}
+
+void WiFiService::APCredentialManager::recordOutcome(bool gotIP,
+                                                     uint32_t timeToIP_ms,
+                                                     uint8_t reason,
+                                                     const uint8_t *bssid) {
+  APCredential *cred = current();
+  if (cred == nullptr)
+    return;
+  APCredential::ConnStats &st = cred->stats;
+  if (gotIP) {
+    st.successes++;
+    st.meanTimeToIP_ms = blendTimeToIP(st.meanTimeToIP_ms, timeToIP_ms);
+    if (APCredential::Radio *radio = findRadio(*cred, bssid)) {
+      radio->successes++;
+      radio->meanTimeToIP_ms =
+          blendTimeToIP(radio->meanTimeToIP_ms, timeToIP_ms);
+    }
+    if (st.authFailures > 0)
+      st.authFailures--;
+  } else {
+    st.lastReason = reason;
+    if ((reason == WIFI_REASON_AUTH_FAIL ||
+         reason == WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT ||
+         reason == WIFI_REASON_HANDSHAKE_TIMEOUT ||
+         reason == WIFI_REASON_AUTH_EXPIRE) &&
+        st.authFailures < 10)
+      st.authFailures++;
+  }
+  statsDirty = true;
+}
+
+void WiFiService::APCredentialManager::recordDrop(uint8_t reason) {
+  APCredential *cred = current();
+  if (cred == nullptr)
+    return;
+  cred->stats.lastReason = reason;
+  statsDirty = true;
+}
+
+void WiFiService::APCredentialManager::loadStats() {
+  if (!initialized)
+    loadDefaultAPs();
+  nvs_handle_t nvs_handle;
+  if (nvs_open(NVS_AREA_NAME.data, NVS_READONLY, &nvs_handle) != ESP_OK)
+    return;
+  StatsRecord records[maxTrackedSSIDs];
+  size_t len = sizeof(records);
+  if (nvs_get_blob(nvs_handle, STATS_NVS_KEY, records, &len) == ESP_OK) {
+    for (size_t r = 0; r < len / sizeof(StatsRecord); ++r)
+      for (size_t i = 0; i < count; ++i)
+        if (ssidHash(credentials[i].ssid, credentials[i].ssidLen) ==
+            records[r].ssidHash)
+          credentials[i].stats = records[r].stats;
+  }
+  // a blob of a build with more slots does not fit: its radios start over
+  len = sizeof(radioRecords);
+  if (nvs_get_blob(nvs_handle, RADIO_STATS_NVS_KEY, radioRecords, &len) !=
+      ESP_OK)
+    len = 0;
+  for (size_t r = 0; r < len / sizeof(RadioStatsRecord); ++r) {
+    const RadioStatsRecord &rec = radioRecords[r];
+    int i = -1;
+    for (size_t k = 0; k < count && i < 0; ++k)
+      if (ssidHash(credentials[k].ssid, credentials[k].ssidLen) ==
+          rec.ssidHash)
+        i = k;
+    if (i < 0)
+      continue;
+    // restored undetected: lastSeen stays 0 until a scan sees the radio
+    APCredential &cred = credentials[i];
+    APCredential::Radio *radio = findRadio(cred, rec.bssid);
+    for (size_t k = 0; radio == nullptr && k < APCredential::maxRadios; ++k)
+      if (cred.radios[k].unused()) {
+        radio = &cred.radios[k];
+        memcpy(radio->bssid, rec.bssid, sizeof(radio->bssid));
+      }
+    if (radio == nullptr)
+      continue;
+    radio->attempts = rec.attempts;
+    radio->successes = rec.successes;
+    radio->meanTimeToIP_ms = rec.meanTimeToIP_ms;
+  }
+  nvs_close(nvs_handle);
+}
+
+void WiFiService::APCredentialManager::saveStats(bool force) {
+  uint32_t now = ED_WIFI_NOW_US() / 1000000;
+  if (!storeLoaded || !statsDirty || (!force && lastStatsSave_s != 0 &&
+                      now - lastStatsSave_s < statsSaveInterval_s))
+    return;
+  StatsRecord records[maxTrackedSSIDs];
+  size_t n = 0, radios = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const APCredential &cred = credentials[i];
+    if (cred.stats.attempts == 0)
+      continue;
+    uint32_t hash = ssidHash(cred.ssid, cred.ssidLen);
+    records[n++] = {hash, cred.stats};
+    for (const APCredential::Radio &r : cred.radios)
+      if (r.attempts > 0) {
+        RadioStatsRecord &rec = radioRecords[radios++];
+        rec = {hash, {}, r.attempts, r.successes, r.meanTimeToIP_ms};
+        memcpy(rec.bssid, r.bssid, sizeof(rec.bssid));
+      }
+  }
+  nvs_handle_t nvs_handle;
+  if (nvs_open(NVS_AREA_NAME.data, NVS_READWRITE, &nvs_handle) != ESP_OK)
+    return;
+  esp_err_t err =
+      nvs_set_blob(nvs_handle, STATS_NVS_KEY, records, n * sizeof(StatsRecord));
+  if (err == ESP_OK && radios == 0) {
+    err = nvs_erase_key(nvs_handle, RADIO_STATS_NVS_KEY);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+      err = ESP_OK; // nothing to erase
+  } else if (err == ESP_OK)
+    err = nvs_set_blob(nvs_handle, RADIO_STATS_NVS_KEY, radioRecords,
+                       radios * sizeof(RadioStatsRecord));
+  if (err == ESP_OK && nvs_commit(nvs_handle) == ESP_OK) {
+    statsDirty = false;
+    lastStatsSave_s = now ? now : 1;
+  }
+  nvs_close(nvs_handle);
+}
+
+bool WiFiService::APCredentialManager::getPMK(const APCredential &cred,
+                                              wifi_auth_mode_t authmode,
+                                              uint8_t pmk[PMK_LEN]) {
+  // PBKDF2 is the PSK derivation of WPA/WPA2 only: SAE derives its own key,
+  // and 64 characters are already a hex PSK
+  if ((authmode != WIFI_AUTH_WPA_PSK && authmode != WIFI_AUTH_WPA2_PSK &&
+       authmode != WIFI_AUTH_WPA_WPA2_PSK) ||
+      cred.pwdLen < 8 || cred.pwdLen > 63)
+    return false;
+  if (cachedPMK(cred, pmk))
+    return true;
+  int64_t start_us = ED_WIFI_NOW_US();
+#if MBEDTLS_VERSION_NUMBER >= 0x03030000
+  int ret = mbedtls_pkcs5_pbkdf2_hmac_ext(
+      MBEDTLS_MD_SHA1, (const unsigned char *)cred.password, cred.pwdLen,
+      (const unsigned char *)cred.ssid, cred.ssidLen, 4096, PMK_LEN, pmk);
+#else
+  mbedtls_md_context_t ctx;
+  mbedtls_md_init(&ctx);
+  int ret = mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1),
+                             1);
+  if (ret == 0)
+    ret = mbedtls_pkcs5_pbkdf2_hmac(
+        &ctx, (const unsigned char *)cred.password, cred.pwdLen,
+        (const unsigned char *)cred.ssid, cred.ssidLen, 4096, PMK_LEN, pmk);
+  mbedtls_md_free(&ctx);
+#endif
+  if (ret != 0) {
+    ESP_LOGE(TAG, "PMK derivation for {%s} failed (%d)", cred.ssid, ret);
+    return false;
+  }
+  ESP_LOGI(TAG, "PMK derived for {%s} in %u ms", cred.ssid,
+           (unsigned)((ED_WIFI_NOW_US() - start_us) / 1000));
+  seedPMK(cred, pmk);
+  savePMKs(); // once per credential: the derivation is what costs
+  return true;
+}
+
+bool WiFiService::APCredentialManager::cachedPMK(const APCredential &cred,
+                                                 uint8_t pmk[PMK_LEN]) {
+  uint32_t sh = ssidHash(cred.ssid, cred.ssidLen);
+  uint32_t ph = ssidHash(cred.password, cred.pwdLen);
+  for (const PmkEntry &e : pmkCache)
+    if (e.valid && e.ssidHash == sh && e.pwdHash == ph) {
+      memcpy(pmk, e.pmk, PMK_LEN);
+      return true;
+    }
+  return false;
+}
+
+void WiFiService::APCredentialManager::seedPMK(const APCredential &cred,
+                                               const uint8_t pmk[PMK_LEN]) {
+  PmkEntry *slot = nullptr;
+  for (PmkEntry &e : pmkCache)
+    if (!e.valid) {
+      slot = &e;
+      break;
+    }
+  if (slot == nullptr) {
+    slot = &pmkCache[pmkNext];
+    pmkNext = (pmkNext + 1) % ED_WIFI_PMK_SLOTS;
+  }
+  *slot = {ssidHash(cred.ssid, cred.ssidLen),
+           ssidHash(cred.password, cred.pwdLen), {}, true};
+  memcpy(slot->pmk, pmk, PMK_LEN);
+}
+
+void WiFiService::APCredentialManager::invalidatePMK(const APCredential &cred) {
+  uint32_t sh = ssidHash(cred.ssid, cred.ssidLen);
+  bool changed = false;
+  for (PmkEntry &e : pmkCache)
+    if (e.valid && e.ssidHash == sh) {
+      e = {};
+      changed = true;
+    }
+  if (changed)
+    savePMKs();
+}
+
+void WiFiService::APCredentialManager::loadPMKs() {
+  nvs_handle_t nvs_handle;
+  if (nvs_open(NVS_AREA_NAME.data, NVS_READONLY, &nvs_handle) != ESP_OK)
+    return;
+  size_t len = sizeof(pmkCache);
+  if (nvs_get_blob(nvs_handle, PMK_NVS_KEY, pmkCache, &len) != ESP_OK ||
+      len != sizeof(pmkCache))
+    memset(pmkCache, 0, sizeof(pmkCache)); // missing or other slot count
+  nvs_close(nvs_handle);
+}
+
+void WiFiService::APCredentialManager::savePMKs() {
+  if (!storeLoaded)
+    return; // a fast wake holds only the retained keys
+  nvs_handle_t nvs_handle;
+  if (nvs_open(NVS_AREA_NAME.data, NVS_READWRITE, &nvs_handle) != ESP_OK)
+    return;
+  if (nvs_set_blob(nvs_handle, PMK_NVS_KEY, pmkCache, sizeof(pmkCache)) ==
+      ESP_OK)
+    nvs_commit(nvs_handle);
+  nvs_close(nvs_handle);
+}
+
+void WiFiService::subscribeToIPReady(void (*callback)()) {
+  if (callback != nullptr)
+    subscribe_ip_ready({callback, nullptr, nullptr});
+}
+
+void WiFiService::subscribeToIPReady(void (*callback)(void *ctx), void *ctx) {
+  if (callback != nullptr)
+    subscribe_ip_ready({nullptr, callback, ctx});
+}
+
+void WiFiService::subscribe_ip_ready(const IPReadyCallback &callback) {
+  ESP_LOGI(TAG, " in subscribeToIPReady: subscribing");
+  for (IPReadyCallback &slot : ipReadyCallbacks) {
+    if (slot.plain != nullptr || slot.withCtx != nullptr)
+      continue;
+    slot = callback;
+    if (NetEvents::subscribe(run_ip_ready_callback, &slot,
+                             NetEvents::mask(NetEvents::Event::GotIP)) >= 0)
+      return;
+    slot = {};
+    break;
+  }
+  ESP_LOGE(TAG, " in subscribeToIPReady: no free subscriber slot");
+}
+
+void WiFiService::run_ip_ready_callback(const NetEvents::Info &info,
+                                        void *ctx) {
+  const IPReadyCallback &cb = *static_cast<const IPReadyCallback *>(ctx);
+  if (cb.plain != nullptr)
+    cb.plain();
+  else
+    cb.withCtx(cb.ctx);
+}
+
+WiFiService::NetEvents::Subscriber
+    WiFiService::NetEvents::subscribers[MAX_SUBSCRIBERS] = {};
+
+void WiFiService::NetEvents::start() {
+  // the registry lock does not exist yet: the initialization of a local
+  // static runs once, concurrent first callers wait for its end
+  static const bool started = [] {
+    lock = xSemaphoreCreateRecursiveMutexStatic(&lockBuf);
+    queue = xQueueCreateStatic(QUEUE_DEPTH, sizeof(Info), queueStorage,
+                               &queueBuf);
+    task = xTaskCreateStatic(dispatch_task, "wifi_notify", sizeof(taskStack),
+                             nullptr, ED_WIFI_NOTIFY_PRIORITY, taskStack,
+                             &taskBuf);
+    return true;
+  }();
+  (void)started;
+}
+
+int WiFiService::NetEvents::subscribe(Callback cb, void *ctx, uint8_t events,
+                                      uint8_t priority) {
+  if (cb == nullptr)
+    return -1;
+  start(); // subscribers may register before launch()
+  int handle = -1;
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; ++i) {
+    if (subscribers[i].cb != nullptr)
+      continue;
+    subscribers[i] = {cb,  ctx, events, priority,
+                      {}, (uint16_t)(subscribers[i].generation + 1)};
+    handle = i;
+    break;
+  }
+  xSemaphoreGiveRecursive(lock);
+  return handle;
 }
 
-void WiFiService::scan_wifi_networks() {
-  ESP_LOGI(TAG, "in scan_wifi_networks");
-  wifi_scan_config_t scan_config = {
-      .ssid = NULL,        // Scan all SSIDs
-      .bssid = NULL,       // Scan all BSSIDs
-      .channel = 0,        // Scan all channels
-      .show_hidden = true, // Include hidden networks
-      .scan_type = WIFI_SCAN_TYPE_ACTIVE,
-      .scan_time = {.active = {.min = 150, .max = 500}},
-      .home_chan_dwell_time = 100,
-      .channel_bitmap = 0,
-      .coex_background_scan =
-          false // a bit more aggressive, might impact bluetooth
-  };
-  // ESP_LOGI(TAG, "trying now start scan:++++++++++++++++++++++");
-  ESP_ERROR_CHECK(esp_wifi_scan_start(&scan_config, true)); // true = blocking
-  uint16_t number = 0;                                      // all channels
-  ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&number));
+bool WiFiService::NetEvents::unsubscribe(int handle) {
+  if (handle < 0 || handle >= (int)MAX_SUBSCRIBERS || lock == nullptr)
+    return false;
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  bool found = subscribers[handle].cb != nullptr;
+  subscribers[handle].cb = nullptr; // the dispatch skips it from now on
+  // waits for the call in progress, unless called from the callback itself
+  while (running == handle && xTaskGetCurrentTaskHandle() != task) {
+    waiter = xTaskGetCurrentTaskHandle();
+    xSemaphoreGiveRecursive(lock);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  }
+  xSemaphoreGiveRecursive(lock);
+  return found;
+}
 
-  wifi_ap_record_t ap_records[number];
-  ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&number, ap_records));
-  ESP_LOGI(TAG, "CALLING updateDetectedAPs WITH %d APs", number);
-  APCredentialManager::updateDetectedAPs(number, ap_records);
+bool WiFiService::NetEvents::getStats(int handle, SubscriberStats &out) {
+  if (handle < 0 || handle >= (int)MAX_SUBSCRIBERS || lock == nullptr)
+    return false;
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  bool found = subscribers[handle].cb != nullptr;
+  if (found)
+    out = subscribers[handle].stats;
+  xSemaphoreGiveRecursive(lock);
+  return found;
 }
 
-void WiFiService::APCredentialManager::updateDetectedAPs(
-    uint16_t number, wifi_ap_record_t *ap_records) {
+void WiFiService::NetEvents::post(Event event, uint8_t reason, uint32_t ip) {
+  if (queue == nullptr)
+    return;
+  Info info = {event, reason, ip};
+  if (xQueueSend(queue, &info, 0) != pdTRUE) {
+    dropped++;
+    ESP_LOGW(TAG, "network event %d dropped, subscribers lagging",
+             (int)event);
+  }
+}
 
-  if (!initialized)
-    loadDefaultAPs();
-  // const WiFiService::APCredential *filtered[maxTrackedSSIDs];
-  int filtered_count = 0;
-
-  for (uint16_t i = 0; i < number && filtered_count < maxTrackedSSIDs; ++i) {
-    // sanitizes and chops the SSID to ED_MAX_SSID_PWD_SIZE
-    char ssid_str[ED_MAX_SSID_PWD_SIZE]; // One extra byte for null terminator
-    memcpy(ssid_str, ap_records[i].ssid, ED_MAX_SSID_PWD_SIZE - 1);
-
-    ssid_str[ED_MAX_SSID_PWD_SIZE - 1] = '\0'; // Ensure null-termination
-    ESP_LOGI(TAG, "processing {%s} rssi %d", ssid_str, ap_records[i].rssi);
-    for (int j = 0; j < WiFiService::APCredentialManager::maxTrackedSSIDs;
-         ++j) {
-      const char *curTrackedSSID = WiFiService::APCredentialManager::getSSID(j);
-      if (curTrackedSSID == nullptr)
-        break;
-      if (strncmp(ssid_str, curTrackedSSID, sizeof(ssid_str)) == 0) {
-        activeSSIDs[filtered_count++] =
-            WiFiService::APCredentialManager::findAndUpdateInfo(
-                ssid_str, ap_records[i].rssi, ap_records[i].primary, j);
-        ESP_LOGI(TAG, "updateDetectedAPs matches %s with RSSI %d", ssid_str,
-                 ap_records[i].rssi);
-        break;
+void WiFiService::NetEvents::dispatch_task(void *arg) {
+  struct Call {
+    Callback cb;
+    void *ctx;
+    uint8_t slot;
+    uint16_t generation;
+  };
+  Info info;
+  while (true) {
+    if (xQueueReceive(queue, &info, portMAX_DELAY) != pdTRUE)
+      continue;
+    uint8_t bit = mask(info.event);
+    // copies the subscribers under the lock, by decreasing priority and in
+    // subscription order within a priority, then calls them without it: a
+    // slow callback does not hold back subscribe() on other tasks
+    Call calls[MAX_SUBSCRIBERS];
+    uint8_t priorities[MAX_SUBSCRIBERS];
+    size_t n = 0;
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    for (size_t i = 0; i < MAX_SUBSCRIBERS; ++i) {
+      const Subscriber &sub = subscribers[i];
+      if (sub.cb == nullptr || !(sub.events & bit))
+        continue;
+      size_t k = n++;
+      for (; k > 0 && priorities[k - 1] < sub.priority; --k) {
+        calls[k] = calls[k - 1];
+        priorities[k] = priorities[k - 1];
+      }
+      calls[k] = {sub.cb, sub.ctx, (uint8_t)i, sub.generation};
+      priorities[k] = sub.priority;
+    }
+    xSemaphoreGiveRecursive(lock);
+    for (size_t k = 0; k < n; ++k) {
+      const Call &c = calls[k];
+      Subscriber &sub = subscribers[c.slot];
+      // skips the subscribers removed by a previous callback
+      xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+      bool live = sub.cb != nullptr && sub.generation == c.generation;
+      if (live)
+        running = c.slot;
+      xSemaphoreGiveRecursive(lock);
+      if (!live)
+        continue;
+      int64_t start = ED_WIFI_NOW_US();
+      c.cb(info, c.ctx);
+      uint32_t run_us = (uint32_t)(ED_WIFI_NOW_US() - start);
+      xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+      running = -1;
+      if (waiter != nullptr) {
+        xTaskNotifyGive(waiter);
+        waiter = nullptr;
       }
+      if (sub.generation == c.generation) {
+        SubscriberStats &st = sub.stats;
+        st.calls++;
+        st.totalRun_us += run_us;
+        if (run_us > st.maxRun_us)
+          st.maxRun_us = run_us;
+      }
+      xSemaphoreGiveRecursive(lock);
+      if (run_us > SLOW_SUBSCRIBER_US)
+        ESP_LOGW(TAG, "subscriber %u took %u us on event %d",
+                 (unsigned)c.slot, run_us, (int)info.event);
     }
   }
-  activeSSIDs[filtered_count] = nullptr; // terminates the list with nullpt
-  // ESP_LOGI(TAG,"updateDetectedAPs matches %d APs",count);
-  qsort(activeSSIDs, filtered_count, sizeof(const APCredential *),
-        APCredential::compare_rssi_desc);
-}
-
-std::vector<std::function<void()>> WiFiService::ipReadyCallbacks;
-
-void WiFiService::subscribeToIPReady(std::function<void()> callback) {
-  ESP_LOGI(TAG, " in subscribeToIPReady: subscribing");
-  ipReadyCallbacks.push_back(callback);
-  ESP_LOGI(TAG,
-           " in subscribeToIPReady: subscribed ipReadyCallbacks size is %d",
-           ipReadyCallbacks.size());
 }
 
-void WiFiService::runGotIPsubscribers() {
-  ESP_LOGI(TAG, " in runGotIPsubscribers");
-  uint8_t i = 1;
-  for (auto &cb : ipReadyCallbacks) {
-    ESP_LOGI(TAG, " runGotIPsubscribers running subscriber %d", i++);
-    cb(); // Notify all subscribers
-  }
+bool WiFiService::APCredentialManager::selectAP(const char *ssid) {
+  if (!initialized)
+    loadDefaultAPs();
+  const APCredential *cred = retrieve(ssid);
+  if (cred == nullptr || cred->type != APCredential::AP_CONNECTABLE)
+    return false;
+  curAP = cred;
+  return true;
 }
 
 bool WiFiService::APCredentialManager::setNextActiveAP() {
   if (!initialized)
     loadDefaultAPs();
-  static int8_t curpos = 0;
+  size_t &curpos = nextActive;
+  // candidates detected too long ago decay out of the list
+  uint32_t now = ED_WIFI_NOW_US() / 1000000;
+  while (activeSSIDs[curpos] != nullptr &&
+         now - activeSSIDs[curpos]->lastSeen > APCredential::maxCandidateAge_s)
+    ++curpos;
   if (activeSSIDs[curpos] == nullptr) {
     curAP = nullptr;
     if (curpos == 0) {
@@ -512,16 +2468,33 @@ bool WiFiService::APCredentialManager::setNextActiveAP() {
       ESP_LOGI(TAG,
                "setNextActiveAP set to nullptr, no other AP to try (was %d of "
                "%d available)",
-               curpos + 1, count);
+               (int)curpos + 1, (int)count);
     curpos = 0; // resets to the first position
     return true;
   }
   curAP = activeSSIDs[curpos++];
-  ESP_LOGI(TAG, "curAP set to %s done, index %d of %d", curAP->ssid, curpos,
-           count);
+  ESP_LOGI(TAG, "curAP set to %s done, index %d of %d", curAP->ssid,
+           (int)curpos, (int)count);
   return true;
 }
-esp_err_t WiFiService::wifi_conn_STA() {
+void WiFiService::setStaCredentials(wifi_config_t &cfg,
+                                    wifi_auth_mode_t authmode) {
+  const APCredential *cred = APCredentialManager::curAP;
+  // the driver fields take the full 32/64 bytes without terminator
+  memcpy(cfg.sta.ssid, cred->ssid, cred->ssidLen);
+  uint8_t pmk[APCredentialManager::PMK_LEN];
+  if (APCredentialManager::getPMK(*cred, authmode, pmk)) {
+    // 64 hex digits are taken by the driver as the PSK itself
+    static constexpr char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < sizeof(pmk); ++i) {
+      cfg.sta.password[2 * i] = hex[pmk[i] >> 4];
+      cfg.sta.password[2 * i + 1] = hex[pmk[i] & 0x0F];
+    }
+  } else
+    memcpy(cfg.sta.password, cred->password, cred->pwdLen);
+}
+
+esp_err_t WiFiService::wifi_conn_STA(const APCredential::Radio *radio) {
   ESP_LOGI(TAG, "Initializing WiFi in mode: STA, curAP is %s null ",
            APCredentialManager::curAP == nullptr ? "" : "not");
 
@@ -532,12 +2505,22 @@ esp_err_t WiFiService::wifi_conn_STA() {
   }
 
   wifi_config_t sta_config = {};
-  strncpy((char *)sta_config.sta.ssid, APCredentialManager::curAP->ssid,
-          sizeof(sta_config.sta.ssid) - 1);
-  sta_config.sta.ssid[sizeof(sta_config.sta.ssid) - 1] = '\0';
-  strncpy((char *)sta_config.sta.password, APCredentialManager::curAP->password,
-          sizeof(sta_config.sta.password) - 1);
-  sta_config.sta.password[sizeof(sta_config.sta.password) - 1] = '\0';
+  setStaCredentials(sta_config, APCredentialManager::curAP->authmode);
+  // pins the strongest radio of the SSID instead of letting the driver pick
+  // one, which could be a weak extender
+  if (radio == nullptr)
+    radio = APCredentialManager::curAP->bestRadio();
+  bssidPinned = radio != nullptr;
+  if (bssidPinned) {
+    memcpy(pinnedBSSID, radio->bssid, sizeof(pinnedBSSID));
+    sta_config.sta.bssid_set = true;
+    memcpy(sta_config.sta.bssid, radio->bssid, sizeof(sta_config.sta.bssid));
+    sta_config.sta.channel = radio->chann;
+    char bssidStr[18];
+    MacAddress(radio->bssid).toString(bssidStr, sizeof(bssidStr));
+    ESP_LOGI(TAG, "pinning radio [%s] channel %d RSSI %d", bssidStr,
+             radio->chann, radio->RSSI);
+  }
 #ifdef DEBUG_BUILD
   sta_config.sta.failure_retry_cnt =
       20; //< Number of connection retries station will do before moving to next
@@ -562,7 +2545,7 @@ esp_err_t WiFiService::wifi_conn_STA() {
   return ESP_OK;
 }
 
-esp_err_t WiFiService::launch() {
+esp_err_t WiFiService::launch(LaunchMode mode) {
 
   esp_err_t ret = nvs_flash_init();
   if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
@@ -571,13 +2554,29 @@ esp_err_t WiFiService::launch() {
     ret = nvs_flash_init(); // NOTE it is ERASING flash if it fails. backup
                             // needs to be properly ensured
   }
-  ESP_ERROR_CHECK(ret);
+  ESP_ERROR_CHECK(ret); // still needed by the driver (PHY calibration data)
+  wakeMode = mode == LaunchMode::SleepWake;
+  if (wakeMode &&
+      esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED) {
+    if (!wakeRecordValid())
+      wakeRecord = {};
+    wakeRecord.stats.wakes++;
+    wakeFast = fastConnectEnabled && fastConnectValid() &&
+               wakeRecord.count > 0 &&
+               wakeRecord.failedWakes < wakeMaxFailures;
+    if (!wakeFast)
+      wakeRecord.count = 0; // drops the candidates, refreshed at the next IP
+    sealWakeRecord();
+  }
   // initializes internal components. Note. being a singleton you canNOT use the
   // constructor
   init_sta_retry_timer(); // the timer for retries to connect back to STA mode
                           // aftern network outages and switch to AP mode
                           // initiaizes the event loop
                           // 🔧 Add this line here
+  NetEvents::start(); // dispatch task of the network event subscribers
+  start_owner_task(); // from here on the state is changed by its task only
+  fsm.setTracer(trace_transition);
   esp_err_t err = esp_event_loop_create_default();
   if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
     ESP_LOGE(TAG, "Failed to create default event loop: %s",
@@ -594,6 +2593,9 @@ esp_err_t WiFiService::launch() {
   RETURN_ON_ERROR(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
                                              &event_handler, NULL),
                   TAG, "IP event reg failed");
+  RETURN_ON_ERROR(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_LOST_IP,
+                                             &event_handler, NULL),
+                  TAG, "IP lost event reg failed");
   // creates network interfaces
   if (!sta_netif) {
     sta_netif = esp_netif_create_default_wifi_sta();
@@ -601,8 +2603,10 @@ esp_err_t WiFiService::launch() {
 
   // initializes Wsifi driver
 
-  esp_wifi_stop();
-  esp_wifi_deinit();
+  if (!wakeFast) { // the driver did not survive the deep sleep
+    esp_wifi_stop();
+    esp_wifi_deinit();
+  }
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   RETURN_ON_ERROR(esp_wifi_init(&cfg), TAG, "wifi launch failed");
@@ -610,16 +2614,38 @@ esp_err_t WiFiService::launch() {
   // Initialize the reconnect timer after WiFi is initialized
   if (staRetryDelayed == nullptr) {
     staRetryDelayed =
-        xTimerCreate("ReconnectTimer", pdMS_TO_TICKS(ReconnectDelay_ms),
+        xTimerCreate("ReconnectTimer", pdMS_TO_TICKS(1000),
                      pdFALSE, NULL, reconnectCallback);
     if (staRetryDelayed == nullptr) {
       ESP_LOGE(TAG, "Failed to create reconnect timer");
     }
   }
 
-  xTaskCreate(wifi_diag_task, "wifi_diag", 6144, nullptr, 5, nullptr);
+  if (roamTimer == nullptr) {
+    roamTimer = xTimerCreate("RoamTimer",
+                             pdMS_TO_TICKS(roamConfig.checkInterval_s * 1000),
+                             pdTRUE, nullptr, roam_check_callback);
+    if (roamTimer == nullptr)
+      ESP_LOGE(TAG, "Failed to create roaming timer");
+    else
+      xTimerStart(roamTimer, 0); // idle until connected
+  }
+
+  if (historyTimer == nullptr) {
+    historyTimer = xTimerCreate("HistoryTimer",
+                                pdMS_TO_TICKS(History::SAMPLE_S * 1000), pdTRUE,
+                                nullptr, history_callback);
+    if (historyTimer == nullptr)
+      ESP_LOGE(TAG, "Failed to create history timer");
+    else
+      xTimerStart(historyTimer, 0);
+  }
 
   setHostName();
+  if (wakeFast)
+    restore_wake_record(); // NVS is read only if the scan path is needed
+  else
+    load_store();
   // scans the actual available APs and matches against stored credentials of
   // known connectable networks
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
@@ -645,6 +2671,11 @@ void WiFiService::wifi_deinit() {
     xTimerDelete(staRetryTimer, portMAX_DELAY);
     staRetryTimer = nullptr;
   }
+  if (probeTimer != nullptr) {
+    xTimerStop(probeTimer, portMAX_DELAY);
+    xTimerDelete(probeTimer, portMAX_DELAY);
+    probeTimer = nullptr;
+  }
 
   if (staRetryDelayed != nullptr) {
     xTimerStop(staRetryDelayed, portMAX_DELAY);
@@ -652,10 +2683,29 @@ void WiFiService::wifi_deinit() {
     staRetryDelayed = nullptr;
   }
 
+  if (roamTimer != nullptr) {
+    xTimerStop(roamTimer, portMAX_DELAY);
+    xTimerDelete(roamTimer, portMAX_DELAY);
+    roamTimer = nullptr;
+  }
+  if (historyTimer != nullptr) {
+    xTimerStop(historyTimer, portMAX_DELAY);
+    xTimerDelete(historyTimer, portMAX_DELAY);
+    historyTimer = nullptr;
+  }
+  if (leaseTimer != nullptr) {
+    xTimerStop(leaseTimer, portMAX_DELAY);
+    xTimerDelete(leaseTimer, portMAX_DELAY);
+    leaseTimer = nullptr;
+  }
+  WebInterfaace::stop();
+  CaptiveDNS::stop();
+
   // Unregister event handlers using the same function pointer and arg
   esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler);
 
   esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler);
+  esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_LOST_IP, &event_handler);
 
   // Stop Wi-Fi
   esp_wifi_stop();
@@ -668,6 +2718,10 @@ void WiFiService::wifi_deinit() {
     esp_netif_destroy(sta_netif);
     sta_netif = nullptr;
   }
+  if (ap_netif) {
+    esp_netif_destroy(ap_netif);
+    ap_netif = nullptr;
+  }
 
 #if CONFIG_LWIP_MDNS_RESPONDER
   mdns_free();
@@ -676,50 +2730,89 @@ void WiFiService::wifi_deinit() {
   ESP_LOGI(TAG, "Wi-Fi deinitialized and resources freed");
 }
 
-void WiFiService::wifi_diag_task(void *arg) {
-  // --- INIT SECTION ---
-  // This runs once, right when the task starts.
-  // Perfect place to do a tiny malloc/free to "register" the task
-  // with heap task tracking while heap is still plentiful.
-  ESP_LOGI(TAG, "Step_in wifi_diag_task");
-  void *p = malloc(1);
-  free(p);
-
-  while (true) {
-    wifi_ap_record_t ap_info;
-    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
-      ESP_LOGI("WiFiDiag", "Connected to %s, RSSI: %d, Channel: %d",
-               ap_info.ssid, ap_info.rssi, ap_info.primary);
-    } else {
-      ESP_LOGW("WiFiDiag", "Not connected to any AP");
-    }
+void WiFiService::history_callback(TimerHandle_t xTimer) {
+  wifi_ap_record_t ap_info;
+  int8_t rssi = esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK ? ap_info.rssi : 0;
+  uint32_t heap = esp_get_free_heap_size();
+  History::push((uint32_t)(ED_WIFI_NOW_US() / 1000000), rssi, heap);
+  ESP_LOGD(TAG, "history: RSSI %d, heap %u", rssi, heap);
+}
 
-    ESP_LOGI("WiFiDiag", "Heap: %u, Uptime: %u sec (low 32 bits)",
-             esp_get_free_heap_size(),
-             (uint32_t)(esp_timer_get_time() / 1000000));
-    static int counter = 0;
-    if (++counter >= 60) { // assuming 1Hz loop
-      ESP_LOGI(TAG, "Step_calling ed_alloc_dump_top");
-      //      ED_alloc_profiler::ed_alloc_dump_top(10);
-      counter = 0;
-    }
-#if 0
-                 // 🔹 Trigger MQTT heap snapshot
-        ED_heap_tracer::mqtt_heap_trace_snapshot_async();
-#endif
-    UBaseType_t hw = uxTaskGetStackHighWaterMark(NULL);
-    ESP_LOGI("WiFiDiag", "Stack HW mark: %u words (~%u bytes)", (unsigned)hw,
-             (unsigned)(hw * sizeof(StackType_t)));
-// 🔹 Pick interval based on mode
-#if 0
-        uint32_t interval_ms =
-            (ED_heap_tracer::get_trace_mode() == ED_heap_tracer::TraceMode::ALL)
-            ? 2000   // churn mode → 2s snapshots
-            : 60000; // leak mode → 60s snapshots
-            vTaskDelay(pdMS_TO_TICKS(interval_ms));
-#endif
-    vTaskDelay(pdMS_TO_TICKS(60000));
+void WiFiService::History::push(uint32_t now_s, int8_t rssi,
+                                uint32_t freeHeap) {
+  uint32_t heap = freeHeap / 16;
+  // encodes the sample as a delta to the previous one
+  uint8_t enc[6];
+  size_t n = 0;
+  enc[n++] = (uint8_t)(rssi - lastRSSI);
+  int32_t d = (int32_t)(heap - lastHeap);
+  uint32_t zz = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+  do {
+    enc[n] = zz & 0x7F;
+    zz >>= 7;
+    if (zz)
+      enc[n] |= 0x80;
+    ++n;
+  } while (zz);
+
+  seq.fetch_add(1, std::memory_order_acquire); // odd: ring being modified
+  Block *b = &blocks[head];
+  if (filled == 0 || b->count == UINT8_MAX ||
+      b->used + n > sizeof(b->data)) {
+    // starts a new block with the full values, dropping the oldest if needed
+    if (filled > 0)
+      head = (head + 1) % BLOCKS;
+    if (filled < BLOCKS)
+      ++filled;
+    b = &blocks[head];
+    *b = {};
+    b->start_s = now_s;
+    b->heap0 = heap;
+    b->rssi0 = rssi;
+    b->count = 1;
+  } else {
+    memcpy(b->data + b->used, enc, n);
+    b->used += n;
+    b->count++;
   }
+  lastRSSI = rssi;
+  lastHeap = heap;
+  seq.fetch_add(1, std::memory_order_release);
+}
+
+size_t WiFiService::History::read(uint8_t *buf, size_t len) {
+  size_t size;
+  uint32_t before;
+  do {
+    // retries if a sample was pushed while copying
+    while ((before = seq.load(std::memory_order_acquire)) & 1)
+      vTaskDelay(1);
+    size_t count = filled;
+    size = HEADER_SIZE + count * BLOCK_SIZE;
+    if (buf == nullptr || len < size)
+      return 0;
+    buf[0] = 'W';
+    buf[1] = 'H';
+    buf[2] = 1; // version
+    buf[3] = BLOCK_SIZE;
+    buf[4] = SAMPLE_S & 0xFF;
+    buf[5] = SAMPLE_S >> 8;
+    buf[6] = (uint8_t)count;
+    buf[7] = 0;
+    size_t oldest = (head + BLOCKS + 1 - count) % BLOCKS;
+    for (size_t i = 0; i < count; ++i)
+      memcpy(buf + HEADER_SIZE + i * BLOCK_SIZE,
+             &blocks[(oldest + i) % BLOCKS], BLOCK_SIZE);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while (seq.load(std::memory_order_relaxed) != before);
+  return size;
+}
+
+void WiFiService::History::clear() {
+  seq.fetch_add(1, std::memory_order_acquire);
+  head = 0;
+  filled = 0;
+  seq.fetch_add(1, std::memory_order_release);
 }
 
 // void WiFiService::setHostname()
@@ -746,84 +2839,490 @@ WiFiService::APCredential::toAPType(char value) {
   }
 };
 
-void WiFiService::WebInterfaace::init() {
-  httpd_handle_t server = NULL;
+// the portal page, gzip-compressed at build time and embedded in flash (see
+// CMakeLists.txt)
+extern const uint8_t portal_gz_start[] asm("_binary_portal_html_gz_start");
+extern const uint8_t portal_gz_end[] asm("_binary_portal_html_gz_end");
+
+namespace {
+// bounded JSON output: a failed write leaves ok false, the caller rolls back
+// to the last complete entry
+struct JsonWriter {
+  char *buf;
+  size_t size;
+  size_t pos;
+  bool ok;
+  void put(char c) {
+    if (ok && pos + 1 < size)
+      buf[pos++] = c;
+    else
+      ok = false;
+  }
+  void raw(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+    if (!ok)
+      return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(&buf[pos], size - pos, fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= size - pos)
+      ok = false;
+    else
+      pos += n;
+  }
+  void string(const char *s) {
+    put('"');
+    for (; *s != '\0'; ++s) {
+      unsigned char c = *s;
+      if (c == '"' || c == '\\') {
+        put('\\');
+        put(c);
+      } else if (c < 0x20)
+        raw("\\u%04x", c);
+      else
+        put(c);
+    }
+    put('"');
+  }
+};
+
+int hexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+const char *skipSpace(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    ++p;
+  return p;
+}
+
+// parses the JSON string at p, \u escapes in the ASCII range only
+// @return past the closing quote, nullptr if invalid or longer than out
+const char *parseJsonString(const char *p, char *out, size_t size) {
+  if (*p++ != '"')
+    return nullptr;
+  size_t n = 0;
+  while (*p != '"') {
+    char c = *p++;
+    if (c == '\0')
+      return nullptr;
+    if (c == '\\') {
+      switch (c = *p++) {
+      case 'b':
+        c = '\b';
+        break;
+      case 'f':
+        c = '\f';
+        break;
+      case 'n':
+        c = '\n';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'u': {
+        unsigned cp = 0;
+        for (int k = 0; k < 4; ++k) {
+          int d = hexDigit(*p++);
+          if (d < 0)
+            return nullptr;
+          cp = cp * 16 + d;
+        }
+        if (cp == 0 || cp > 0x7f)
+          return nullptr;
+        c = (char)cp;
+        break;
+      }
+      case '"':
+      case '\\':
+      case '/':
+        break;
+      default:
+        return nullptr;
+      }
+    }
+    if (n + 1 >= size)
+      return nullptr;
+    out[n++] = c;
+  }
+  out[n] = '\0';
+  return p + 1;
+}
+
+// reads {"ssid":"...","password":"..."}: other members must be strings too,
+// they are ignored
+bool parseCredential(const char *p, char *ssid, char *password) {
+  char key[16];
+  char ignored[ED_WIFI_PWD_SIZE];
+  bool gotSSID = false;
+  p = skipSpace(p);
+  if (*p++ != '{')
+    return false;
+  for (p = skipSpace(p); *p != '}'; p = skipSpace(p)) {
+    if ((p = parseJsonString(p, key, sizeof(key))) == nullptr)
+      return false;
+    p = skipSpace(p);
+    if (*p++ != ':')
+      return false;
+    p = skipSpace(p);
+    if (strcmp(key, "ssid") == 0) {
+      p = parseJsonString(p, ssid, ED_WIFI_SSID_SIZE);
+      gotSSID = true;
+    } else if (strcmp(key, "password") == 0)
+      p = parseJsonString(p, password, ED_WIFI_PWD_SIZE);
+    else
+      p = parseJsonString(p, ignored, sizeof(ignored));
+    if (p == nullptr)
+      return false;
+    p = skipSpace(p);
+    if (*p == ',')
+      ++p;
+    else if (*p != '}')
+      return false;
+  }
+  return gotSSID && ssid[0] != '\0';
+}
+
+// decodes a form or query value in place: '+' and %XX
+bool urlDecode(char *s) {
+  char *out = s;
+  for (; *s != '\0'; ++s) {
+    if (*s == '+')
+      *out++ = ' ';
+    else if (*s == '%') {
+      int hi = hexDigit(s[1]);
+      int lo = hi < 0 ? -1 : hexDigit(s[2]);
+      if (lo < 0 || (hi == 0 && lo == 0))
+        return false;
+      *out++ = (char)(hi * 16 + lo);
+      s += 2;
+    } else
+      *out++ = *s;
+  }
+  *out = '\0';
+  return true;
+}
+
+// empty (open network), WPA passphrase or 64 hex digit PSK
+bool validPassword(const char *password) {
+  size_t len = strlen(password);
+  return len == 0 || (len >= 8 && len < ED_WIFI_PWD_SIZE);
+}
+} // namespace
+
+void WiFiService::WebInterfaace::start() {
+  if (active)
+    return;
+  active = true;
+  seenCount = 0;
+  if (xTimerPendFunctionCall(server_op, nullptr, 1, pdMS_TO_TICKS(100)) !=
+      pdPASS)
+    ESP_LOGE(TAG, "portal: server start not queued");
+}
+
+void WiFiService::WebInterfaace::stop() {
+  if (!active)
+    return;
+  active = false;
+  surveyPending = false;
+  if (xTimerPendFunctionCall(server_op, nullptr, 0, pdMS_TO_TICKS(100)) !=
+      pdPASS)
+    ESP_LOGE(TAG, "portal: server stop not queued");
+}
+
+void WiFiService::WebInterfaace::server_op(void *arg, uint32_t run) {
+  if (!run) {
+    if (server != nullptr) {
+      httpd_stop(server);
+      server = nullptr;
+      ESP_LOGI(TAG, "portal stopped");
+    }
+    return;
+  }
+  if (server != nullptr)
+    return;
+  if (etag[0] == '\0')
+    snprintf(etag, sizeof(etag), "\"%08" PRIx32 "\"",
+             esp_rom_crc32_le(0, portal_gz_start,
+                              portal_gz_end - portal_gz_start));
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  esp_err_t wse = httpd_start(&server, &config);
-  ESP_LOGE(TAG, "httpd_start returns: %d", wse);
+  // up to 4 stations, browsers opening several connections each: the least
+  // recently used socket is recycled rather than refusing a new client
+  config.lru_purge_enable = true;
+  config.max_uri_handlers = 10;
+  esp_err_t err = httpd_start(&server, &config);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "portal: httpd_start failed: %s", esp_err_to_name(err));
+    server = nullptr;
+    return;
+  }
+  static const httpd_uri_t uris[] = {
+      {"/", HTTP_GET, root_get_handler, nullptr},
+      {"/set_ap", HTTP_POST, set_ap_post_handler, nullptr},
+      {"/api/networks", HTTP_GET, networks_get_handler, nullptr},
+      {"/api/networks", HTTP_POST, networks_post_handler, nullptr},
+      {"/api/networks", HTTP_DELETE, networks_delete_handler, nullptr},
+      {"/api/scan", HTTP_GET, scan_get_handler, nullptr},
+      {"/api/scan", HTTP_POST, scan_post_handler, nullptr},
+  };
+  for (const httpd_uri_t &uri : uris)
+    httpd_register_uri_handler(server, &uri);
+  httpd_register_err_handler(server, HTTPD_404_NOT_FOUND, redirect_handler);
+  ESP_LOGI(TAG, "portal started, page %u bytes gzip",
+           (unsigned)(portal_gz_end - portal_gz_start));
+}
 
-  httpd_uri_t root_uri = {.uri = "/",
-                          .method = HTTP_GET,
-                          .handler =
-                              WiFiService::WebInterfaace::root_get_handler,
-                          .user_ctx = NULL};
+void WiFiService::WebInterfaace::noteSeen(const wifi_ap_record_t &record) {
+  char ssid[ED_WIFI_SSID_SIZE];
+  memcpy(ssid, record.ssid, ED_WIFI_SSID_SIZE - 1);
+  ssid[ED_WIFI_SSID_SIZE - 1] = '\0';
+  if (ssid[0] == '\0')
+    return; // hidden network
+  // an SSID is listed once, with its strongest radio
+  size_t at = seenCount;
+  for (size_t i = 0; i < seenCount; ++i)
+    if (strcmp(seen[i].ssid, ssid) == 0) {
+      if (record.rssi <= seen[i].rssi)
+        return;
+      at = i;
+      break;
+    }
+  if (at == seenCount) {
+    if (seenCount < ED_WIFI_PORTAL_SCAN_MAX)
+      ++seenCount;
+    else if (record.rssi <= seen[seenCount - 1].rssi)
+      return;
+    at = seenCount - 1; // the weakest one is replaced
+  }
+  // keeps the list sorted by signal, strongest first
+  while (at > 0 && seen[at - 1].rssi < record.rssi) {
+    seen[at] = seen[at - 1];
+    --at;
+  }
+  SeenAP &ap = seen[at];
+  memcpy(ap.ssid, ssid, sizeof(ap.ssid));
+  ap.rssi = record.rssi;
+  ap.chann = record.primary;
+  ap.authmode = record.authmode;
+}
+
+void WiFiService::WebInterfaace::runPendingSurvey() {
+  if (!surveyPending || !active || !apFallbackActive() || scanSessionActive)
+    return;
+  surveyPending = false;
+  scan_wifi_networks(ScanPurpose::Survey);
+}
 
-  httpd_uri_t set_ap_uri = {.uri = "/set_ap",
-                            .method = HTTP_POST,
-                            .handler =
-                                WiFiService::WebInterfaace::set_ap_post_handler,
-                            .user_ctx = NULL};
-  if (wse == ESP_OK) {
-    httpd_register_uri_handler(server, &root_uri);
-    httpd_register_uri_handler(server, &set_ap_uri);
+size_t WiFiService::WebInterfaace::render(View view, char *buf, size_t size) {
+  static_assert(ED_WIFI_PORTAL_JSON_SIZE >= 256, "portal JSON buffer");
+  static constexpr size_t tail = 32; // room kept to close the document
+  JsonWriter w = {buf, size - tail, 0, true};
+  bool truncated = false;
+  uint32_t now = ED_WIFI_NOW_US() / 1000000;
+  if (view == View::Networks) {
+    w.raw("{\"networks\":[");
+    for (size_t i = 0;; ++i) {
+      const APCredential *cred = APCredentialManager::getCredential(i);
+      if (cred == nullptr)
+        break;
+      size_t mark = w.pos;
+      w.raw("%s{\"ssid\":", i ? "," : "");
+      w.string(cred->ssid);
+      w.raw(",\"connectable\":%s,\"saved\":%s,\"default\":%s",
+            cred->type == APCredential::AP_CONNECTABLE ? "true" : "false",
+            cred->persistent ? "true" : "false",
+            APCredentialManager::isDefault(*cred) ? "true" : "false");
+      // passwords are never sent back
+      if (cred->lastSeen != 0)
+        w.raw(",\"rssi\":%d,\"chann\":%u,\"seen_s\":%" PRIu32 "}", cred->RSSI,
+              cred->chann, now - cred->lastSeen);
+      else
+        w.raw(",\"rssi\":null}");
+      if (!w.ok) {
+        w.pos = mark;
+        truncated = true;
+        break;
+      }
+    }
+  } else {
+    w.raw("{\"scanning\":%s,\"networks\":[",
+          scanSessionActive || surveyPending ? "true" : "false");
+    for (size_t i = 0; i < seenCount; ++i) {
+      size_t mark = w.pos;
+      w.raw("%s{\"ssid\":", i ? "," : "");
+      w.string(seen[i].ssid);
+      w.raw(",\"rssi\":%d,\"chann\":%u,\"open\":%s,\"known\":%s}",
+            seen[i].rssi, seen[i].chann,
+            seen[i].authmode == WIFI_AUTH_OPEN ? "true" : "false",
+            APCredentialManager::lookup(seen[i].ssid) >= 0 ? "true" : "false");
+      if (!w.ok) {
+        w.pos = mark;
+        truncated = true;
+        break;
+      }
+    }
   }
+  w.size = size;
+  w.ok = true;
+  w.raw("],\"truncated\":%s}", truncated ? "true" : "false");
+  return w.pos;
 }
-esp_err_t WiFiService::WebInterfaace::root_get_handler(httpd_req_t *req) {
 
-  /*<html><body>
-  <form action="/set_ap" method="POST">
-SSID: <input type="text" name="ssid"><br>
-Password: <input type="password" name="password"><br>
-<input type="submit" value="Update">
-</form>
-</body></html>
+esp_err_t WiFiService::WebInterfaace::send_view(httpd_req_t *req, View view) {
+  size_t length = 0;
+  CommandMsg msg = {Command::PortalView};
+  msg.data.portal.buf = json;
+  msg.data.portal.size = sizeof(json);
+  msg.data.portal.length = &length;
+  msg.data.portal.view = (uint8_t)view;
+  if (!call(msg))
+    return httpd_resp_send_500(req);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, length);
+}
 
-  */
-  const char *html = "<html><body><form action=\"/set_ap\" method=\"POST\">"
-                     "SSID: <input name=\"ssid\"><br>"
-                     "Password: <input name=\"password\" type=\"password\"><br>"
-                     "<input type=\"submit\" value=\"Update\">"
-                     "</form></body></html>";
-  httpd_resp_send(req, html, HTTPD_RESP_USE_STRLEN);
-  return ESP_OK;
+esp_err_t WiFiService::WebInterfaace::send_status(httpd_req_t *req,
+                                                  const char *status,
+                                                  const char *body) {
+  httpd_resp_set_status(req, status);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, body, HTTPD_RESP_USE_STRLEN);
+}
+
+bool WiFiService::WebInterfaace::recv_body(httpd_req_t *req, char *buf,
+                                           size_t size) {
+  if (req->content_len == 0 || req->content_len >= size)
+    return false;
+  size_t received = 0;
+  while (received < req->content_len) {
+    int ret = httpd_req_recv(req, &buf[received], req->content_len - received);
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+      continue;
+    if (ret <= 0)
+      return false;
+    received += ret;
+  }
+  buf[received] = '\0';
+  return true;
+}
+
+esp_err_t WiFiService::WebInterfaace::root_get_handler(httpd_req_t *req) {
+  // the page changes with the firmware only: a revalidation costs a 304
+  char match[sizeof(etag)];
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match,
+                                  sizeof(match)) == ESP_OK &&
+      strcmp(match, etag) == 0) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, nullptr, 0);
+  }
+  httpd_resp_set_type(req, "text/html");
+  httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  // sent straight from flash, without copy
+  return httpd_resp_send(req, (const char *)portal_gz_start,
+                         portal_gz_end - portal_gz_start);
 }
 
 esp_err_t WiFiService::WebInterfaace::set_ap_post_handler(httpd_req_t *req) {
-  // Buffer to hold incoming POST data - increased size for safety
+  // form data: ssid=MySSID&password=MyPass, each character possibly encoded
+  // on 3
   char buf[512];
-  int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
-  if (ret <= 0) {
-    httpd_resp_send_500(req);
+  char ssid[3 * ED_WIFI_SSID_SIZE] = {0};
+  char password[3 * ED_WIFI_PWD_SIZE] = {0};
+  if (!recv_body(req, buf, sizeof(buf)) ||
+      httpd_query_key_value(buf, "ssid", ssid, sizeof(ssid)) != ESP_OK ||
+      !urlDecode(ssid) || ssid[0] == '\0' ||
+      strlen(ssid) >= ED_WIFI_SSID_SIZE) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid SSID");
+    return ESP_FAIL;
+  }
+  esp_err_t err =
+      httpd_query_key_value(buf, "password", password, sizeof(password));
+  if (err == ESP_ERR_NOT_FOUND)
+    password[0] = '\0'; // open network
+  else if (err != ESP_OK || !urlDecode(password) || !validPassword(password)) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid password");
     return ESP_FAIL;
   }
-
-  buf[ret] = '\0'; // Null-terminate the received data
-
-  // Extract SSID and password from form data
-  char ssid[ED_MAX_SSID_PWD_SIZE] = {0};
-  char password[ED_MAX_SSID_PWD_SIZE] = {0};
-
-  // Simple parsing (assumes format: ssid=MySSID&password=MyPass)
-  // Use width specifiers to prevent buffer overflow (ED_MAX_SSID_PWD_SIZE is
-  // 19, so max 18 chars + null)
-  sscanf(buf, "ssid=%18[^&]&password=%18s", ssid, password);
 
   ESP_LOGI("AP_CONFIG", "Received SSID: %s", ssid);
   // Do NOT log password in production - security risk
-  // ESP_LOGI("AP_CONFIG", "Received Password: %s", password);
-
-  APCredentialManager::addOrUpdate(ssid, password, true);
-  // Save to NVS
   // in case the credentials do not exists, they are saved as new AT tracked
   // in case the credential exists, they are saved as well to override the
   // firmware stored password
-  APCredentialManager::addOrUpdateToNVS(ssid, password);
+  if (APCredentialManager::addOrUpdateToNVS(ssid, password) != ESP_OK)
+    return httpd_resp_send_500(req);
   // Respond to client
   httpd_resp_send(req, "AP settings updated successfully!",
                   HTTPD_RESP_USE_STRLEN);
   return ESP_OK;
 }
 
+esp_err_t WiFiService::WebInterfaace::networks_get_handler(httpd_req_t *req) {
+  return send_view(req, View::Networks);
+}
+
+esp_err_t WiFiService::WebInterfaace::networks_post_handler(httpd_req_t *req) {
+  char body[256];
+  char ssid[ED_WIFI_SSID_SIZE] = {0};
+  char password[ED_WIFI_PWD_SIZE] = {0};
+  if (!recv_body(req, body, sizeof(body)) ||
+      !parseCredential(body, ssid, password) || !validPassword(password))
+    return send_status(req, "400 Bad Request", "{\"error\":\"invalid\"}");
+  if (APCredentialManager::addOrUpdateToNVS(ssid, password) != ESP_OK)
+    return send_status(req, "507 Insufficient Storage",
+                       "{\"error\":\"full\"}");
+  ESP_LOGI(TAG, "portal: {%s} saved", ssid);
+  return send_status(req, "200 OK", "{\"ok\":true}");
+}
+
+esp_err_t
+WiFiService::WebInterfaace::networks_delete_handler(httpd_req_t *req) {
+  char query[3 * ED_WIFI_SSID_SIZE + 8];
+  char ssid[3 * ED_WIFI_SSID_SIZE];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+      httpd_query_key_value(query, "ssid", ssid, sizeof(ssid)) != ESP_OK ||
+      !urlDecode(ssid))
+    return send_status(req, "400 Bad Request", "{\"error\":\"ssid\"}");
+  switch (APCredentialManager::erase(ssid, true)) {
+  case ESP_OK:
+    break;
+  case ESP_ERR_NOT_FOUND:
+    return send_status(req, "404 Not Found", "{\"error\":\"unknown\"}");
+  case ESP_ERR_NOT_SUPPORTED:
+    return send_status(req, "409 Conflict", "{\"error\":\"default\"}");
+  case ESP_ERR_INVALID_STATE:
+    return send_status(req, "409 Conflict", "{\"error\":\"in use\"}");
+  default:
+    return httpd_resp_send_500(req);
+  }
+  ESP_LOGI(TAG, "portal: {%s} removed", ssid);
+  return send_status(req, "200 OK", "{\"ok\":true}");
+}
+
+esp_err_t WiFiService::WebInterfaace::scan_get_handler(httpd_req_t *req) {
+  return send_view(req, View::Scan);
+}
+
+esp_err_t WiFiService::WebInterfaace::scan_post_handler(httpd_req_t *req) {
+  // the sweep takes the AP off its channel for a few seconds: answers first
+  if (!submit({Command::Survey}, 0))
+    return send_status(req, "503 Service Unavailable", "{\"error\":\"busy\"}");
+  return send_status(req, "202 Accepted", "{\"ok\":true}");
+}
+
 esp_err_t WiFiService::WebInterfaace::httpd_resp_send_500(httpd_req_t *req) {
   const char *error_msg = "500 Internal Server Error";
   httpd_resp_set_status(req, "500 Internal Server Error");
@@ -831,28 +3330,226 @@ esp_err_t WiFiService::WebInterfaace::httpd_resp_send_500(httpd_req_t *req) {
   return httpd_resp_send(req, error_msg, strlen(error_msg));
 };
 
+esp_err_t WiFiService::WebInterfaace::redirect_handler(httpd_req_t *req,
+                                                       httpd_err_code_t err) {
+  // absolute: the request was sent to the host the phone checks, resolved to
+  // the AP by the captive DNS
+  char location[24] = "/";
+  esp_netif_ip_info_t ip;
+  if (ap_netif != nullptr && esp_netif_get_ip_info(ap_netif, &ip) == ESP_OK)
+    snprintf(location, sizeof(location), "http://" IPSTR "/", IP2STR(&ip.ip));
+  httpd_resp_set_status(req, "302 Found");
+  httpd_resp_set_hdr(req, "Location", location);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, nullptr, 0);
+}
+
+void WiFiService::CaptiveDNS::start(esp_netif_t *ap) {
+  esp_netif_ip_info_t ip;
+  if (ap == nullptr || esp_netif_get_ip_info(ap, &ip) != ESP_OK) {
+    ESP_LOGE(TAG, "captive DNS: no AP address");
+    return;
+  }
+  apAddr = ip.ip.addr;
+  if (task == nullptr)
+    task = xTaskCreateStatic(dns_task, "wifi_dns", sizeof(taskStack), nullptr,
+                             ED_WIFI_DNS_PRIORITY, taskStack, &taskBuf);
+  if (task == nullptr || active.exchange(true))
+    return;
+  xTaskNotifyGive(task);
+}
+
+void WiFiService::CaptiveDNS::stop() { active = false; }
+
+void WiFiService::CaptiveDNS::dns_task(void *arg) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+      ESP_LOGE(TAG, "captive DNS: socket failed, errno %d", errno);
+      active = false;
+      continue;
+    }
+    // the socket belongs to this task: it checks every second whether to
+    // close it rather than being closed under its feet
+    struct timeval timeout = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      ESP_LOGE(TAG, "captive DNS: bind failed, errno %d", errno);
+      close(sock);
+      active = false;
+      continue;
+    }
+    ESP_LOGI(TAG, "captive DNS started");
+    answered = 0;
+    while (active) {
+      struct sockaddr_in from;
+      socklen_t fromLen = sizeof(from);
+      int len = recvfrom(sock, packet, sizeof(packet), 0,
+                         (struct sockaddr *)&from, &fromLen);
+      if (len <= 0)
+        continue; // timeout
+      size_t out = answer(packet, len, sizeof(packet), apAddr);
+      if (out > 0 && sendto(sock, packet, out, 0, (struct sockaddr *)&from,
+                            fromLen) > 0)
+        ++answered;
+    }
+    close(sock);
+    ESP_LOGI(TAG, "captive DNS stopped, %" PRIu32 " answers", answered);
+  }
+}
+
+size_t WiFiService::CaptiveDNS::answer(uint8_t *msg, size_t len, size_t size,
+                                       uint32_t addr) {
+  static constexpr size_t HEADER = 12;
+  static constexpr uint8_t RCODE_FORMERR = 1, RCODE_NOTIMP = 4;
+  // header: id, flags (2 bytes), question, answer, authority and additional
+  // counts (2 bytes each)
+  if (len < HEADER || (msg[2] & 0x80) != 0)
+    return 0; // truncated, or a response
+  uint8_t opcode = (msg[2] >> 3) & 0x0F;
+  uint16_t questions = (msg[4] << 8) | msg[5];
+  // response, authoritative, keeping the opcode and recursion desired
+  msg[2] = 0x80 | (msg[2] & 0x79) | 0x04;
+  msg[3] = 0x80; // recursion available, no error
+  memset(&msg[4], 0, HEADER - 4);
+  if (opcode != 0 || questions != 1) {
+    msg[3] |= opcode != 0 ? RCODE_NOTIMP : RCODE_FORMERR;
+    return HEADER;
+  }
+  // the question is kept as is, the records after it (e.g. EDNS) dropped
+  size_t pos = HEADER;
+  while (pos < len && msg[pos] != 0) {
+    if ((msg[pos] & 0xC0) != 0) { // no compression in a question
+      msg[3] |= RCODE_FORMERR;
+      return HEADER;
+    }
+    pos += msg[pos] + 1;
+  }
+  if (pos + 5 > len) {
+    msg[3] |= RCODE_FORMERR;
+    return HEADER;
+  }
+  uint16_t qtype = (msg[pos + 1] << 8) | msg[pos + 2];
+  uint16_t qclass = (msg[pos + 3] << 8) | msg[pos + 4];
+  pos += 5;
+  msg[5] = 1; // question count
+  // other types (e.g. AAAA) get an empty answer, so that the client falls
+  // back to IPv4 at once
+  if (qtype != 1 || qclass != 1 || pos + 16 > size)
+    return pos;
+  msg[7] = 1; // answer count
+  const uint8_t record[] = {
+      0xC0, HEADER, // name: pointer to the question
+      0, 1,         // type A
+      0, 1,         // class IN
+      (uint8_t)(TTL_S >> 24), (uint8_t)(TTL_S >> 16), (uint8_t)(TTL_S >> 8),
+      (uint8_t)TTL_S,
+      0, 4 // address length
+  };
+  memcpy(&msg[pos], record, sizeof(record));
+  memcpy(&msg[pos + sizeof(record)], &addr, 4);
+  return pos + sizeof(record) + 4;
+}
+
 bool WiFiService::APCredentialManager::addOrUpdate(const char *ssid,
                                                    const char *password,
                                                    bool canConnect) {
-  for (size_t i = 0; i < count; ++i) {
-    if (credentials[i].matches(ssid)) {
-      strncpy(credentials[i].password, password,
-              sizeof(credentials[i].password) - 1);
-      credentials[i].password[sizeof(credentials[i].password) - 1] = '\0';
-
-      credentials[i].type = canConnect ? APCredential::APType::AP_CONNECTABLE
-                                       : APCredential::APType::AP_UNCONNECTABLE;
-
-      return true; // Updated
+  if (!onOwnerTask()) {
+    // the credentials belong to the ED_wifi task: runs there and waits
+    CommandMsg msg = {Command::AddCredential};
+    strncpy(msg.data.credential.ssid, ssid,
+            sizeof(msg.data.credential.ssid) - 1);
+    strncpy(msg.data.credential.password, password,
+            sizeof(msg.data.credential.password) - 1);
+    msg.data.credential.canConnect = canConnect;
+    bool result = false;
+    msg.result = &result;
+    return call(msg) && result;
+  }
+  if (!initialized)
+    loadDefaultAPs();
+  size_t ssidLen = strnlen(ssid, ED_WIFI_SSID_SIZE);
+  size_t pwdLen = strnlen(password, ED_WIFI_PWD_SIZE);
+  if (ssidLen >= ED_WIFI_SSID_SIZE || pwdLen >= ED_WIFI_PWD_SIZE) {
+    ESP_LOGE(TAG, "credential {%.32s} rejected: SSID or password too long",
+             ssid);
+    return false;
+  }
+  int i = lookup(ssid);
+  if (i >= 0) {
+    APCredential &cred = credentials[i];
+    if (cred.pwdLen != pwdLen || memcmp(cred.password, password, pwdLen) != 0) {
+      // the former password is left in the arena until the next compaction
+      if (!reserve(pwdLen + 1))
+        return false;
+      invalidatePMK(cred);
+      cred.password = store(password, pwdLen);
+      cred.pwdLen = pwdLen;
     }
+    cred.type = canConnect ? APCredential::APType::AP_CONNECTABLE
+                           : APCredential::APType::AP_UNCONNECTABLE;
+
+    return true; // Updated
   }
 
-  if (count >= maxTrackedSSIDs)
+  if (count >= maxTrackedSSIDs || !reserve(ssidLen + 1 + pwdLen + 1))
     return false; // No space
 
-  credentials[count++] = APCredential(ssid, password, canConnect);
+  const char *s = store(ssid, ssidLen);
+  credentials[count] = APCredential(s, store(password, pwdLen), canConnect);
+  indexInsert(count++);
   return true; // Added
 }
+
+bool WiFiService::APCredentialManager::reserve(size_t bytes) {
+  if (arenaUsed + bytes > sizeof(arena))
+    compactArena();
+  if (arenaUsed + bytes <= sizeof(arena))
+    return true;
+  ESP_LOGE(TAG, "credential arena full (%u bytes)", (unsigned)sizeof(arena));
+  return false;
+}
+
+const char *WiFiService::APCredentialManager::store(const char *s,
+                                                    size_t len) {
+  if (len == 0)
+    return ""; // no arena space for empty passwords
+  char *copy = arena + arenaUsed;
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  arenaUsed += len + 1;
+  return copy;
+}
+
+void WiFiService::APCredentialManager::compactArena() {
+  // the strings still referenced, in arena order
+  const char **live[2 * maxTrackedSSIDs];
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (inArena(credentials[i].ssid))
+      live[n++] = &credentials[i].ssid;
+    if (inArena(credentials[i].password))
+      live[n++] = &credentials[i].password;
+  }
+  std::sort(live, live + n,
+            [](const char **a, const char **b) { return *a < *b; });
+  size_t used = 0;
+  for (size_t k = 0; k < n; ++k) {
+    size_t len = strlen(*live[k]) + 1;
+    if (*live[k] != arena + used)
+      memmove(arena + used, *live[k], len);
+    *live[k] = arena + used;
+    used += len;
+  }
+  ESP_LOGD(TAG, "credential arena compacted: %u -> %u bytes",
+           (unsigned)arenaUsed, (unsigned)used);
+  arenaUsed = used;
+}
 /*
     bool WiFiService::APCredentialManager::packCredential( //TODO manage also
    the parameter of connection enabled. want to be able to configure and save
@@ -888,73 +3585,208 @@ bool WiFiService::APCredentialManager::addOrUpdate(const char *ssid,
 esp_err_t
 WiFiService::APCredentialManager::addOrUpdateToNVS(const char *ssid,
                                                    const char *password) {
-  ED_NVS::NVSdataUnit wifiCred(NVS_AREA_NAME.data, ssid, password);
-  return ED_NVS::NVSstorage::writeData(wifiCred);
+  if (!onOwnerTask()) {
+    CommandMsg msg = {Command::AddCredential};
+    strncpy(msg.data.credential.ssid, ssid,
+            sizeof(msg.data.credential.ssid) - 1);
+    strncpy(msg.data.credential.password, password,
+            sizeof(msg.data.credential.password) - 1);
+    msg.data.credential.canConnect = true;
+    msg.data.credential.persist = true;
+    bool result = false;
+    msg.result = &result;
+    return call(msg) && result ? ESP_OK : ESP_ERR_NO_MEM;
+  }
+  load_store(); // the blob is rewritten from the full list
+  if (!addOrUpdate(ssid, password, true))
+    return ESP_ERR_NO_MEM;
+  credentials[lookup(ssid)].persistent = true;
+  scheduleCredentialSave();
+  return ESP_OK;
+}
 
-  /*
-          // Initialize NVS
-          esp_err_t err = nvs_flash_init();
-          if (err == ESP_ERR_NVS_NO_FREE_PAGES ||
-              err == ESP_ERR_NVS_NEW_VERSION_FOUND)
-          {
-              ESP_RETURN_ON_ERROR(err, TAG,
-                                  "NVS error: %s. Manual recovery may be
-     needed.", esp_err_to_name(err));
-              // Optionally: enter safe mode or notify user
-          }
-
-          ESP_ERROR_CHECK(err);
-
-          // Open NVS handle in read-write mode
-          nvs_handle_t nvs_handle;
-          err = nvs_open(NVS_STORAGE_KEY, NVS_READWRITE, &nvs_handle);
-          if (err != ESP_OK)
-              return err;
-
-          unsigned char i = 0;
-          char          ssid_key[9]; //, pass_key[9];
-          bool          SSIDalreadyInNVS = false;
-          // scans the stored SSID credential to try and locat a matching one
-          while (true)
-          {
-              snprintf(ssid_key, sizeof(ssid_key), "ssid_%u", i);
-              // snprintf(pass_key, sizeof(pass_key), "spwd_%u", i);
-
-              char   nvs_ssid[ED_MAX_SSID_PWD_SIZE];
-              size_t ssid_len = sizeof(nvs_ssid);
-
-              if (nvs_get_str(nvs_handle, ssid_key, nvs_ssid, &ssid_len) !=
-                      ESP_OK ||               // reached end of storage and no
-     matching SSID found strcmp(nvs_ssid, ssid) == 0 // matching SSID
-              )
-                  break; //  i set to the new entry index in case it needs
-     adding or
-                         //  matching
-
-              // Write SSID and password. if SSID already exists, it will be
-     overwritten
-              // safely as per documentation
-              err = nvs_set_str(nvs_handle, ssid_key, ssid);
-              ESP_RETURN_ON_ERROR(err, TAG,
-                                  "Could not save SSID to NVS for key %s, SSID
-     {%s}", ssid_key, ssid);
-
-              err = nvs_set_str(nvs_handle, pass_key, password);
-              ESP_RETURN_ON_ERROR(err, TAG,
-                                  "Could not save password to NVS for key %s,
-     SSID {%s}", ssid_key, ssid);
-
-              // Commit changes
-              err = nvs_commit(nvs_handle);
-              ESP_RETURN_ON_ERROR(err, TAG, "Could not save commit SSID changes
-     to NVS");
-
-              // Close handle
-              nvs_close(nvs_handle);
-              return ESP_OK;
-
-              */
-};
+void WiFiService::APCredentialManager::scheduleCredentialSave() {
+  credDirty = true;
+  if (credSaveTimer == nullptr)
+    credSaveTimer = xTimerCreate("CredSaveTimer",
+                                 pdMS_TO_TICKS(credSaveDelay_ms), pdFALSE,
+                                 nullptr, cred_save_callback);
+  // restarting the timer at each change coalesces a burst in one write
+  if (credSaveTimer == nullptr || xTimerReset(credSaveTimer, 0) != pdPASS)
+    flushCredentials();
+}
+
+void WiFiService::APCredentialManager::cred_save_callback(TimerHandle_t xTimer) {
+  submit({Command::SaveCredentials}, 0);
+}
+
+esp_err_t WiFiService::APCredentialManager::flushCredentials() {
+  if (!credDirty)
+    return ESP_OK;
+  if (credLoadIncomplete) {
+    ESP_LOGE(TAG, "credential blob not rewritten: it holds credentials "
+                  "which could not be loaded");
+    return ESP_ERR_INVALID_STATE;
+  }
+  size_t size = sizeof(CredBlobHeader);
+  for (size_t i = 0; i < count; ++i)
+    if (credentials[i].persistent)
+      size += 3 + credentials[i].ssidLen + credentials[i].pwdLen;
+  std::vector<uint8_t> blob(size); // sized to the content
+  CredBlobHeader header = {CRED_MAGIC, CRED_VERSION, 0, 0, 0};
+  size_t pos = sizeof(header);
+  for (size_t i = 0; i < count; ++i) {
+    const APCredential &cred = credentials[i];
+    if (!cred.persistent)
+      continue;
+    blob[pos++] = cred.type == APCredential::AP_CONNECTABLE ? 1 : 0;
+    blob[pos++] = cred.ssidLen;
+    blob[pos++] = cred.pwdLen;
+    memcpy(&blob[pos], cred.ssid, cred.ssidLen);
+    pos += cred.ssidLen;
+    memcpy(&blob[pos], cred.password, cred.pwdLen);
+    pos += cred.pwdLen;
+    header.count++;
+  }
+  header.length = pos - sizeof(header);
+  header.crc = esp_rom_crc32_le(0, &blob[sizeof(header)], header.length);
+  memcpy(blob.data(), &header, sizeof(header));
+
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(NVS_AREA_NAME.data, NVS_READWRITE, &nvs_handle);
+  if (err != ESP_OK)
+    return err;
+  err = nvs_set_blob(nvs_handle, CRED_NVS_KEY, blob.data(), pos);
+  if (err == ESP_OK)
+    err = nvs_commit(nvs_handle);
+  nvs_close(nvs_handle);
+  if (err == ESP_OK) {
+    credDirty = false;
+    ESP_LOGI(TAG, "%u credentials saved (%u bytes)", header.count,
+             (unsigned)pos);
+  } else
+    ESP_LOGE(TAG, "credentials not saved: %s", esp_err_to_name(err));
+  return err;
+}
+
+bool WiFiService::APCredentialManager::restore(const char *ssid,
+                                               const char *password,
+                                               bool canConnect) {
+  if (!addOrUpdate(ssid, password, canConnect))
+    return false;
+  credentials[lookup(ssid)].persistent = true;
+  return true;
+}
+
+esp_err_t WiFiService::APCredentialManager::loadCredentials() {
+  if (!initialized)
+    loadDefaultAPs();
+  std::vector<uint8_t> blob;
+  size_t len = 0;
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(NVS_AREA_NAME.data, NVS_READONLY, &nvs_handle);
+  if (err == ESP_OK) {
+    // the first call gets the size, the blob is then read at once
+    err = nvs_get_blob(nvs_handle, CRED_NVS_KEY, nullptr, &len);
+    if (err == ESP_OK && len <= credBlobMax) {
+      blob.resize(len);
+      err = nvs_get_blob(nvs_handle, CRED_NVS_KEY, blob.data(), &len);
+    }
+    nvs_close(nvs_handle);
+  }
+  if (err == ESP_ERR_NVS_NOT_FOUND) {
+    // first boot with the blob format: imports the previous storage, if any
+    if (importLegacyCredentials() > 0)
+      flushCredentials();
+    return ESP_OK;
+  }
+  if (err != ESP_OK)
+    return rejectCredentialBlob(err, "not readable");
+  CredBlobHeader header;
+  if (len < sizeof(header) || len > credBlobMax)
+    return rejectCredentialBlob(ESP_ERR_INVALID_SIZE, "unexpected size");
+  memcpy(&header, blob.data(), sizeof(header));
+  if (header.magic != CRED_MAGIC || header.version != CRED_VERSION)
+    return rejectCredentialBlob(ESP_ERR_INVALID_VERSION, "unknown format");
+  if (sizeof(header) + header.length != len ||
+      esp_rom_crc32_le(0, &blob[sizeof(header)], header.length) != header.crc)
+    return rejectCredentialBlob(ESP_ERR_INVALID_CRC, "corrupted");
+  const uint8_t *p = &blob[sizeof(header)];
+  const uint8_t *end = p + header.length;
+  uint8_t dropped = 0;
+  for (uint8_t n = 0; n < header.count; ++n) {
+    if (end - p < 3 || p[1] >= ED_WIFI_SSID_SIZE || p[2] >= ED_WIFI_PWD_SIZE ||
+        end - p < 3 + p[1] + p[2])
+      return rejectCredentialBlob(ESP_ERR_INVALID_SIZE, "truncated record");
+    char ssid[ED_WIFI_SSID_SIZE] = {};
+    char password[ED_WIFI_PWD_SIZE] = {};
+    memcpy(ssid, p + 3, p[1]);
+    memcpy(password, p + 3 + p[1], p[2]);
+    if (!restore(ssid, password, p[0] & 1))
+      ++dropped;
+    p += 3 + p[1] + p[2];
+  }
+  if (dropped > 0) {
+    credLoadIncomplete = true;
+    ESP_LOGE(TAG,
+             "credential blob: %u of %u credentials not restored, the blob "
+             "is kept as is",
+             dropped, header.count);
+    return ESP_ERR_NO_MEM;
+  }
+  ESP_LOGI(TAG, "%u credentials loaded from NVS", header.count);
+  return ESP_OK;
+}
+
+esp_err_t
+WiFiService::APCredentialManager::rejectCredentialBlob(esp_err_t err,
+                                                       const char *why) {
+  credLoadIncomplete = true;
+  ESP_LOGE(TAG, "credential blob: %s (%s), kept as is and not rewritten", why,
+           esp_err_to_name(err));
+  return err;
+}
+
+size_t WiFiService::APCredentialManager::importLegacyCredentials() {
+  size_t imported = 0;
+  // ssid_N/spwd_N pairs of the WFC namespace
+  nvs_handle_t nvs_handle;
+  if (nvs_open(NVS_STORAGE_KEY, NVS_READONLY, &nvs_handle) == ESP_OK) {
+    char ssid_key[9], pass_key[9];
+    for (unsigned i = 0;; ++i) {
+      snprintf(ssid_key, sizeof(ssid_key), "ssid_%u", i);
+      snprintf(pass_key, sizeof(pass_key), "spwd_%u", i);
+      char ssid[ED_WIFI_SSID_SIZE], password[ED_WIFI_PWD_SIZE];
+      size_t ssid_len = sizeof(ssid), pass_len = sizeof(password);
+      if (nvs_get_str(nvs_handle, ssid_key, ssid, &ssid_len) != ESP_OK ||
+          nvs_get_str(nvs_handle, pass_key, password, &pass_len) != ESP_OK)
+        break;
+      imported += restore(ssid, password, true);
+    }
+    nvs_close(nvs_handle);
+  }
+  // SSID/password strings written through ED_NVS in NVS_AREA_NAME
+  if (nvs_open(NVS_AREA_NAME.data, NVS_READONLY, &nvs_handle) == ESP_OK) {
+    nvs_iterator_t it = nullptr;
+    esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, NVS_AREA_NAME.data,
+                                   NVS_TYPE_STR, &it);
+    while (res == ESP_OK) {
+      nvs_entry_info_t info;
+      nvs_entry_info(it, &info);
+      char password[ED_WIFI_PWD_SIZE];
+      size_t pass_len = sizeof(password);
+      if (nvs_get_str(nvs_handle, info.key, password, &pass_len) == ESP_OK)
+        imported += restore(info.key, password, true);
+      res = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+    nvs_close(nvs_handle);
+  }
+  if (imported > 0)
+    ESP_LOGI(TAG, "%u credentials imported from the previous NVS format",
+             (unsigned)imported);
+  return imported;
+}
 
 esp_err_t WiFiService::APCredentialManager::loadFromNVS() {
   nvs_handle_t nvs_handle;
@@ -970,7 +3802,7 @@ esp_err_t WiFiService::APCredentialManager::loadFromNVS() {
     snprintf(ssid_key, sizeof(ssid_key), "ssid_%u", i);
     snprintf(pass_key, sizeof(pass_key), "spwd_%u", i);
 
-    char nvs_ssid[ED_MAX_SSID_PWD_SIZE], nvs_password[ED_MAX_SSID_PWD_SIZE];
+    char nvs_ssid[ED_WIFI_SSID_SIZE], nvs_password[ED_WIFI_PWD_SIZE];
     size_t ssid_len = sizeof(nvs_ssid), pass_len = sizeof(nvs_password);
 
     if (nvs_get_str(nvs_handle, ssid_key, nvs_ssid, &ssid_len) != ESP_OK ||
@@ -1000,7 +3832,12 @@ std::optional<WiFiService::CurrentAPInfo> WiFiService::getCurrentAPInfo() {
 }
 
 void WiFiService::forceReconnect() {
+  submit({Command::ForceReconnect}, portMAX_DELAY);
+}
+
+void WiFiService::force_reconnect() {
   ESP_LOGW(TAG, "forceReconnect() called – forcing WiFi reconnection");
+  transition(ConnectionFsm::Input::Stop);
 
   // Stop any pending retry timers
   if (staRetryTimer) {
@@ -1009,31 +3846,31 @@ void WiFiService::forceReconnect() {
   if (staRetryDelayed) {
     xTimerStop(staRetryDelayed, 0);
   }
+  if (probeTimer) {
+    xTimerStop(probeTimer, 0);
+  }
 
   // Reset retry counters
   s_retry_num = 0;
+  retryBackoff.reset();
+  apBackoff.reset();
+
+  // the interrupted flows: a late SCAN_DONE is ignored, a roam or a fast
+  // connect in progress is abandoned, not counted as failed
+  scanSessionActive = false;
+  roamStage = RoamStage::Idle;
+  fastConnectPending = false;
+  attemptPending = false;
 
-  // If currently in AP mode, switch back to STA mode
   wifi_mode_t mode;
-  esp_wifi_get_mode(&mode);
-  if (mode == WIFI_MODE_AP || mode == WIFI_MODE_APSTA) {
+  if (esp_wifi_get_mode(&mode) == ESP_OK &&
+      (mode == WIFI_MODE_AP || mode == WIFI_MODE_APSTA))
     ESP_LOGI(TAG, "Currently in AP mode, switching to STA");
-    esp_wifi_stop();
-    esp_wifi_set_mode(WIFI_MODE_STA);
-    esp_wifi_start();
-  } else {
-    // Already in STA mode – disconnect and reconnect
+  else
     esp_wifi_disconnect();
-  }
-
-  // Force a new scan and connection attempt
-  // The event handler will trigger scan on WIFI_EVENT_STA_START, but since we
-  // might not have stopped the interface, we need to ensure a fresh start.
-  // Simplest: stop and restart STA
-  esp_wifi_stop();
-  esp_wifi_set_mode(WIFI_MODE_STA);
-  esp_wifi_start(); // This will generate WIFI_EVENT_STA_START and then
-                    // SCAN_DONE
+  // stops the portal of an AP fallback, then restarts the STA: a new scan
+  // and connection attempt on WIFI_EVENT_STA_START
+  restart_sta();
 }
 
 } // namespace ED_wifi
\ No newline at end of file
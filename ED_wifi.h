@@ -2,18 +2,23 @@
 #pragma once
 
 #include "ED_nvs.h"
+#include "ED_wifi_fsm.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <esp_err.h>
 #include <esp_event_base.h>
 #include <esp_http_server.h>
-#include <functional>
 #include <optional>
 #include <secrets.h>
 #include <string>
@@ -27,7 +32,85 @@
  * - we failed to connect after the maximum amount of retries */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT BIT1
-#define ED_MAX_SSID_PWD_SIZE 19
+#define ED_WIFI_SSID_SIZE 33 // 802.11 limit of 32 bytes + terminator
+#define ED_WIFI_PWD_SIZE 65  // WPA2 passphrase (63) or hex PSK (64) + terminator
+// former common limit of SSID and password, kept for source compatibility
+#define ED_MAX_SSID_PWD_SIZE ED_WIFI_PWD_SIZE
+#ifndef ED_WIFI_MAX_CREDENTIALS
+// credentials tracked at runtime: firmware defaults, NVS overrides and the
+// SSIDs monitored for interference
+#define ED_WIFI_MAX_CREDENTIALS 10
+#endif
+#ifndef ED_WIFI_PMK_SLOTS
+// WPA2 PMKs kept precomputed, for the networks connected most recently
+#define ED_WIFI_PMK_SLOTS 4
+#endif
+#ifndef ED_WIFI_WAKE_CANDIDATES
+// ranked APs retained in RTC memory across deep sleep, tried in order on wake
+#define ED_WIFI_WAKE_CANDIDATES 3
+#endif
+#ifndef ED_WIFI_LEASE_SLOTS
+// DHCP leases recorded, one per network connected most recently
+#define ED_WIFI_LEASE_SLOTS 4
+#endif
+#ifndef ED_WIFI_PORTAL_SCAN_MAX
+// networks in range listed by the provisioning portal, strongest first
+#define ED_WIFI_PORTAL_SCAN_MAX 16
+#endif
+#ifndef ED_WIFI_PORTAL_JSON_SIZE
+// buffer of the JSON answers of the provisioning portal
+#define ED_WIFI_PORTAL_JSON_SIZE 2048
+#endif
+#ifndef ED_WIFI_DNS_PRIORITY
+// captive DNS responder, below the application tasks
+#define ED_WIFI_DNS_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
+#ifndef ED_WIFI_DNS_STACK
+#define ED_WIFI_DNS_STACK 3072
+#endif
+#ifndef ED_WIFI_CRED_ARENA_SIZE
+// bytes of the pool holding the SSID and password strings added at runtime,
+// each one sized to its content. The firmware defaults are not copied. The
+// default has room for every slot holding full-length strings; a smaller
+// pool saves RAM when the SSIDs and passwords are short, additions then fail
+// once it is full.
+#define ED_WIFI_CRED_ARENA_SIZE                                               \
+  (ED_WIFI_MAX_CREDENTIALS * (ED_WIFI_SSID_SIZE + ED_WIFI_PWD_SIZE))
+#endif
+#ifndef ED_WIFI_NOW_US
+// monotonic clock (us) of all the ED_wifi timing: a host harness can map it to
+// a virtual clock, to replay connection scenarios deterministically and in
+// accelerated time
+#define ED_WIFI_NOW_US() esp_timer_get_time()
+#endif
+#ifndef ED_WIFI_RANDOM
+// source of the backoff jitter, can be made deterministic off-target
+#define ED_WIFI_RANDOM() esp_random()
+#endif
+#ifndef ED_WIFI_MAX_SUBSCRIBERS
+#define ED_WIFI_MAX_SUBSCRIBERS 8 // network event subscribers
+#endif
+#ifndef ED_WIFI_NOTIFY_STACK
+#define ED_WIFI_NOTIFY_STACK 4096 // stack of the subscriber dispatch task
+#endif
+#ifndef ED_WIFI_NOTIFY_PRIORITY
+// subscriber dispatch task, below the ED_wifi owner task
+#define ED_WIFI_NOTIFY_PRIORITY 5
+#endif
+#ifndef ED_WIFI_TASK_CORE
+#define ED_WIFI_TASK_CORE tskNO_AFFINITY // core of the ED_wifi owner task
+#endif
+#ifndef ED_WIFI_TASK_PRIORITY
+#define ED_WIFI_TASK_PRIORITY 6
+#endif
+#ifndef ED_WIFI_TASK_STACK
+#define ED_WIFI_TASK_STACK 4096
+#endif
+#ifndef ED_WIFI_HISTORY_BLOCKS
+// 64-byte blocks of RSSI/heap history, ~20 samples each: 64 blocks (4 KB)
+// hold about 20 hours at one sample per minute
+#define ED_WIFI_HISTORY_BLOCKS 64
+#endif
 // #define EXAMPLE_H2E_IDENTIFIER 0 // Define the EXAMPLE_H2E_IDENTIFIER constan
 
 /*
@@ -42,6 +125,17 @@ to be defined in secrets.h Specify in sequence SSID, password,  U or u or 0
 
 namespace ED_wifi {
 
+/**
+ * @brief size of an open-addressed table holding n entries: the smallest power
+ * of two not below 2n, keeping the load factor at or below 50%
+ */
+constexpr size_t hashTableSize(size_t n) {
+  size_t size = 1;
+  while (size < 2 * n)
+    size <<= 1;
+  return size;
+}
+
 // A memory-efficient class for ESP32.
 // It avoids dynamic allocation and complex libraries.
 class MacAddress {
@@ -83,7 +177,7 @@ public:
 static void forceReconnect();
 
   struct CurrentAPInfo {
-    char ssid[ED_MAX_SSID_PWD_SIZE];
+    char ssid[ED_WIFI_SSID_SIZE];
     int8_t rssi;
   };
 
@@ -104,23 +198,146 @@ static void forceReconnect();
                            // interfere with own ops.
     };
     /**
-     * @brief compares AP based on the strength of their signal
+     * @brief compares AP based on the strength of their signal, as ranked by
+     * the latest scan session (smoothed and aged estimate)
      * @param a
      * @param b
      * @return positive is the signal of a is stronger than the one of b
      */
     static int compare_rssi_desc(const void *a, const void *b);
+    /**
+     * @brief blends a new RSSI sample into a smoothed estimate (EWMA, weight
+     * 1/4 to the new sample). An estimate older than estimateReset_s is
+     * replaced by the sample.
+     * @param est_q4 current estimate in dBm * 16
+     * @param lastSeen timestamp in seconds of the estimate, 0 if none
+     * @param sample the new RSSI sample
+     * @param now timestamp in seconds
+     * @return the new estimate in dBm * 16
+     */
+    static int16_t smoothRSSI(int16_t est_q4, uint32_t lastSeen, int8_t sample,
+                              uint32_t now);
+    /**
+     * @brief ages a smoothed estimate: past a grace period the signal is
+     * considered lost by 1 dB every decayPeriod_s
+     * @param est_q4 estimate in dBm * 16
+     * @param lastSeen timestamp in seconds of the estimate
+     * @param now timestamp in seconds
+     * @return the aged estimate in dBm
+     */
+    static int8_t agedRSSI(int16_t est_q4, uint32_t lastSeen, uint32_t now);
+    static constexpr uint32_t estimateReset_s = 300;
+    static constexpr uint32_t decayGrace_s = 30;
+    static constexpr uint32_t decayPeriod_s = 10;
+    static constexpr uint32_t maxCandidateAge_s =
+        600; // older detections are no longer connection candidates
     static std::optional<APType> toAPType(char value);
 
-    char ssid[ED_MAX_SSID_PWD_SIZE];     // the SSID of the Access Point
-    char password[ED_MAX_SSID_PWD_SIZE]; // the password to access the SSID
+    const char *ssid;     // the SSID of the Access Point
+    const char *password; // the password to access the SSID
+    uint8_t ssidLen;
+    uint8_t pwdLen;
     APType type;   // the type of AP: Connectable or Unconnectable
     int8_t RSSI;   // the latest measured value of the signal strength in dB
     uint8_t chann; // the channel of the SSID
     uint32_t
         lastSeen; // timestamp in seconds of the last time the SSID was detected
+    /**
+     * @brief a specific radio (BSSID) broadcasting the SSID: several
+     * extenders of the same network share the SSID
+     */
+    struct Radio {
+      uint8_t bssid[6];
+      int8_t RSSI;       // latest signal strength of this radio in dB
+      int16_t RSSIest;   // smoothed signal strength in dBm * 16
+      uint8_t chann;     // channel of this radio
+      bool failed;       // connection failed, skipped until detected again
+      uint32_t lastSeen; // timestamp in seconds, 0 if not detected since boot
+      // connection history of this radio, persisted across reboots: an
+      // extender can fail or be slow where the other radios of the SSID work
+      uint8_t attempts;         // attempts pinned to this radio
+      uint8_t successes;        // of which obtained an IP
+      uint16_t meanTimeToIP_ms; // moving average of the time-to-IP
+      /**
+       * @brief an entry holding neither a detection nor a history
+       */
+      bool unused() const { return lastSeen == 0 && attempts == 0; }
+    };
+    static constexpr size_t maxRadios = 4;
+    static constexpr uint32_t radioFreshness_s =
+        120; // radios not seen for longer are not used to pin the connection
+    Radio radios[maxRadios];
+    uint16_t detectedInSession; // scan session which last detected the SSID
+    int8_t rank; // score at the end of the latest scan session, the sort key
+                 // of the active AP
+    bool persistent; // added or overridden at runtime, saved in the NVS blob
+    wifi_auth_mode_t authmode; // security of the latest detection,
+                               // WIFI_AUTH_MAX if never detected
+    /**
+     * @brief connection history of the SSID, learned across attempts and
+     * persisted across reboots
+     */
+    struct ConnStats {
+      uint16_t attempts;        // connection attempts launched
+      uint16_t successes;       // attempts which obtained an IP
+      uint16_t meanTimeToIP_ms; // moving average of the time-to-IP
+      uint8_t authFailures;     // recent auth/handshake failures, decays on
+                                // success
+      uint8_t lastReason;       // latest disconnect reason
+    };
+    ConnStats stats;
 
+    /**
+     * @brief the strings are not copied: they must outlive the credential
+     * (firmware literals or the arena of APCredentialManager)
+     */
     APCredential(const char *s, const char *p, bool canConnect);
+    /**
+     * @brief records the detection of one of the radios broadcasting the SSID.
+     * When the table is full, the least recently seen radio is replaced.
+     * @param bssid
+     * @param rssi
+     * @param chann
+     * @param now timestamp in seconds
+     */
+    void updateRadio(const uint8_t bssid[6], int8_t rssi, uint8_t chann,
+                     uint32_t now);
+    /**
+     * @brief gets the best ranked radio recently detected which did not fail
+     * (see radioScore)
+     * @return nullptr if none is available
+     */
+    const Radio *bestRadio() const;
+    /**
+     * @brief ranks a radio of the SSID: its smoothed and aged signal, lowered
+     * by its own association success rate and time-to-IP, or by the ones of
+     * the SSID while the radio has no history
+     * @param now timestamp in seconds
+     * @return equivalent dBm
+     */
+    int8_t radioScore(const Radio &r, uint32_t now) const;
+    /**
+     * @brief penalty of a connection history: a poor success rate (up to
+     * 20 dB) and a slow time-to-IP (up to 10 dB)
+     * @return dB to subtract from the signal
+     */
+    static int32_t historyPenalty(uint32_t attempts, uint32_t successes,
+                                  uint32_t meanTimeToIP_ms);
+    /**
+     * @brief gets the smoothed and aged signal of the SSID: the best among its
+     * radios
+     * @param now timestamp in seconds
+     * @return dBm, INT8_MIN if not detected for more than maxCandidateAge_s
+     */
+    int8_t signalEstimate(uint32_t now) const;
+    /**
+     * @brief ranks the SSID as a connection candidate: the best score of its
+     * radios (radioScore), lowered by the recent authentication failures,
+     * which concern the password shared by all of them
+     * @param now timestamp in seconds
+     * @return equivalent dBm, INT8_MIN if not a candidate
+     */
+    int8_t score(uint32_t now) const;
     /**
      * @brief checks the target SSID identifier matches the current one
      * @param targetSsid
@@ -156,7 +373,9 @@ public:
    */
   class APCredentialManager {
   private:
-    static constexpr size_t maxTrackedSSIDs = 10;
+    static constexpr size_t maxTrackedSSIDs = ED_WIFI_MAX_CREDENTIALS;
+    static_assert(maxTrackedSSIDs > 0 && maxTrackedSSIDs < 255,
+                  "the SSID index stores positions on 8 bits");
     APCredentialManager() = delete; // meant to be only static
     inline static bool initialized = false;
     /**
@@ -175,9 +394,25 @@ public:
     /**
      * @brief removes a given SSID from the registered and tracked SSID
      * @param ssid
-     * @return
+     * @return false if not tracked, or if it is the AP used by the station
+     */
+    static bool remove(const char *ssid) { return erase(ssid, false) == ESP_OK; }
+    /**
+     * @brief removes a given SSID, keeping the current AP and the scan
+     * results consistent
+     * @param addedOnly refuses the firmware defaults, which would be back at
+     * the next boot
+     * @return ESP_ERR_NOT_FOUND if not tracked, ESP_ERR_NOT_SUPPORTED for a
+     * firmware default (addedOnly), ESP_ERR_INVALID_STATE for the AP used by
+     * the station (outside of the AP fallback)
+     */
+    static esp_err_t erase(const char *ssid, bool addedOnly);
+    /**
+     * @brief true if the credential comes from the firmware defaults
      */
-    static bool remove(const char *ssid);
+    static bool isDefault(const APCredential &cred) {
+      return !inArena(cred.ssid);
+    }
     /**
      * @brief finds a given SSID among the registered and tracked SSID, and
      * updates the associated measurement of strength of the signal and channel
@@ -198,12 +433,14 @@ public:
      * @param chann the detected channel
      * @param index suggested index for the right item in the array. Used to
      * avoid rescans.
+     * @param bssid the specific radio detected, if known
      * @return pointer to the updated APcredential instance, nullpointer if out
      * of index
      */
     static const APCredential *findAndUpdateInfo(char *ssid, int strength,
                                                  uint8_t chann,
-                                                 int8_t index = -1);
+                                                 int8_t index = -1,
+                                                 const uint8_t *bssid = nullptr);
     /**
      * @brief gets the current number of Access Points whose credentials are
      * marked as usable for connection
@@ -224,6 +461,13 @@ public:
       else
         return nullptr;
     }
+    /**
+     * @brief gets a tracked credential, in insertion order
+     * @return nullptr past the end of the list
+     */
+    static const APCredential *getCredential(size_t index) {
+      return index < count ? &credentials[index] : nullptr;
+    }
 
     /**
      * @brief processes the  AP detected during a WiFi scan matching the tracked
@@ -233,12 +477,124 @@ public:
      */
     static void updateDetectedAPs(uint16_t number,
                                   wifi_ap_record_t *ap_records);
+    /**
+     * @brief resets the list of detected AP before a scan session, which can
+     * be made of several scan passes
+     */
+    static void beginDetection();
+    /**
+     * @brief matches a single detected AP against the tracked list, updating
+     * its data and listing it among the active ones if connectable
+     * @param record the detected AP
+     * @return true if the AP matches a tracked SSID
+     */
+    static bool ingestDetectedAP(const wifi_ap_record_t &record);
+    /**
+     * @brief closes the scan session, sorting the detected active AP by
+     * strength of signal
+     */
+    static void endDetection();
+    /**
+     * @brief SSID and channel where a connectable network was seen
+     */
+    struct ScanTarget {
+      const char *ssid;
+      uint8_t chann;
+    };
+    /**
+     * @brief lists the channels where the radios of connectable credentials
+     * were seen in previous scans, best ranked first, to plan directed scans
+     * @param targets output array
+     * @param max capacity of the output array
+     * @return number of targets listed
+     */
+    static size_t getScanTargets(ScanTarget targets[], size_t max);
+    /**
+     * @brief marks a radio of the current AP as failed, so that the next
+     * connection to the same SSID pins another of its radios
+     * @param bssid
+     * @return true if another usable radio of the current AP is available
+     */
+    static bool markRadioFailed(const uint8_t bssid[6]);
+    /**
+     * @brief records that a connection attempt to the current AP was launched
+     * @param bssid the radio the attempt is pinned to, nullptr if the driver
+     * picks one
+     */
+    static void recordAttempt(const uint8_t *bssid);
+    /**
+     * @brief records the outcome of the attempt to the current AP
+     * @param gotIP true if the attempt obtained an IP
+     * @param timeToIP_ms time from the attempt to the IP, if obtained
+     * @param reason disconnect reason, if failed
+     * @param bssid the radio the attempt was pinned to, nullptr if none
+     */
+    static void recordOutcome(bool gotIP, uint32_t timeToIP_ms, uint8_t reason,
+                              const uint8_t *bssid);
+    /**
+     * @brief records a disconnection of the current AP after it granted an IP
+     * @param reason
+     */
+    static void recordDrop(uint8_t reason);
+    /**
+     * @brief restores the connection statistics from NVS
+     */
+    static void loadStats();
+    /**
+     * @brief writes the connection statistics to NVS, if changed and not
+     * written in the last statsSaveInterval_s (unless forced)
+     * @param force
+     */
+    static void saveStats(bool force = false);
+    static constexpr size_t PMK_LEN = 32;
+    /**
+     * @brief gets the WPA2 PMK of a credential. PBKDF2-SHA1 (4096 rounds) is
+     * run once per SSID and passphrase, then the PMK is served from a cache
+     * mirrored in NVS, so the driver is spared the derivation on every
+     * connection.
+     * @param cred
+     * @param authmode security of the AP to connect to
+     * @param pmk receives the key
+     * @return false if a PMK does not apply (open network, WPA3, hex PSK) or
+     * the derivation failed: the passphrase is then used
+     */
+    static bool getPMK(const APCredential &cred, wifi_auth_mode_t authmode,
+                       uint8_t pmk[PMK_LEN]);
+    /**
+     * @brief restores the PMK cache from NVS
+     */
+    static void loadPMKs();
+    /**
+     * @brief tells whether the list of active AP is too old to be trusted, so
+     * that a new scan is needed before giving up on STA mode
+     * @return
+     */
+    static bool detectionStale() {
+      return ED_WIFI_NOW_US() / 1000000 - lastDetection_s >
+             APCredential::maxCandidateAge_s;
+    }
+    /**
+     * @brief gets an AP detected by the latest scan session, sorted by strength
+     * of signal
+     * @param index
+     * @return nullptr past the end of the list
+     */
+    static const APCredential *getActiveAP(size_t index) {
+      return index < maxTrackedSSIDs ? activeSSIDs[index] : nullptr;
+    }
     /**
      * @brief switches to the next active AP, sorted by detected strength of
      * signal. when the list is exhaustes, returns nullptr
      * @return true is there is at least one reachable connectable network
      */
     static bool setNextActiveAP();
+    /**
+     * @brief sets as current AP the connectable credential matching the SSID,
+     * bypassing the scan results (used by the fast-connect path)
+     * @param ssid
+     * @return true if a connectable credential was found
+     */
+    static bool selectAP(const char *ssid);
     static const APCredential *curAP;
 
     /**
@@ -264,7 +620,30 @@ public:
      */
     static bool packCredential(CodecOperation mode, std::string &ssid,
                                std::string &password, std::string &codecStr);
+    /**
+     * @brief adds or updates a credential and persists it. The NVS write is
+     * deferred by credSaveDelay_ms, so that a burst of updates (e.g. from the
+     * web interface) results in a single write of the credential blob
+     * @return ESP_ERR_NO_MEM if the credential list is full
+     */
     static esp_err_t addOrUpdateToNVS(const char *ssid, const char *password);
+    /**
+     * @brief loads the credentials saved at runtime with a single read of the
+     * credential blob, validated by magic, version and CRC. When the blob does
+     * not exist yet, imports the per-key entries written by the previous
+     * versions and saves them as a blob
+     * @return ESP_ERR_NO_MEM if some credentials could not be restored (e.g.
+     * a blob written by a build with more slots), another error if the blob
+     * could not be read or is rejected (size, version, CRC): in both cases the
+     * blob is no longer rewritten in this boot, which would lose them
+     */
+    static esp_err_t loadCredentials();
+    /**
+     * @brief writes the pending credential changes now, without waiting for
+     * the end of the coalescing delay
+     * @return
+     */
+    static esp_err_t flushCredentials();
 
   private:
     static constexpr const char *NVS_STORAGE_KEY = "WFC";
@@ -274,6 +653,182 @@ public:
     static const APCredential *activeSSIDs[maxTrackedSSIDs + 1];
     static APCredential credentials[maxTrackedSSIDs];
     static size_t count;
+    /**
+     * @brief pool of the strings of the credentials added at runtime, each
+     * one stored with its terminator only. Strings of removed credentials and
+     * replaced passwords are reclaimed by compaction when space runs out.
+     */
+    static inline char arena[ED_WIFI_CRED_ARENA_SIZE] = {};
+    static inline size_t arenaUsed = 0;
+    static bool inArena(const char *s) {
+      return s >= arena && s < arena + sizeof(arena);
+    }
+    /**
+     * @brief makes room for strings totalling the given bytes (terminators
+     * included), compacting the arena if needed
+     * @return false if the arena is full
+     */
+    static bool reserve(size_t bytes);
+    /**
+     * @brief copies a string in the space granted by reserve()
+     */
+    static const char *store(const char *s, size_t len);
+    /**
+     * @brief slides the strings still referenced to the start of the arena
+     */
+    static void compactArena();
+    static inline size_t detectedCount =
+        0; // number of active AP listed by the current scan session
+    static inline size_t nextActive = 0; // next activeSSIDs to try
+    static inline uint16_t sessionId = 0; // current scan session
+    static inline uint32_t lastDetection_s =
+        0; // end of the latest scan session, seconds
+    static constexpr const char *CRED_NVS_KEY = "WFCRED";
+    static constexpr uint32_t CRED_MAGIC = 0x45444346; // "EDCF"
+    static constexpr uint8_t CRED_VERSION = 1;
+    static constexpr uint32_t credSaveDelay_ms =
+        2000; // updates within this delay are written together
+    /**
+     * @brief credential blob: this header, then for each credential a flags
+     * byte (bit 0: connectable), the SSID length, the password length and the
+     * two strings without terminator. The CRC covers the records.
+     */
+    struct CredBlobHeader {
+      uint32_t magic;
+      uint8_t version;
+      uint8_t count;
+      uint16_t length; // bytes of records following the header
+      uint32_t crc;
+    };
+    static constexpr size_t credBlobMax =
+        sizeof(CredBlobHeader) +
+        maxTrackedSSIDs * (3 + ED_WIFI_SSID_SIZE - 1 + ED_WIFI_PWD_SIZE - 1);
+    static_assert(ED_WIFI_CRED_ARENA_SIZE >=
+                      ED_WIFI_SSID_SIZE + ED_WIFI_PWD_SIZE,
+                  "the arena must hold at least one full-length credential");
+    static inline bool credDirty = false;
+    // the stored blob was not (fully) loaded: rewriting it would lose the
+    // credentials it holds
+    static inline bool credLoadIncomplete = false;
+    /**
+     * @brief rejects the stored credential blob: it is left as is, and no
+     * longer rewritten in this boot
+     * @return err
+     */
+    static esp_err_t rejectCredentialBlob(esp_err_t err, const char *why);
+    static inline TimerHandle_t credSaveTimer = nullptr;
+    /**
+     * @brief marks the credentials as changed and (re)arms the coalescing
+     * timer
+     */
+    static void scheduleCredentialSave();
+    static void cred_save_callback(TimerHandle_t xTimer);
+    /**
+     * @brief adds a credential read from NVS, flagged as persistent
+     */
+    static bool restore(const char *ssid, const char *password,
+                        bool canConnect);
+    /**
+     * @brief imports the credentials saved by the previous versions: the
+     * ssid_N/spwd_N pairs of the WFC namespace and the SSID/password strings
+     * of NVS_AREA_NAME
+     * @return number of credentials imported
+     */
+    static size_t importLegacyCredentials();
+    static constexpr const char *PMK_NVS_KEY = "WFPMK";
+    /**
+     * @brief a cached PMK, keyed by the fingerprints of the SSID and of the
+     * passphrase: an entry can not outlive a change of password, even one
+     * made by reflashing the firmware defaults
+     */
+    struct PmkEntry {
+      uint32_t ssidHash;
+      uint32_t pwdHash;
+      uint8_t pmk[PMK_LEN];
+      bool valid;
+    };
+    static inline PmkEntry pmkCache[ED_WIFI_PMK_SLOTS] = {};
+    static inline size_t pmkNext = 0; // round robin replacement
+    /**
+     * @brief drops the cached PMKs of an SSID (password changed or
+     * credential removed)
+     */
+    static void invalidatePMK(const APCredential &cred);
+    static void savePMKs();
+    /**
+     * @brief gets the cached PMK of a credential, without deriving it
+     */
+    static bool cachedPMK(const APCredential &cred, uint8_t pmk[PMK_LEN]);
+    /**
+     * @brief caches a PMK retained across deep sleep, without writing NVS
+     */
+    static void seedPMK(const APCredential &cred, const uint8_t pmk[PMK_LEN]);
+    friend class WiFiService;
+    static constexpr const char *STATS_NVS_KEY = "WFS";
+    static constexpr uint32_t statsSaveInterval_s =
+        600; // limits the flash wear of the statistics
+    static inline bool statsDirty = false;
+    static inline uint32_t lastStatsSave_s = 0; // 0 = never saved
+    struct StatsRecord {
+      uint32_t ssidHash;
+      APCredential::ConnStats stats;
+    };
+    // the radio histories in a blob of their own, so that the SSID one keeps
+    // the format of the previous versions
+    static constexpr const char *RADIO_STATS_NVS_KEY = "WFSR";
+    struct RadioStatsRecord {
+      uint32_t ssidHash;
+      uint8_t bssid[6];
+      uint8_t attempts;
+      uint8_t successes;
+      uint16_t meanTimeToIP_ms;
+    };
+    // staging of the radio blob for loadStats/saveStats, both on the owner
+    // task: static rather than on its stack, which it would outgrow with a
+    // raised capacity
+    static inline RadioStatsRecord
+        radioRecords[maxTrackedSSIDs * APCredential::maxRadios] = {};
+    /**
+     * @brief gets the radio of a credential with the given BSSID
+     * @return nullptr if bssid is nullptr or not among the radios
+     */
+    static APCredential::Radio *findRadio(APCredential &cred,
+                                          const uint8_t *bssid);
+    /**
+     * @brief gets the credential of the current AP for update
+     * @return nullptr if no current AP
+     */
+    static APCredential *current() {
+      return curAP ? &credentials[curAP - credentials] : nullptr;
+    }
+    /**
+     * @brief slot of the open-addressed SSID index: the fingerprint (length
+     * and FNV-1a hash) of a tracked SSID and its position in credentials[]
+     */
+    struct IndexSlot {
+      uint32_t hash;
+      uint8_t len;
+      uint8_t pos; // position in credentials[] + 1, 0 marks an empty slot
+    };
+    static constexpr size_t indexSlots =
+        hashTableSize(maxTrackedSSIDs); // load factor at or below 50%
+    static inline IndexSlot ssidIndex[indexSlots] = {};
+    static uint32_t ssidHash(const char *ssid, size_t len);
+    /**
+     * @brief adds the credential at the given position to the SSID index
+     * @param pos
+     */
+    static void indexInsert(size_t pos);
+    /**
+     * @brief recreates the SSID index after positions in credentials[] moved
+     */
+    static void rebuildIndex();
+    /**
+     * @brief finds a tracked SSID through the index
+     * @param ssid
+     * @return the position in credentials[], -1 if not tracked
+     */
+    static int lookup(const char *ssid);
     /**
      * @brief retrieves the stored information for a given SSID
      * @param ssid
@@ -285,6 +840,7 @@ public:
      * @brief loads from NVS wifi credential received after flashing firmware
      * using the web interface. the password will overwrite the one loaded from
      * flashed firmware is SSID matches.
+     * Legacy ssid_N/spwd_N format, only read to import it in the blob.
      * @return
      */
     static esp_err_t loadFromNVS();
@@ -292,45 +848,749 @@ public:
     // number of SSID current registered at the credential manager
   };
 
+  /**
+   * @brief provisioning portal, running while in AP fallback: the page,
+   * gzip-compressed at build time and served from flash, and a JSON API on
+   * the credentials and the networks in range.
+   * The handlers run on the httpd task and read or change the credentials
+   * through the owner task.
+   */
   class WebInterfaace {
+    friend class WiFiService;
+
   private:
     WebInterfaace();
+    static inline httpd_handle_t server = nullptr; // timer service task only
+    static inline bool active = false;             // owner task
+    static inline char etag[11] = {}; // CRC32 of the page, quoted
+    /**
+     * @brief starts (run != 0) or stops the HTTP server, on the timer service
+     * task: stopping waits for the handler in progress, which may itself be
+     * waiting for the owner task
+     */
+    static void server_op(void *arg, uint32_t run);
+    /**
+     * @brief a network in range, whether known or not, as listed by the
+     * portal to pick the SSID to add
+     */
+    struct SeenAP {
+      char ssid[ED_WIFI_SSID_SIZE];
+      int8_t rssi;
+      uint8_t chann;
+      uint8_t authmode;
+    };
+    static inline SeenAP seen[ED_WIFI_PORTAL_SCAN_MAX] = {};
+    static inline size_t seenCount = 0;
+    static inline bool surveyPending = false; // POST /api/scan not run yet
+    // the httpd task runs a single handler at a time
+    static inline char json[ED_WIFI_PORTAL_JSON_SIZE];
+
+    enum class View : uint8_t { Networks, Scan };
+    /**
+     * @brief writes the JSON of a view, on the owner task
+     * @return length written, truncated to the entries which fit
+     */
+    static size_t render(View view, char *buf, size_t size);
+    static esp_err_t send_view(httpd_req_t *req, View view);
+    static esp_err_t send_status(httpd_req_t *req, const char *status,
+                                 const char *body);
+    /**
+     * @brief reads the request body in buf, terminated
+     * @return false if empty, too long or failed
+     */
+    static bool recv_body(httpd_req_t *req, char *buf, size_t size);
 
   public:
-    static void init();
+    /**
+     * @brief starts the HTTP server and registers the handlers, if not
+     * running yet. Called when the AP fallback is entered.
+     */
+    static void start();
+    /**
+     * @brief stops the HTTP server, called when the AP fallback ends
+     */
+    static void stop();
+    static void init() { start(); } // kept for compatibility
+    static bool running() { return active; }
+    /**
+     * @brief clears the networks in range, when a scan session begins
+     */
+    static void clearSeen() { seenCount = 0; }
+    /**
+     * @brief lists a network in range, keeping the strongest ones
+     */
+    static void noteSeen(const wifi_ap_record_t &record);
+    /**
+     * @brief runs the full scan requested by POST /api/scan, on the owner
+     * task, once no scan session is active
+     */
+    static void runPendingSurvey();
 
     static esp_err_t root_get_handler(httpd_req_t *req);
     static esp_err_t set_ap_post_handler(httpd_req_t *req);
     static esp_err_t httpd_resp_send_500(httpd_req_t *req);
+    /**
+     * @brief GET /api/networks: the known networks, without passwords
+     */
+    static esp_err_t networks_get_handler(httpd_req_t *req);
+    /**
+     * @brief POST /api/networks: adds or updates a network from a JSON body
+     * {"ssid":"...","password":"..."} and saves it
+     */
+    static esp_err_t networks_post_handler(httpd_req_t *req);
+    /**
+     * @brief DELETE /api/networks?ssid=...: removes a network
+     */
+    static esp_err_t networks_delete_handler(httpd_req_t *req);
+    /**
+     * @brief GET /api/scan: the networks found by the last scan session
+     */
+    static esp_err_t scan_get_handler(httpd_req_t *req);
+    /**
+     * @brief POST /api/scan: requests a full scan, answered 202 at once
+     */
+    static esp_err_t scan_post_handler(httpd_req_t *req);
+    /**
+     * @brief redirects any other URL to the page: the connectivity checks of
+     * the phones (e.g. /generate_204) then show it as a captive portal
+     */
+    static esp_err_t redirect_handler(httpd_req_t *req, httpd_err_code_t err);
+  };
+  /**
+   * @brief captive portal DNS responder, running while in AP fallback: every
+   * A query is answered with the SoftAP address, so that the phones joining
+   * the AP open the portal by themselves.
+   * One UDP socket and a static packet buffer, served by a low priority task
+   * created once and idle between AP fallbacks: no allocation per query.
+   */
+  class CaptiveDNS {
+    friend class WiFiService;
+
+  private:
+    CaptiveDNS();
+    static constexpr uint16_t PORT = 53;
+    static constexpr uint32_t TTL_S = 60;
+    static constexpr size_t PACKET_SIZE = 512; // DNS over UDP, without EDNS
+    static inline uint8_t packet[PACKET_SIZE];
+    static inline std::atomic<bool> active{false};
+    static inline uint32_t apAddr = 0; // network order
+    static inline uint32_t answered = 0;
+    static inline TaskHandle_t task = nullptr;
+    static inline StaticTask_t taskBuf;
+    static inline StackType_t taskStack[ED_WIFI_DNS_STACK];
+    /**
+     * @brief opens the socket when notified, serves it while active
+     */
+    static void dns_task(void *arg);
+
+  public:
+    /**
+     * @brief turns a query into its answer, in place: every A query is
+     * answered with addr. No state, no allocation.
+     * @param msg the query, then the answer
+     * @param len length of the query
+     * @param size of msg, the answer is not written beyond it
+     * @param addr IPv4 address of the answers, network order
+     * @return length of the answer, 0 to drop the packet
+     */
+    static size_t answer(uint8_t *msg, size_t len, size_t size, uint32_t addr);
+    /**
+     * @brief starts answering with the address of the AP interface
+     */
+    static void start(esp_netif_t *ap);
+    /**
+     * @brief stops answering, the socket is closed within a second
+     */
+    static void stop();
   };
   explicit WiFiService() =
       delete; // meant to be used as singleton, no instances.
   ~WiFiService();
 
-  static esp_err_t launch();
   /**
-   * @brief allows function to subscribe to a obtained-IP event and be run
+   * @brief how launch() starts the station
+   */
+  enum class LaunchMode : uint8_t {
+    Normal,   // credentials, statistics and keys loaded from NVS, then scan
+    SleepWake // battery devices: on wake from deep sleep, connects with the
+              // state retained in RTC memory, without scan nor NVS read
+  };
+  static esp_err_t launch(LaunchMode mode = LaunchMode::Normal);
+  /**
+   * @brief wakes of a device launched in LaunchMode::SleepWake. Kept in RTC
+   * memory, reset by a power cycle.
+   */
+  struct WakeStats {
+    uint32_t wakes;           // launches after a deep sleep
+    uint32_t fastWakes;       // wakes connected without scan
+    uint32_t fallbacks;       // wakes which needed the scan path
+    uint32_t lastWakeToIP_ms; // from boot to the IP, latest wake
+    uint32_t meanWakeToIP_ms; // moving average, weight 1/4 to the latest
+  };
+  static WakeStats getWakeStats();
+  /**
+   * @brief core and priority of the task which owns the WiFiService state.
+   * Defaults from ED_WIFI_TASK_CORE and ED_WIFI_TASK_PRIORITY
+   */
+  struct TaskConfig {
+    BaseType_t core; // tskNO_AFFINITY or the core id
+    UBaseType_t priority;
+  };
+  /**
+   * @brief sets the owner task configuration, effective if called before
+   * launch()
+   * @param config
+   */
+  static void setTaskConfig(const TaskConfig &config) { taskConfig = config; }
+  /**
+   * @brief commands lost because the queue of the owner task was full
+   */
+  static uint32_t getDroppedCommands() { return droppedCommands; }
+  static ConnectionFsm::State getConnectionState() { return fsm.current(); }
+  /**
+   * @brief copies the last transitions of the connection state machine,
+   * oldest first. The copy is made by the owner task, consistent with the
+   * transitions it dispatches
+   * @return number of transitions copied
+   */
+  static size_t getStateTrace(ConnectionFsm::Transition *out, size_t max);
+  /**
+   * @brief allows function to subscribe to a obtained-IP event and be run.
+   * Kept for compatibility, registers in NetEvents with priority 0
    * @param callback
    */
-  static void subscribeToIPReady(std::function<void()> callback);
+  static void subscribeToIPReady(void (*callback)());
+  /**
+   * @brief as above, with a context passed back to the callback
+   */
+  static void subscribeToIPReady(void (*callback)(void *ctx), void *ctx);
+  /**
+   * @brief enables/disables the fast-connect path, which tries a direct
+   * connection to the last AP which granted an IP before falling back to the
+   * full scan. Enabled by default.
+   * @param enabled
+   */
+  static void setFastConnect(bool enabled);
+  /**
+   * @brief how the DHCP lease recorded for a network is reused when the
+   * station connects to it again
+   */
+  enum class LeaseReuse : uint8_t {
+    Off,    // full DHCP exchange at every connection
+    Reboot, // INIT-REBOOT: requests the last address directly, skipping
+            // DISCOVER/OFFER. The server confirms or refuses it. Done by
+            // lwIP when CONFIG_LWIP_DHCP_RESTORE_LAST_IP is enabled (ESP-IDF
+            // 4.x and 5.x), otherwise the same as Off.
+    Static  // applies the recorded lease after an ARP conflict probe,
+            // without waiting for the server. DHCP resumes at half the lease
+            // time or at the next disconnection.
+  };
+  /**
+   * @brief sets the reuse of the recorded DHCP leases, LeaseReuse::Reboot by
+   * default
+   */
+  static void setLeaseReuse(LeaseReuse mode);
+
+  /**
+   * @brief measurement of the time the ED_wifi handler holds the default
+   * event loop, which is shared with all the other components
+   */
+  struct EventLoopStats {
+    uint32_t events;          // events handled
+    uint32_t maxHold_us;      // worst holding time
+    int32_t maxHoldEventId;   // event which caused the worst holding time
+    uint32_t overBudget;      // events exceeding EVENT_LOOP_BUDGET_US
+    uint64_t totalHold_us;    // cumulated holding time
+  };
+  /**
+   * @brief gets the statistics of the time the ED_wifi handler held the event
+   * loop
+   * @return
+   */
+  static EventLoopStats getEventLoopStats() { return eventLoopStats; }
+
+  /**
+   * @brief parameters of the background roaming: while connected, the RSSI of
+   * the AP is checked periodically; below the threshold background scans look
+   * for a better radio, and the station roams to it only when it is stronger
+   * by the margin for several consecutive scans (hysteresis).
+   */
+  struct RoamConfig {
+    bool enabled = true;
+    int8_t rssiThreshold = -70;    // dBm, below it background scans start
+    uint8_t margin_dB = 8;         // advantage required to a candidate
+    uint8_t sustainedScans = 3;    // consecutive scans confirming the candidate
+    uint16_t checkInterval_s = 15; // period of the RSSI check, at least 1
+    uint16_t scanInterval_s = 30;  // minimum time between background scans
+  };
+  struct RoamStats {
+    uint32_t roams;           // roams which obtained an IP
+    uint32_t roamFailures;    // roams which did not obtain an IP
+    uint32_t backgroundScans; // scans launched by the roaming check
+    uint32_t lastLatency_ms;  // from the roam decision to the new IP
+    uint32_t maxLatency_ms;
+    uint64_t totalLatency_ms;
+  };
+  /**
+   * @brief sets the roaming parameters, effective from the next check
+   * @param config
+   */
+  static void setRoamConfig(const RoamConfig &config);
+  static RoamStats getRoamStats() { return roamStats; }
+
+  /**
+   * @brief phases of a connection, from the start of the STA (or the loss of
+   * the connection) to the IP
+   */
+  enum class ConnPhase : uint8_t {
+    Scan,  // scan session which selected the AP
+    Assoc, // authentication and association of the successful attempt
+    DHCP,  // from association to IP
+    Total, // time-to-IP, retries and AP switches included
+    Count
+  };
+  /**
+   * @brief timestamps (ED_WIFI_NOW_US, us) of the phases of the last
+   * connection. 0 when the phase did not occur (e.g. no scan on fast connect)
+   */
+  struct ConnTimeline {
+    int64_t start_us;      // STA start or connection lost
+    int64_t scanStart_us;  // first pass of the scan session
+    int64_t scanEnd_us;    // scan session completed
+    int64_t assocStart_us; // esp_wifi_connect of the successful attempt
+    int64_t connected_us;  // WIFI_EVENT_STA_CONNECTED
+    int64_t gotIP_us;      // IP_EVENT_STA_GOT_IP
+    uint16_t attempts;     // association attempts in this connection
+  };
+  static constexpr size_t LATENCY_BUCKETS = 10;
+  /**
+   * @brief latency distribution of a phase. Bucket i counts the samples up to
+   * latencyBucketBound_ms(i), the last bucket the ones beyond
+   */
+  struct LatencyHistogram {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint64_t total_ms;
+  };
+  /**
+   * @brief upper bound of a histogram bucket: 50 ms doubling up to 12.8 s
+   * @param i bucket index
+   * @return the bound in ms, UINT32_MAX for the last bucket
+   */
+  static constexpr uint32_t latencyBucketBound_ms(size_t i) {
+    return i + 1 < LATENCY_BUCKETS ? 50u << i : UINT32_MAX;
+  }
+  static LatencyHistogram getLatencyHistogram(ConnPhase phase) {
+    return phase < ConnPhase::Count ? latencyHist[(size_t)phase]
+                                    : LatencyHistogram{};
+  }
+  static ConnTimeline getLastTimeline() { return lastTimeline; }
+  static void resetLatencyHistograms();
+
+  /**
+   * @brief counters and gauges of the connection, updated by the wifi event
+   * handling and readable from any task without locks: each field is a
+   * relaxed atomic, a snapshot is consistent field by field.
+   */
+  class Metrics {
+  public:
+    /**
+     * @brief disconnect reasons are counted in slots: the 802.11 codes 1..29
+     * map to their own slot, the ESP-IDF codes 200..209 to slots 30..39,
+     * anything else to slot 0
+     */
+    static constexpr size_t REASON_SLOTS = 40;
+    static constexpr size_t reasonSlot(uint8_t reason) {
+      return reason < 30                     ? reason
+             : reason >= 200 && reason < 210 ? 30 + (reason - 200)
+                                             : 0;
+    }
+    /**
+     * @brief the reason code counted in a slot, 0 for the slot of the
+     * unlisted codes
+     */
+    static constexpr uint8_t slotReason(size_t slot) {
+      return slot < 30 ? slot : slot < REASON_SLOTS ? 200 + (slot - 30) : 0;
+    }
+    struct Snapshot {
+      uint32_t uptime_s;     // when the snapshot was taken
+      uint32_t connects;     // IP obtained
+      uint32_t disconnects;  // WIFI_EVENT_STA_DISCONNECTED
+      uint32_t retries;      // retries on the same AP
+      uint32_t apFallbacks;  // switches to AP mode
+      uint32_t scans;        // scan sessions, all purposes
+      uint32_t scanTotal_ms; // cumulated duration of the scan sessions
+      uint32_t scanMax_ms;   // longest scan session
+      uint32_t roams;        // roams which obtained an IP
+      uint32_t roamFailures;
+      uint32_t rssiSamples; // RSSI readings while connected
+      int8_t rssiMin;       // dBm, 0 if no samples
+      int8_t rssiAvg;
+      int8_t rssiMax;
+      uint16_t byReason[REASON_SLOTS]; // disconnects per reason slot
+    };
+    /**
+     * @brief copies the current values, without locking the writers
+     * @param out
+     */
+    static void snapshot(Snapshot &out);
+    static void reset();
+
+  private:
+    friend class WiFiService;
+    static uint32_t recordDisconnect(uint8_t reason); // returns the count
+    static void recordScan(uint32_t duration_ms);
+    static void recordRSSI(int8_t rssi);
+    static inline std::atomic<uint32_t> connects{0};
+    static inline std::atomic<uint32_t> disconnects{0};
+    static inline std::atomic<uint32_t> retries{0};
+    static inline std::atomic<uint32_t> apFallbacks{0};
+    static inline std::atomic<uint32_t> scans{0};
+    static inline std::atomic<uint32_t> scanTotal_ms{0};
+    static inline std::atomic<uint32_t> scanMax_ms{0};
+    static inline std::atomic<uint32_t> roams{0};
+    static inline std::atomic<uint32_t> roamFailures{0};
+    static inline std::atomic<uint32_t> rssiSamples{0};
+    static inline std::atomic<int32_t> rssiSum{0};
+    static inline std::atomic<int32_t> rssiMin{INT8_MAX};
+    static inline std::atomic<int32_t> rssiMax{INT8_MIN};
+    static inline std::atomic<uint32_t> byReason[REASON_SLOTS] = {};
+  };
+
+  /**
+   * @brief registry of the subscribers to the network events. Events are
+   * queued by the wifi event handling and dispatched on a dedicated task, so
+   * that a slow subscriber (e.g. an MQTT connect) neither holds the event loop
+   * nor delays the wifi logic. Subscribers run by decreasing priority; the
+   * registry has a fixed capacity and allocates nothing.
+   */
+  class NetEvents {
+  public:
+    enum class Event : uint8_t {
+      GotIP,        // IP obtained (also after a roam)
+      LostIP,       // IP_EVENT_STA_LOST_IP
+      Disconnected, // an established connection dropped
+      Roamed,       // the station moved to another radio and got its IP
+      APMode,       // fallback to AP mode entered
+      Count
+    };
+    struct Info {
+      Event event;
+      uint8_t reason; // disconnect reason, Disconnected only
+      uint32_t ip;    // network order, GotIP and Roamed only
+    };
+    using Callback = void (*)(const Info &info, void *ctx);
+    static constexpr size_t MAX_SUBSCRIBERS = ED_WIFI_MAX_SUBSCRIBERS;
+    static constexpr uint8_t mask(Event e) { return 1u << (uint8_t)e; }
+    static constexpr uint8_t ALL_EVENTS = (1u << (uint8_t)Event::Count) - 1;
+    struct SubscriberStats {
+      uint32_t calls;
+      uint32_t maxRun_us; // worst execution time of the callback
+      uint64_t totalRun_us;
+    };
+    /**
+     * @brief registers a callback
+     * @param cb called on the dispatch task
+     * @param ctx passed back to cb
+     * @param events mask of the events of interest, see mask()
+     * @param priority higher runs first
+     * @return a handle for unsubscribe/getStats, -1 if the registry is full
+     */
+    static int subscribe(Callback cb, void *ctx, uint8_t events = ALL_EVENTS,
+                         uint8_t priority = 0);
+    /**
+     * @brief removes a subscriber. Once returned, the callback is not called
+     * anymore (waits for its call in progress, if any). Can be called from
+     * within a callback
+     * @return false if the handle is not subscribed
+     */
+    static bool unsubscribe(int handle);
+    static bool getStats(int handle, SubscriberStats &out);
+    static uint32_t getDropped() { return dropped; }
+
+  private:
+    friend class WiFiService;
+    static constexpr size_t QUEUE_DEPTH = 8;
+    static constexpr uint32_t SLOW_SUBSCRIBER_US =
+        100000; // callbacks running longer are logged
+    struct Subscriber {
+      Callback cb; // nullptr for a free slot
+      void *ctx;
+      uint8_t events;
+      uint8_t priority;
+      SubscriberStats stats;
+      uint16_t generation; // bumped when the slot is reused
+    };
+    /**
+     * @brief creates the queue, the lock and the dispatch task, once even
+     * when the first subscribe() calls race
+     */
+    static void start();
+    /**
+     * @brief queues an event for the subscribers, without blocking
+     */
+    static void post(Event event, uint8_t reason = 0, uint32_t ip = 0);
+    static void dispatch_task(void *arg);
+    static Subscriber subscribers[MAX_SUBSCRIBERS];
+    // the lock guards the table only: the callbacks run without it, from a
+    // copy of the subscribers taken when the event is dequeued
+    static inline int running = -1; // slot whose callback is running
+    static inline TaskHandle_t waiter = nullptr; // unsubscribe() waiting it
+    static inline TaskHandle_t task = nullptr;
+    static inline uint32_t dropped = 0; // events lost on a full queue
+    static inline QueueHandle_t queue = nullptr;
+    static inline SemaphoreHandle_t lock = nullptr;
+    static inline StaticQueue_t queueBuf;
+    static inline uint8_t queueStorage[QUEUE_DEPTH * sizeof(Info)];
+    static inline StaticSemaphore_t lockBuf;
+    static inline StaticTask_t taskBuf;
+    static inline StackType_t taskStack[ED_WIFI_NOTIFY_STACK];
+  };
+
+  /**
+   * @brief history of the RSSI of the connected AP and of the free heap,
+   * sampled every SAMPLE_S seconds by a timer and kept in a fixed ring of
+   * delta-encoded blocks. When the ring is full the oldest block is dropped.
+   *
+   * Blob returned by read(), little endian:
+   *  - header (8 bytes): 'W' 'H', version (1), block size, sample period in s
+   *    (uint16), number of blocks (uint8), reserved
+   *  - the blocks, oldest first. Each block:
+   *    - uint32 uptime (s) of its first sample
+   *    - uint32 free heap of the first sample, in units of 16 bytes
+   *    - int8 RSSI of the first sample (0 = not connected)
+   *    - uint8 number of samples in the block, the first included
+   *    - uint8 bytes of delta payload used, uint8 reserved
+   *    - payload: for each further sample, the RSSI difference to the previous
+   *      sample (one byte, modulo 256), then the heap difference (16 byte
+   *      units) as a zigzag LEB128 varint. Sample i is SAMPLE_S*i after the
+   *      first one.
+   */
+  class History {
+  public:
+    static constexpr uint16_t SAMPLE_S = 60;
+    static constexpr size_t BLOCK_SIZE = 64;
+    static constexpr size_t BLOCKS = ED_WIFI_HISTORY_BLOCKS;
+    static constexpr size_t HEADER_SIZE = 8;
+    static constexpr size_t MAX_BLOB_SIZE = HEADER_SIZE + BLOCK_SIZE * BLOCKS;
+    /**
+     * @brief copies the history as a binary blob, consistent even if a sample
+     * is added meanwhile
+     * @param buf destination, MAX_BLOB_SIZE bytes always suffice
+     * @param len size of buf
+     * @return bytes written, 0 if buf cannot hold the current history
+     */
+    static size_t read(uint8_t *buf, size_t len);
+    static void clear();
+
+  private:
+    friend class WiFiService;
+    struct Block {
+      uint32_t start_s;
+      uint32_t heap0; // free heap / 16
+      int8_t rssi0;
+      uint8_t count;
+      uint8_t used;
+      uint8_t reserved;
+      uint8_t data[BLOCK_SIZE - 12];
+    };
+    static_assert(sizeof(Block) == BLOCK_SIZE, "history block is not packed");
+    static_assert(BLOCKS > 0 && BLOCKS <= UINT8_MAX,
+                  "the blob counts the blocks in one byte");
+    static void push(uint32_t now_s, int8_t rssi, uint32_t freeHeap);
+    static inline Block blocks[BLOCKS] = {};
+    static inline size_t head = 0;   // block being filled
+    static inline size_t filled = 0; // blocks holding samples
+    static inline int8_t lastRSSI = 0;
+    static inline uint32_t lastHeap = 0; // free heap / 16 of the last sample
+    static inline std::atomic<uint32_t> seq{
+        0}; // odd while push() modifies the ring, for the readers
+  };
 
 private:
+  /**
+   * @brief the last AP (specific radio) which granted an IP to the station.
+   * Kept in RTC memory (survives soft reset and deep sleep) and mirrored in NVS
+   * (survives power loss), used to connect skipping the scan.
+   */
+  struct FastConnectRecord {
+    uint32_t magic;
+    char ssid[ED_WIFI_SSID_SIZE];
+    uint8_t bssid[6];
+    uint8_t chann;
+    uint8_t authmode;             // wifi_auth_mode_t of the AP
+    uint32_t scanPathTimeToIP_ms; // latest time-to-IP through the scan path,
+                                  // the reference to report the time saved
+    uint32_t crc;                 // crc32 of all the fields above
+  };
+  static constexpr uint32_t FAST_CONNECT_MAGIC = 0xED0FA57C;
+  static constexpr const char *FAST_CONNECT_NVS_KEY = "lastAP";
+  static FastConnectRecord fastConnectRecord;
+  static inline bool fastConnectEnabled = true;
+  static inline bool fastConnectPending =
+      false; // a direct connection to the recorded AP is ongoing
+  static inline int64_t connectStart_us =
+      0; // start of the current connection attempt, 0 when not measuring
+  static uint32_t fastConnectCrc(const FastConnectRecord &rec);
+  static bool fastConnectValid();
+  /**
+   * @brief restores the fast connect record from NVS when the RTC copy was
+   * lost (power cycle)
+   */
+  static void loadFastConnectRecord();
+  /**
+   * @brief updates the fast connect record with the AP currently connected and
+   * mirrors it to NVS if it changed
+   * @param timeToIP_ms time-to-IP of the connection just completed
+   */
+  static void saveFastConnectRecord(uint32_t timeToIP_ms);
+  /**
+   * @brief tries a direct connection to the recorded AP on its channel,
+   * skipping the scan
+   * @return true if the connection was launched, false if the scan path is
+   * needed
+   */
+  static bool tryFastConnect();
+  /**
+   * @brief launches a direct connection to a given radio, skipping the scan.
+   * A failure is handled by the fast connect branch of the disconnection.
+   * @return false if the SSID is not a connectable credential
+   */
+  static bool connect_direct(const char *ssid, const uint8_t bssid[6],
+                             uint8_t chann, wifi_auth_mode_t authmode);
+
+  /**
+   * @brief state retained in RTC memory across deep sleep by
+   * LaunchMode::SleepWake: the connected AP and the next ranked candidates
+   * with their keys, so that a wake needs neither the scan nor NVS
+   */
+  struct WakeRecord {
+    uint32_t magic;
+    struct Candidate {
+      char ssid[ED_WIFI_SSID_SIZE];
+      char password[ED_WIFI_PWD_SIZE];
+      uint8_t bssid[6];
+      uint8_t chann;
+      uint8_t authmode; // wifi_auth_mode_t
+      bool pmkValid;
+      uint8_t pmk[32];
+    };
+    Candidate candidates[ED_WIFI_WAKE_CANDIDATES]; // ranked, connected AP first
+    uint8_t count;
+    uint8_t fastSlot; // candidate tried by the fast connect, WAKE_NO_SLOT if none
+    uint8_t failedWakes; // consecutive wakes which needed the scan
+    WakeStats stats;
+    uint32_t crc; // crc32 of all the fields above
+  };
+  static constexpr uint32_t WAKE_MAGIC = 0xED0F5EEA;
+  static constexpr uint8_t WAKE_NO_SLOT = 0xFF;
+  static constexpr uint8_t wakeMaxFailures =
+      2; // then the retained candidates are dropped, the next wake scans
+  static WakeRecord wakeRecord;
+  static inline bool wakeMode = false;   // launched in LaunchMode::SleepWake
+  static inline bool wakeFast = false;   // this wake took the retained path
+  static inline bool wakeReported = false;
+  static inline uint8_t wakeNext = 0;    // next retained candidate to try
+  static inline bool rankedThisBoot = false; // a scan session ranked the APs
+  static inline bool storeLoaded = false; // NVS state loaded by load_store()
+  static bool wakeRecordValid();
+  static void sealWakeRecord();
+  /**
+   * @brief loads the state kept in NVS (fast connect record, credentials,
+   * statistics, PMKs). Deferred by a fast wake until the scan path is
+   * needed: until then, the partial state is not written back.
+   */
+  static void load_store();
+  /**
+   * @brief restores the retained candidates as (non persistent) credentials
+   * and seeds their PMKs
+   */
+  static void restore_wake_record();
+  /**
+   * @brief retains the connected AP and the best ranked candidates, and
+   * reports the wake-to-IP time
+   */
+  static void capture_wake_record();
+  /**
+   * @brief tries the next retained candidate after a failed direct connection
+   * @return false when all were tried: the scan path follows
+   */
+  static bool try_wake_candidate();
+
+  /**
+   * @brief a DHCP lease, recorded per network (SSID) and mirrored in NVS
+   */
+  struct Lease {
+    uint32_t ssidHash;
+    esp_netif_ip_info_t ip; // address, netmask, gateway
+    esp_ip4_addr_t dns;
+    uint32_t lease_s;          // granted by the server, 0 if unknown
+    uint32_t obtainedEpoch;    // wall clock of the ACK, 0 if not synchronized
+    uint32_t obtainedUptime_s; // uptime of the ACK, meaningful if thisBoot
+    bool thisBoot;
+    bool valid;
+  };
+  static inline Lease leases[ED_WIFI_LEASE_SLOTS] = {};
+  static inline size_t leaseNext = 0; // round robin replacement
+  static inline LeaseReuse leaseReuse = LeaseReuse::Reboot;
+  static inline bool leaseStatic = false;  // DHCP stopped by the static path
+  static inline bool leaseProbing = false; // ARP conflict probe running
+  static inline bool leaseApplied =
+      false; // the coming GOT_IP is the reused lease, not a new one
+  static inline Lease pendingLease = {};
+  static inline TimerHandle_t leaseTimer =
+      nullptr; // end of the conflict probe, then resumption of DHCP
+  static constexpr uint32_t LEASE_PROBE_MS = 200;
+  static constexpr const char *LEASE_NVS_KEY = "WFLEASE";
+  static Lease *findLease(const APCredential &cred);
+  /**
+   * @brief age of a lease
+   * @return UINT32_MAX if unknown (recorded before a reboot, clock not set)
+   */
+  static uint32_t leaseAge_s(const Lease &lease);
+  /**
+   * @brief records the lease just obtained from DHCP for the current network
+   */
+  static void record_lease();
+  /**
+   * @brief on association, reuses the lease of the network per leaseReuse
+   */
+  static void reuse_lease();
+  static void lease_timer_expired();
+  static void lease_timer_callback(TimerHandle_t xTimer);
+  /**
+   * @brief leaves the static path: the DHCP client runs again
+   */
+  static void resume_dhcp();
+  static void loadLeases();
+  static void saveLeases();
+
   // static inline esp_event_handler_instance_t wifi_event_handler_instance =
   // nullptr;
   // esp_event_handler_instance_t ip_event_handler_instance   = nullptr;
   static void wifi_deinit();
-  static std::vector<std::function<void()>>
-      ipReadyCallbacks; // callback subscribers which need launching on IP ready
-  static void runGotIPsubscribers(); // processes the list of method which
-                                     // subscribed the IP assigned event.
+  struct IPReadyCallback {
+    void (*plain)();
+    void (*withCtx)(void *ctx);
+    void *ctx;
+  };
+  static inline IPReadyCallback
+      ipReadyCallbacks[NetEvents::MAX_SUBSCRIBERS]; // subscribeToIPReady
+                                                    // callbacks
+  static void subscribe_ip_ready(const IPReadyCallback &callback);
+  /**
+   * @brief runs a subscribeToIPReady callback, ctx being its slot
+   */
+  static void run_ip_ready_callback(const NetEvents::Info &info, void *ctx);
   static inline esp_netif_t *sta_netif = nullptr;
+  static inline esp_netif_t *ap_netif = nullptr; // created by the AP fallback
   static char station_ID[18];           // the network host ID of the station
   static inline MacAddress station_mac; // the MAC of the device
   // static char _SSID[2][ED_MAX_SSID_PWD_SIZE]; // instance value as we suppose
   // there might be two station configurations, 4G and 5G to handle static char
   // _PWD[2][ED_MAX_SSID_PWD_SIZE];
-  static const uint16_t ReconnectDelay_ms =
-      2000; // dealy before the next wifi reconnection session is launched
   /**
    * @brief initializes MAC and std station ID for wifi operations
    */
@@ -343,21 +1603,185 @@ private:
   static void retry_sta_mode_task(void *arg);
   static void sta_retry_callback(TimerHandle_t xTimer);
   static void init_sta_retry_timer();
-  static TimerHandle_t staRetryTimer;
+  static TimerHandle_t staRetryTimer; // one-shot, armed with apBackoff
+  /**
+   * @brief exponential backoff with jitter: each call to next() doubles the
+   * delay up to the cap, and draws the actual wait uniformly in its upper
+   * half. The draw comes from the hardware RNG (ED_WIFI_RANDOM), so that
+   * devices failing together (router reboot) spread their retries instead of
+   * hitting the AP in lockstep.
+   */
+  class Backoff {
+  public:
+    Backoff(uint32_t base_ms, uint32_t cap_ms)
+        : base_ms(base_ms), cap_ms(cap_ms), step(0) {}
+    /**
+     * @brief provides the delay before the next attempt and advances the
+     * schedule
+     * @return the delay in ms, within [d/2, d) where d = min(cap, base*2^n)
+     */
+    uint32_t next();
+    /**
+     * @brief restarts the schedule from the base delay, on success
+     */
+    void reset() { step = 0; }
+    uint8_t attempts() const { return step; }
+
+  private:
+    const uint32_t base_ms;
+    const uint32_t cap_ms;
+    uint8_t step; // attempts since the last reset
+  };
+  static Backoff retryBackoff; // between retries on the same AP
+  static Backoff apBackoff;    // AP fallback before the next full STA retry
+  static constexpr uint32_t PROBE_INTERVAL_MS =
+      10000; // period of the quick probe while in AP fallback
+  static inline TimerHandle_t probeTimer = nullptr;
+  /**
+   * @brief serving as AP after STA connection failed, as tracked by the
+   * connection state machine
+   */
+  static bool apFallbackActive() {
+    return fsm.current() == ConnectionFsm::State::APFallback;
+  }
+  /**
+   * @brief while in AP fallback, launches a short directed scan for the
+   * known networks so that their return is detected within seconds rather
+   * than at the next apBackoff expiry
+   */
+  static void probe_callback(TimerHandle_t xTimer);
+  /**
+   * @brief leaves the AP fallback and restarts the STA connection flow
+   */
+  static void leave_ap_fallback();
+  /**
+   * @brief stops the portal, the captive DNS and the timers of the AP
+   * fallback if running, then restarts the WiFi in STA mode: the connection
+   * flow starts again on WIFI_EVENT_STA_START
+   */
+  static void restart_sta();
   static esp_err_t wifi_conn_AP();
   static const char *wifi_reason_to_string(uint8_t reason);
   static void event_handler(void *arg, esp_event_base_t event_base,
                             int32_t event_id, void *event_data);
-  // scans the available networks, check if they are matching the ones
-  // registered in APCredentialManager and updates their data of RSSI
-  static void scan_wifi_networks();
+  /**
+   * @brief plans the passes of a scan session: first a directed probe for each
+   * connectable credential on the channel where it was last seen, then a full
+   * sweep of all channels only if the targeted passes found none of them.
+   */
+  class ScanPlanner {
+  public:
+    /**
+     * @brief starts a new scan session collecting the targets
+     * @param targeted false to skip the directed passes and sweep all channels
+     * @param sweep false to never fall back to the full sweep
+     */
+    static void begin(bool targeted = true, bool sweep = true);
+    /**
+     * @brief provides the configuration of the next pass
+     * @param config filled with the scan configuration
+     * @return false when the session is completed
+     */
+    static bool nextPass(wifi_scan_config_t &config);
+    /**
+     * @brief reports the outcome of the pass just completed
+     * @param matched number of tracked SSID detected
+     */
+    static void passDone(uint16_t matched);
+
+  private:
+    static constexpr size_t maxTargets =
+        4; // beyond that, a full sweep costs less airtime
+    struct Target {
+      char ssid[ED_WIFI_SSID_SIZE];
+      uint8_t chann;
+    };
+    static inline Target targets[maxTargets];
+    static inline size_t targetCount = 0;
+    static inline size_t nextTarget = 0;
+    static inline bool matchedAny = false;
+    static inline bool fullSweepDone = false;
+    static inline bool sweepAllowed = true;
+  };
+  static inline bool scanSessionActive =
+      false; // a scan session launched by scan_wifi_networks is ongoing
+  enum class ScanPurpose {
+    Connect, // the session ends connecting to the best AP
+    Roam,    // background scan while connected, the session ends evaluating
+             // a roam
+    Probe,   // quick directed scan while in AP fallback, the session ends
+             // leaving AP mode if a known network is back
+    Survey   // full sweep requested from the portal, the session only lists
+             // the networks in range
+  };
+  static inline ScanPurpose scanPurpose = ScanPurpose::Connect;
+  /**
+   * @brief starts a new scan session: the passes run in background, their
+   * results are processed on WIFI_EVENT_SCAN_DONE by on_scan_done
+   * @param purpose what the session is for
+   */
+  static void scan_wifi_networks(ScanPurpose purpose = ScanPurpose::Connect);
+  /**
+   * @brief launches the next pass of the scan session without blocking
+   * @return false if the session has no more passes
+   */
+  static bool start_scan_pass();
+  /**
+   * @brief collects the results of a completed pass, launches the next one
+   * or, at the end of the session, connects to the best detected AP.
+   * Results are streamed one record at a time: peak memory is one
+   * wifi_ap_record_t on the stack regardless of the number of AP in range.
+   * @param status outcome of the pass as reported by the driver (0 = success)
+   */
+  static void on_scan_done(uint32_t status);
+  /**
+   * @brief the wifi/IP events body, run by event_handler which measures the
+   * time it holds the default event loop
+   */
+  static void handle_event(esp_event_base_t event_base, int32_t event_id,
+                           void *event_data);
+  static constexpr uint32_t EVENT_LOOP_BUDGET_US =
+      20000; // handling above this time is logged as a stall of the loop
+  static inline EventLoopStats eventLoopStats = {};
+  static inline int64_t scanSessionStart_us = 0;
+  static inline ConnTimeline timeline = {};     // connection in progress
+  static inline ConnTimeline lastTimeline = {}; // last completed connection
+  static inline LatencyHistogram latencyHist[(size_t)ConnPhase::Count] = {};
+  /**
+   * @brief adds a sample to the histogram of a phase
+   * @param from_us start of the phase, the sample is dropped if 0
+   * @param to_us end of the phase
+   */
+  static void recordPhase(ConnPhase phase, int64_t from_us, int64_t to_us);
   /**
    * @brief connecte to the next detected AP network.
    * notice that at every calls switches to the next network, until the list of
    * available network is exhausted
    * @return
    */
-  static esp_err_t wifi_conn_STA();
+  static esp_err_t
+  wifi_conn_STA(const APCredential::Radio *radio =
+                    nullptr); // radio to pin, the strongest one if nullptr
+  /**
+   * @brief fills SSID and key of the station configuration from the current
+   * AP: the precomputed PMK as 64 hex digits when it applies, the passphrase
+   * otherwise
+   * @param authmode security of the AP to connect to
+   */
+  static void setStaCredentials(wifi_config_t &cfg, wifi_auth_mode_t authmode);
+  /**
+   * @brief launches the association to the configured AP, recording the
+   * attempt for the connection statistics
+   * @return false if the state machine refuses a connection in the current
+   * state: nothing was launched
+   */
+  static bool start_attempt();
+  static inline bool attemptPending =
+      false; // an association was launched and did not obtain an IP yet
+  static inline int64_t attemptStart_us = 0;
+  static inline bool bssidPinned =
+      false; // the STA config targets a specific radio (pinnedBSSID)
+  static inline uint8_t pinnedBSSID[6] = {};
   static int s_retry_num;
   static TimerHandle_t staRetryDelayed;
   /**
@@ -365,7 +1789,149 @@ private:
    * @param xTimer
    */
   static void reconnectCallback(TimerHandle_t xTimer);
-  static void wifi_diag_task(void *arg);
+  /**
+   * @brief the WiFiService state (credentials, current AP, retries, timers
+   * state) is owned by a single task. Wifi/IP events, timer expiries, the web
+   * interface and the public API post commands to its bounded queue instead
+   * of changing the state from their own task.
+   */
+  enum class Command : uint8_t {
+    WifiEvent,      // eventId, data copied from the event
+    IPEvent,        // eventId, data copied from the event
+    Reconnect,      // staRetryDelayed expired
+    STARetry,       // staRetryTimer expired
+    Probe,          // probeTimer expired
+    RoamCheck,      // roamTimer expired
+    ForceReconnect, // forceReconnect()
+    SetRoamConfig,  // setRoamConfig()
+    SetFastConnect, // setFastConnect()
+    SetLeaseReuse,  // setLeaseReuse()
+    AddCredential,  // APCredentialManager::addOrUpdate(ToNVS)()
+    SaveCredentials, // credential coalescing delay expired
+    LeaseTimer,      // leaseTimer expired
+    RemoveCredential, // APCredentialManager::remove()
+    PortalView,       // the portal reads the state to answer a request
+    Survey,           // the portal requests a full scan
+    StateTrace        // getStateTrace()
+  };
+  struct CommandMsg {
+    Command cmd;
+    int32_t eventId;
+    SemaphoreHandle_t done; // given once executed, if not nullptr
+    bool *result;      // outcome of AddCredential, if not nullptr
+    esp_err_t *status; // outcome of RemoveCredential, if not nullptr
+    union {
+      wifi_event_sta_scan_done_t scanDone;
+      wifi_event_sta_disconnected_t disconnected;
+      ip_event_got_ip_t gotIP;
+      struct {
+        char ssid[ED_WIFI_SSID_SIZE];
+        char password[ED_WIFI_PWD_SIZE];
+        bool canConnect;
+        bool persist; // addOrUpdateToNVS; for a removal, addedOnly
+      } credential;
+      struct {
+        char *buf;
+        size_t size;
+        size_t *length; // written
+        uint8_t view;
+      } portal;
+      struct {
+        ConnectionFsm::Transition *out;
+        size_t max;
+        size_t *count; // written
+      } trace;
+      // copied bytewise: the default member initializers of RoamConfig
+      // would delete the constructor of the union
+      alignas(RoamConfig) uint8_t roamConfig[sizeof(RoamConfig)];
+      bool fastConnect;
+      LeaseReuse leaseReuse;
+    } data;
+  };
+  static constexpr size_t COMMAND_QUEUE_DEPTH = 16;
+  static inline TaskConfig taskConfig = {ED_WIFI_TASK_CORE,
+                                         ED_WIFI_TASK_PRIORITY};
+  static inline QueueHandle_t commandQueue = nullptr;
+  static inline TaskHandle_t ownerTask = nullptr;
+  static inline uint32_t droppedCommands = 0;
+  static inline StaticQueue_t commandQueueBuf;
+  static inline uint8_t
+      commandQueueStorage[COMMAND_QUEUE_DEPTH * sizeof(CommandMsg)];
+  static inline StaticTask_t ownerTaskBuf;
+  static inline StackType_t ownerTaskStack[ED_WIFI_TASK_STACK];
+  /**
+   * @brief creates the command queue and the owner task, once
+   */
+  static void start_owner_task();
+  static void owner_task(void *arg);
+  /**
+   * @brief true when the state can be changed directly: on the owner task,
+   * or before it is started (e.g. credentials added before launch())
+   */
+  static bool onOwnerTask() {
+    return ownerTask == nullptr || xTaskGetCurrentTaskHandle() == ownerTask;
+  }
+  /**
+   * @brief runs the command on the owner task: directly if already there,
+   * otherwise through the queue
+   * @param wait ticks to wait for room in the queue
+   * @return false if the command was dropped
+   */
+  static bool submit(const CommandMsg &msg, TickType_t wait);
+  /**
+   * @brief as submit, waiting for the command to be executed
+   */
+  static bool call(CommandMsg &msg);
+  static void execute(const CommandMsg &msg);
+  static void force_reconnect();
+  /**
+   * @brief setRoamConfig() on the owner task
+   */
+  static void apply_roam_config(const RoamConfig &config);
+  static inline ConnectionFsm fsm;
+  /**
+   * @brief feeds the connection state machine
+   * @return false if the input is not valid in the current state: the caller
+   * drops the corresponding action
+   */
+  static bool transition(ConnectionFsm::Input input);
+  static void trace_transition(const ConnectionFsm::Transition &t);
+  static inline TimerHandle_t historyTimer = nullptr;
+  /**
+   * @brief samples RSSI and free heap into History, every History::SAMPLE_S
+   */
+  static void history_callback(TimerHandle_t xTimer);
+
+  static RoamConfig roamConfig;
+  static inline RoamStats roamStats = {};
+  static inline TimerHandle_t roamTimer = nullptr;
+  enum class RoamStage {
+    Idle,
+    Leaving, // disconnecting from the current radio
+    Joining  // connecting to the candidate radio
+  };
+  static inline RoamStage roamStage = RoamStage::Idle;
+  static inline int64_t roamStart_us = 0;
+  static inline int64_t lastRoamScan_us = 0;
+  static inline uint8_t roamSustained =
+      0; // consecutive scans confirming roamCandidate
+  static inline char roamSSID[ED_WIFI_SSID_SIZE] = {};
+  static inline APCredential::Radio roamCandidate = {};
+  /**
+   * @brief periodic check of the signal of the connected AP, launching
+   * background scans when it degrades
+   * @param xTimer
+   */
+  static void roam_check_callback(TimerHandle_t xTimer);
+  /**
+   * @brief body of the roaming check, run by the owner task
+   */
+  static void check_roam();
+  /**
+   * @brief compares the best detected radio with the connected one at the end
+   * of a background scan, and roams when the advantage is sustained
+   */
+  static void evaluate_roam();
 };
 
 } // namespace ED_wifi
\ No newline at end of file
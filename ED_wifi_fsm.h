@@ -0,0 +1,166 @@
+#pragma once
+/**
+ * @file ED_wifi_fsm.h
+ * @brief connection state machine of ED_wifi.
+ *
+ * Plain C++ without ESP-IDF dependencies: the transition table and the
+ * dispatch are tested on a Linux host by host_test/fsm_test.cpp.
+ */
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_wifi {
+
+class ConnectionFsm {
+public:
+  enum class State : uint8_t {
+    Idle,       // STA stopped or (re)starting
+    Scanning,   // scan session to select the AP
+    Connecting, // association launched, waiting for the IP
+    Connected,  // IP obtained
+    Retrying,   // waiting the backoff delay before retrying the same AP
+    APFallback, // serving as AP, STA retry and probe timers running
+    Count
+  };
+  /**
+   * @brief what happened: either a fact reported by the driver (GotIP) or a
+   * decision taken by the connection logic, or a timer expiry
+   */
+  enum class Input : uint8_t {
+    ScanStart,     // scan session launched to select an AP
+    Connect,       // association launched
+    GotIP,         // IP obtained, accepted in any state
+    RetryLater,    // retry on the same AP scheduled
+    RetryDue,      // the retry delay expired
+    Fallback,      // AP mode entered
+    LeaveFallback, // AP fallback ended (STA retry timer or probe)
+    Stop,          // forced reconnection, STA restarted
+    Count
+  };
+  struct Transition {
+    uint32_t time_ms; // as provided to dispatch
+    State from;
+    Input input;
+    State to; // equal to from if rejected
+    bool accepted;
+  };
+  using Tracer = void (*)(const Transition &t);
+
+  static constexpr size_t STATES = (size_t)State::Count;
+  static constexpr size_t INPUTS = (size_t)Input::Count;
+  static constexpr size_t TRACE_DEPTH = 16;
+
+  /**
+   * @brief next state for each state and input, State::Count where the input
+   * is not valid in that state (e.g. a retry timer expiring after a forced
+   * reconnection)
+   */
+  static constexpr State table[STATES][INPUTS] = {
+      //        ScanStart         Connect            GotIP
+      //        RetryLater        RetryDue           Fallback
+      //        LeaveFallback     Stop
+      /* Idle */
+      {State::Scanning, State::Connecting, State::Connected, State::Count,
+       State::Count, State::APFallback, State::Count, State::Idle},
+      /* Scanning */
+      {State::Scanning, State::Connecting, State::Connected, State::Count,
+       State::Count, State::APFallback, State::Count, State::Idle},
+      /* Connecting */
+      {State::Scanning, State::Connecting, State::Connected, State::Retrying,
+       State::Count, State::APFallback, State::Count, State::Idle},
+      /* Connected */
+      {State::Scanning, State::Connecting, State::Connected, State::Retrying,
+       State::Count, State::APFallback, State::Count, State::Idle},
+      /* Retrying */
+      {State::Count, State::Count, State::Connected, State::Count,
+       State::Connecting, State::Count, State::Count, State::Idle},
+      /* APFallback */
+      {State::Count, State::Count, State::Connected, State::Count,
+       State::Count, State::Count, State::Idle, State::Idle},
+  };
+
+  static constexpr State next(State s, Input i) {
+    return s < State::Count && i < Input::Count
+               ? table[(size_t)s][(size_t)i]
+               : State::Count;
+  }
+  static constexpr bool valid(State s, Input i) {
+    return next(s, i) != State::Count;
+  }
+
+  /**
+   * @brief applies an input
+   * @param now_ms timestamp recorded in the trace
+   * @return false if the input is not valid in the current state, which is
+   * left unchanged
+   */
+  bool dispatch(Input input, uint32_t now_ms) {
+    State from = current();
+    State to = next(from, input);
+    Transition t = {now_ms, from, input, to == State::Count ? from : to,
+                    to != State::Count};
+    trace[traceHead] = t;
+    traceHead = (traceHead + 1) % TRACE_DEPTH;
+    if (traceCount < TRACE_DEPTH)
+      ++traceCount;
+    if (tracer != nullptr)
+      tracer(t);
+    state.store(t.to, std::memory_order_relaxed);
+    return t.accepted;
+  }
+  /**
+   * @brief current state, can be read from any task
+   */
+  State current() const { return state.load(std::memory_order_relaxed); }
+  /**
+   * @brief copies the last transitions, oldest first. Not synchronized with
+   * dispatch: to be called from the task dispatching
+   * @return number of transitions copied
+   */
+  size_t getTrace(Transition *out, size_t max) const {
+    size_t n = traceCount < max ? traceCount : max;
+    size_t first = (traceHead + TRACE_DEPTH - n) % TRACE_DEPTH;
+    for (size_t k = 0; k < n; ++k)
+      out[k] = trace[(first + k) % TRACE_DEPTH];
+    return n;
+  }
+  /**
+   * @brief called on every dispatch, accepted or not
+   */
+  void setTracer(Tracer t) { tracer = t; }
+
+  static constexpr const char *name(State s) {
+    constexpr const char *names[] = {"Idle",      "Scanning", "Connecting",
+                                     "Connected", "Retrying", "APFallback"};
+    return s < State::Count ? names[(size_t)s] : "?";
+  }
+  static constexpr const char *name(Input i) {
+    constexpr const char *names[] = {"ScanStart", "Connect",  "GotIP",
+                                     "RetryLater", "RetryDue", "Fallback",
+                                     "LeaveFallback", "Stop"};
+    return i < Input::Count ? names[(size_t)i] : "?";
+  }
+
+private:
+  std::atomic<State> state{State::Idle};
+  Tracer tracer = nullptr;
+  Transition trace[TRACE_DEPTH] = {};
+  size_t traceHead = 0;
+  size_t traceCount = 0;
+};
+
+// every state can be left, and a forced reconnection always restarts
+static_assert(ConnectionFsm::next(ConnectionFsm::State::APFallback,
+                                  ConnectionFsm::Input::LeaveFallback) ==
+                  ConnectionFsm::State::Idle,
+              "the AP fallback must be left by its timers");
+static_assert(ConnectionFsm::next(ConnectionFsm::State::Retrying,
+                                  ConnectionFsm::Input::RetryDue) ==
+                  ConnectionFsm::State::Connecting,
+              "a due retry must reconnect");
+static_assert(!ConnectionFsm::valid(ConnectionFsm::State::Scanning,
+                                    ConnectionFsm::Input::RetryDue),
+              "a stale retry timer must be ignored");
+
+} // namespace ED_wifi
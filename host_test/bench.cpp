@@ -0,0 +1,308 @@
+/**
+ * @file bench.cpp
+ * @brief microbenchmarks of the APCredentialManager hot paths: scan
+ * processing (updateDetectedAPs: lookup and findAndUpdateInfo per record,
+ * then the ranking qsort with compare_rssi_desc), findAndUpdateInfo alone,
+ * the ranking alone, addOrUpdate/remove and MacAddress::toString. Synthetic
+ * scan sets of 1 to 200 records against tracked lists of 1 to
+ * ED_WIFI_MAX_CREDENTIALS entries, reported in ns/op and allocations/op.
+ * Then the captive portal DNS (CaptiveDNS::answer) on synthetic queries, in
+ * queries/s and allocations/op.
+ *
+ *   wifi_bench           measures, ~0.1 s per row
+ *   wifi_bench --quick   one pass per row, fails if a path allocates
+ *
+ * The capacity is set at configure time: -DED_WIFI_BENCH_CREDENTIALS=64
+ */
+#include "ED_wifi.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+using ED_wifi::MacAddress;
+using CaptiveDNS = ED_wifi::WiFiService::CaptiveDNS;
+using Manager = ED_wifi::WiFiService::APCredentialManager;
+
+// heap allocations of the program, counted in the measured loops only
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size != 0 ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+constexpr size_t CAPACITY = ED_WIFI_MAX_CREDENTIALS;
+constexpr size_t MAX_RECORDS = 200;
+constexpr size_t RECORD_COUNTS[] = {1, 10, 50, 100, 200};
+// a scan set, or one record per tracked credential
+constexpr size_t RECORDS = CAPACITY > MAX_RECORDS ? CAPACITY : MAX_RECORDS;
+
+bool quick = false;
+bool allocating = false; // a measured path allocated
+
+struct Result {
+  double ns;     // per op
+  double allocs; // per op
+};
+
+/**
+ * @brief runs op until the time budget is spent, at least once
+ */
+template <typename Op> Result measure(Op &&op) {
+  using Clock = std::chrono::steady_clock;
+  const auto budget =
+      quick ? std::chrono::microseconds(0) : std::chrono::milliseconds(100);
+  size_t allocsBefore = allocations.load(std::memory_order_relaxed);
+  size_t ops = 0;
+  auto start = Clock::now();
+  auto now = start;
+  do {
+    for (size_t k = 0; k < 16; ++k)
+      op();
+    ops += 16;
+    now = Clock::now();
+  } while (now - start < budget);
+  size_t allocs = allocations.load(std::memory_order_relaxed) - allocsBefore;
+  if (allocs > 0)
+    allocating = true;
+  return {std::chrono::duration<double, std::nano>(now - start).count() / ops,
+          (double)allocs / ops};
+}
+
+void trackedName(char *out, size_t i) { snprintf(out, 33, "tracked-%03zu", i); }
+
+/**
+ * @brief replaces the tracked list, firmware defaults included, with n
+ * connectable synthetic credentials
+ */
+void track(size_t n) {
+  while (Manager::getConnCredentialsQty() > 0)
+    Manager::remove(Manager::getSSID(0));
+  char ssid[33];
+  for (size_t i = 0; i < n; ++i) {
+    trackedName(ssid, i);
+    if (!Manager::addOrUpdate(ssid, "benchmark-password", true)) {
+      fprintf(stderr, "could not track %zu credentials\n", n);
+      exit(1);
+    }
+  }
+}
+
+/**
+ * @brief a scan set of n records: the first ones match the tracked
+ * credentials, one radio each, the others are neighbours
+ */
+void scanSet(wifi_ap_record_t *records, size_t n, size_t tracked) {
+  for (size_t i = 0; i < n; ++i) {
+    wifi_ap_record_t &r = records[i];
+    r = {};
+    if (i < tracked)
+      trackedName((char *)r.ssid, i);
+    else
+      snprintf((char *)r.ssid, sizeof(r.ssid), "neighbour-%03zu", i);
+    const uint8_t bssid[6] = {0x02, 0, 0, 0, (uint8_t)(i >> 8), (uint8_t)i};
+    memcpy(r.bssid, bssid, sizeof(r.bssid));
+    r.primary = 1 + i % 13;
+    r.rssi = (int8_t)(-30 - (int)((i * 37) % 60));
+    r.authmode = WIFI_AUTH_WPA2_PSK;
+  }
+}
+
+// 1, doubling, up to the capacity
+template <typename F> void forTrackedSizes(F &&f) {
+  for (size_t n = 1; n < CAPACITY; n *= 2)
+    f(n);
+  f(CAPACITY);
+}
+
+void benchScanProcessing() {
+  printf("\nupdateDetectedAPs: one scan set, ranking included\n");
+  printf("%8s %8s %12s %12s %10s\n", "tracked", "records", "ns/op",
+         "ns/record", "allocs/op");
+  static wifi_ap_record_t records[RECORDS];
+  forTrackedSizes([](size_t tracked) {
+    track(tracked);
+    for (size_t n : RECORD_COUNTS) {
+      scanSet(records, n, tracked);
+      Result r = measure(
+          [n] { Manager::updateDetectedAPs((uint16_t)n, records); });
+      printf("%8zu %8zu %12.0f %12.1f %10.2f\n", tracked, n, r.ns, r.ns / n,
+             r.allocs);
+    }
+  });
+}
+
+void benchFindAndUpdate() {
+  printf("\nfindAndUpdateInfo: SSID lookup through the index, radio update\n");
+  printf("%8s %12s %12s %10s\n", "tracked", "hit ns/op", "miss ns/op",
+         "allocs/op");
+  forTrackedSizes([](size_t tracked) {
+    track(tracked);
+    char hit[33], miss[33] = "neighbour-000";
+    trackedName(hit, tracked - 1);
+    const uint8_t bssid[6] = {0x02, 0, 0, 0, 0, 1};
+    Result h = measure(
+        [&] { Manager::findAndUpdateInfo(hit, -50, 6, -1, bssid); });
+    Result m = measure(
+        [&] { Manager::findAndUpdateInfo(miss, -50, 6, -1, bssid); });
+    printf("%8zu %12.1f %12.1f %10.2f\n", tracked, h.ns, m.ns,
+           h.allocs + m.allocs);
+  });
+}
+
+void benchRanking() {
+  printf("\nendDetection: scores and qsort with compare_rssi_desc\n");
+  printf("%8s %12s %10s\n", "detected", "ns/op", "allocs/op");
+  static wifi_ap_record_t records[RECORDS];
+  forTrackedSizes([](size_t tracked) {
+    track(tracked);
+    scanSet(records, tracked, tracked);
+    Manager::beginDetection();
+    for (size_t i = 0; i < tracked; ++i)
+      Manager::ingestDetectedAP(records[i]);
+    Result r = measure([] { Manager::endDetection(); });
+    printf("%8zu %12.1f %10.2f\n", tracked, r.ns, r.allocs);
+  });
+}
+
+void benchAddRemove() {
+  printf("\nremove + addOrUpdate: the oldest credential, shifting the list\n");
+  printf("%8s %12s %10s\n", "tracked", "ns/op", "allocs/op");
+  forTrackedSizes([](size_t tracked) {
+    track(tracked);
+    Result r = measure([] {
+      // the oldest entry goes back at the end: the list keeps its size
+      char ssid[33];
+      strncpy(ssid, Manager::getSSID(0), sizeof(ssid) - 1);
+      ssid[sizeof(ssid) - 1] = '\0';
+      Manager::remove(ssid);
+      Manager::addOrUpdate(ssid, "benchmark-password", true);
+    });
+    printf("%8zu %12.1f %10.2f\n", tracked, r.ns, r.allocs);
+  });
+}
+
+void benchMacToString() {
+  printf("\nMacAddress::toString\n");
+  printf("%12s %10s\n", "ns/op", "allocs/op");
+  const uint8_t bytes[6] = {0x24, 0x0A, 0xC4, 0x12, 0xAB, 0xEF};
+  MacAddress mac(bytes);
+  char out[18];
+  Result r = measure([&] {
+    mac.toString(out, sizeof(out));
+    // keeps the call from being optimized out
+    asm volatile("" : : "r"(out) : "memory");
+  });
+  printf("%12.1f %10.2f\n", r.ns, r.allocs);
+}
+
+/**
+ * @brief a dotted name in wire format: length prefixed labels, root label
+ */
+std::string wireName(const std::string &dotted) {
+  std::string out;
+  size_t label = 0;
+  for (;;) {
+    size_t end = dotted.find('.', label);
+    size_t len = (end != std::string::npos ? end : dotted.size()) - label;
+    out += (char)len;
+    out.append(dotted, label, len);
+    if (end == std::string::npos)
+      break;
+    label = end + 1;
+  }
+  return out + '\0';
+}
+
+/**
+ * @brief a query of one question, id 0x1234, recursion desired
+ * @param opcode 0 for a standard query
+ * @param name in wire format, root label included
+ * @param edns appends an OPT record (4096 bytes payload), as most stub
+ * resolvers do
+ */
+std::vector<uint8_t> dnsQuery(uint8_t opcode, const std::string &name,
+                              uint16_t qtype, bool edns) {
+  // id, flags, then 1 question, no answer, no authority, the additional
+  // records
+  const uint8_t header[] = {0x12, 0x34, (uint8_t)(opcode << 3 | 0x01), 0, 0, 1,
+                            0,    0,    0, 0, 0, (uint8_t)(edns ? 1 : 0)};
+  const uint8_t question[] = {(uint8_t)(qtype >> 8), (uint8_t)qtype, 0, 1};
+  // root name, type OPT, payload size, no extended flags, no data
+  const uint8_t opt[] = {0, 0, 41, 0x10, 0, 0, 0, 0, 0, 0, 0};
+  std::string q((const char *)header, sizeof(header));
+  q += name;
+  q.append((const char *)question, sizeof(question));
+  if (edns)
+    q.append((const char *)opt, sizeof(opt));
+  return std::vector<uint8_t>(q.begin(), q.end());
+}
+
+void benchCaptiveDNS() {
+  printf("\nCaptiveDNS::answer: one query copied in, answered in place\n");
+  printf("%-22s %6s %6s %12s %12s %10s\n", "query", "bytes", "answer",
+         "ns/op", "queries/s", "allocs/op");
+  // the name the Android connectivity check resolves
+  const std::string name = wireName("connectivitycheck.gstatic.com");
+  // 251 bytes, close to the 255 allowed
+  const std::string longName =
+      wireName(std::string(63, 'a') + '.' + std::string(63, 'b') + '.' +
+               std::string(63, 'c') + '.' + std::string(57, 'd'));
+  struct Query {
+    const char *name;
+    std::vector<uint8_t> bytes;
+  };
+  const uint32_t addr = 0x0104A8C0; // 192.168.4.1
+  const Query queries[] = {
+      {"A", dnsQuery(0, name, 1, false)},
+      {"A, EDNS", dnsQuery(0, name, 1, true)},
+      {"A, 251 bytes name", dnsQuery(0, longName, 1, false)},
+      {"AAAA", dnsQuery(0, name, 28, false)},
+      {"inverse query", dnsQuery(1, name, 1, false)},
+      {"compressed question",
+       dnsQuery(0, std::string("\xC0\x0C", 2), 1, false)},
+  };
+  static uint8_t msg[512];
+  for (const Query &q : queries) {
+    size_t out = 0;
+    Result r = measure([&] {
+      memcpy(msg, q.bytes.data(), q.bytes.size());
+      out = CaptiveDNS::answer(msg, q.bytes.size(), sizeof(msg), addr);
+      asm volatile("" : : "r"(msg) : "memory");
+    });
+    printf("%-22s %6zu %6zu %12.1f %12.0f %10.2f\n", q.name, q.bytes.size(),
+           out, r.ns, 1e9 / r.ns, r.allocs);
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  printf("APCredentialManager, capacity %zu credentials\n", CAPACITY);
+  benchScanProcessing();
+  benchFindAndUpdate();
+  benchRanking();
+  benchAddRemove();
+  benchMacToString();
+  benchCaptiveDNS();
+  if (allocating) {
+    printf("\na measured path allocated on the heap\n");
+    return 1;
+  }
+  return 0;
+}
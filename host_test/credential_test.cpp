@@ -0,0 +1,142 @@
+/**
+ * @file credential_test.cpp
+ * @brief host test of the credential bookkeeping of ED_wifi.cpp: the radio
+ * table of an SSID, restored histories included, and the credential blob
+ * which cannot be loaded, left as is.
+ *
+ *   credential_test              radio table
+ *   credential_test <blob case>  one rejected blob, in a fresh process: the
+ *                                rejection holds for the rest of the boot
+ */
+#include "ED_wifi.h"
+#include "nvs.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using APCredential = ED_wifi::WiFiService::APCredential;
+using Manager = ED_wifi::WiFiService::APCredentialManager;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);     \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+static const uint8_t bssidA[6] = {0x02, 0, 0, 0, 0, 0x0A};
+static const uint8_t bssidB[6] = {0x02, 0, 0, 0, 0, 0x0B};
+
+static const APCredential::Radio *find(const APCredential &cred,
+                                       const uint8_t *bssid) {
+  for (const APCredential::Radio &r : cred.radios)
+    if (!r.unused() && memcmp(r.bssid, bssid, sizeof(r.bssid)) == 0)
+      return &r;
+  return nullptr;
+}
+
+// a radio restored from NVS, not yet detected, keeps its history when
+// another radio of the SSID is detected first
+static void test_restored_radio_kept() {
+  APCredential cred("home", "password", true);
+  APCredential::Radio &restored = cred.radios[0];
+  memcpy(restored.bssid, bssidA, sizeof(restored.bssid));
+  restored.attempts = 5;
+  restored.successes = 1;
+  restored.meanTimeToIP_ms = 9000;
+
+  cred.updateRadio(bssidB, -60, 6, 100);
+  const APCredential::Radio *a = find(cred, bssidA);
+  const APCredential::Radio *b = find(cred, bssidB);
+  CHECK(a != nullptr && b != nullptr && a != b);
+  CHECK(a != nullptr && a->attempts == 5 && a->successes == 1 &&
+        a->meanTimeToIP_ms == 9000);
+  CHECK(b != nullptr && b->attempts == 0 && b->lastSeen == 100);
+
+  // its detection then updates it in place
+  cred.updateRadio(bssidA, -50, 1, 110);
+  CHECK(find(cred, bssidA) == a && a->attempts == 5 && a->lastSeen == 110);
+}
+
+// a full table replaces its least recently seen radio, history dropped
+static void test_full_table_evicts_oldest() {
+  APCredential cred("home", "password", true);
+  for (size_t i = 0; i < APCredential::maxRadios; ++i) {
+    const uint8_t bssid[6] = {0x02, 0, 0, 0, 1, (uint8_t)i};
+    cred.updateRadio(bssid, -60, 6, 100 + (uint32_t)(i + 1) % 4 * 10);
+  }
+  // the radio 3 was seen at 100
+  APCredential::Radio &oldest = cred.radios[3];
+  CHECK(oldest.lastSeen == 100);
+  oldest.attempts = 2;
+  cred.updateRadio(bssidB, -55, 11, 200);
+  CHECK(find(cred, bssidB) == &oldest);
+  CHECK(oldest.attempts == 0 && oldest.lastSeen == 200);
+  for (size_t i = 0; i < 3; ++i)
+    CHECK(cred.radios[i].bssid[4] == 1 && cred.radios[i].bssid[5] == i);
+}
+
+static void writeBlob(const std::vector<uint8_t> &blob) {
+  nvs_handle_t nvs;
+  CHECK(nvs_open("Config_WiFi", NVS_READWRITE, &nvs) == ESP_OK);
+  CHECK(nvs_set_blob(nvs, "WFCRED", blob.data(), blob.size()) == ESP_OK);
+  nvs_close(nvs);
+}
+
+static std::vector<uint8_t> readBlob() {
+  nvs_handle_t nvs;
+  size_t len = 0;
+  std::vector<uint8_t> blob;
+  if (nvs_open("Config_WiFi", NVS_READONLY, &nvs) != ESP_OK)
+    return blob;
+  if (nvs_get_blob(nvs, "WFCRED", nullptr, &len) == ESP_OK) {
+    blob.resize(len);
+    nvs_get_blob(nvs, "WFCRED", blob.data(), &len);
+  }
+  nvs_close(nvs);
+  return blob;
+}
+
+// a blob the build cannot load survives the next credential saved
+static void test_rejected_blob_kept(const std::vector<uint8_t> &blob) {
+  writeBlob(blob);
+  CHECK(Manager::addOrUpdateToNVS("added", "password") == ESP_OK);
+  CHECK(Manager::flushCredentials() == ESP_ERR_INVALID_STATE);
+  CHECK(readBlob() == blob);
+}
+
+// header of the credential blob: magic, version, count, length, CRC
+static std::vector<uint8_t> blobHeader(uint8_t version) {
+  std::vector<uint8_t> blob(12, 0);
+  const uint32_t magic = 0x45444346;
+  memcpy(blob.data(), &magic, sizeof(magic));
+  blob[4] = version;
+  return blob;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    if (strcmp(argv[1], "blob_oversize") == 0) {
+      // written by a build with more slots
+      std::vector<uint8_t> blob = blobHeader(1);
+      blob.resize(blob.size() + (ED_WIFI_MAX_CREDENTIALS + 1) *
+                                    (3 + ED_WIFI_SSID_SIZE + ED_WIFI_PWD_SIZE));
+      test_rejected_blob_kept(blob);
+    } else if (strcmp(argv[1], "blob_version") == 0) {
+      // written by a later format
+      test_rejected_blob_kept(blobHeader(2));
+    } else {
+      std::printf("unknown case %s\n", argv[1]);
+      return 2;
+    }
+  } else {
+    test_restored_radio_kept();
+    test_full_table_evicts_oldest();
+  }
+  if (failures == 0)
+    std::printf("credential_test %s: OK\n", argc > 1 ? argv[1] : "radios");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+/**
+ * @file fsm_test.cpp
+ * @brief host test of the connection state machine: every cell of the
+ * transition table, the rejection of invalid inputs and the trace.
+ */
+#include "ED_wifi_fsm.h"
+#include <cstdio>
+
+using ED_wifi::ConnectionFsm;
+using S = ConnectionFsm::State;
+using I = ConnectionFsm::Input;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);     \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+// expected next state, S::Count where the input is rejected: the table as
+// documented in ED_wifi_README.md, written out independently
+static constexpr S X = S::Count;
+static constexpr S expected[ConnectionFsm::STATES][ConnectionFsm::INPUTS] = {
+    //  ScanStart    Connect        GotIP         RetryLater
+    //  RetryDue     Fallback       LeaveFallback Stop
+    /* Idle */
+    {S::Scanning, S::Connecting, S::Connected, X, X, S::APFallback, X,
+     S::Idle},
+    /* Scanning */
+    {S::Scanning, S::Connecting, S::Connected, X, X, S::APFallback, X,
+     S::Idle},
+    /* Connecting */
+    {S::Scanning, S::Connecting, S::Connected, S::Retrying, X, S::APFallback,
+     X, S::Idle},
+    /* Connected */
+    {S::Scanning, S::Connecting, S::Connected, S::Retrying, X, S::APFallback,
+     X, S::Idle},
+    /* Retrying */
+    {X, X, S::Connected, X, S::Connecting, X, X, S::Idle},
+    /* APFallback */
+    {X, X, S::Connected, X, X, X, S::Idle, S::Idle},
+};
+
+// drives a fresh machine to the given state through accepted inputs
+static void reach(ConnectionFsm &fsm, S target) {
+  switch (target) {
+  case S::Idle:
+    break;
+  case S::Scanning:
+    fsm.dispatch(I::ScanStart, 0);
+    break;
+  case S::Connecting:
+    fsm.dispatch(I::Connect, 0);
+    break;
+  case S::Connected:
+    fsm.dispatch(I::GotIP, 0);
+    break;
+  case S::Retrying:
+    fsm.dispatch(I::Connect, 0);
+    fsm.dispatch(I::RetryLater, 0);
+    break;
+  case S::APFallback:
+    fsm.dispatch(I::Fallback, 0);
+    break;
+  case S::Count:
+    break;
+  }
+}
+
+static void test_table() {
+  for (size_t s = 0; s < ConnectionFsm::STATES; ++s)
+    for (size_t i = 0; i < ConnectionFsm::INPUTS; ++i) {
+      S want = expected[s][i];
+      CHECK(ConnectionFsm::next((S)s, (I)i) == want);
+      // the same through dispatch, from the state actually reached
+      ConnectionFsm fsm;
+      reach(fsm, (S)s);
+      CHECK(fsm.current() == (S)s);
+      bool accepted = fsm.dispatch((I)i, 7);
+      CHECK(accepted == (want != X));
+      CHECK(fsm.current() == (want != X ? want : (S)s));
+    }
+  // out of range inputs and states are rejected
+  CHECK(!ConnectionFsm::valid(S::Count, I::GotIP));
+  CHECK(!ConnectionFsm::valid(S::Idle, I::Count));
+}
+
+static void test_every_state_reaches_idle() {
+  // Stop always restarts, and no state is a dead end
+  for (size_t s = 0; s < ConnectionFsm::STATES; ++s) {
+    CHECK(ConnectionFsm::next((S)s, I::Stop) == S::Idle);
+    size_t exits = 0;
+    for (size_t i = 0; i < ConnectionFsm::INPUTS; ++i)
+      if (ConnectionFsm::valid((S)s, (I)i) &&
+          ConnectionFsm::next((S)s, (I)i) != (S)s)
+        ++exits;
+    CHECK(exits > 0);
+  }
+}
+
+static size_t traced = 0;
+static ConnectionFsm::Transition lastTraced = {};
+
+static void tracer(const ConnectionFsm::Transition &t) {
+  ++traced;
+  lastTraced = t;
+}
+
+static void test_trace() {
+  ConnectionFsm fsm;
+  fsm.setTracer(tracer);
+  CHECK(fsm.dispatch(I::ScanStart, 10));
+  CHECK(fsm.dispatch(I::Connect, 20));
+  CHECK(!fsm.dispatch(I::RetryDue, 30)); // stale retry timer
+  CHECK(traced == 3);
+  CHECK(!lastTraced.accepted);
+  CHECK(lastTraced.from == S::Connecting && lastTraced.to == S::Connecting);
+
+  ConnectionFsm::Transition out[ConnectionFsm::TRACE_DEPTH];
+  size_t n = fsm.getTrace(out, ConnectionFsm::TRACE_DEPTH);
+  CHECK(n == 3);
+  CHECK(out[0].time_ms == 10 && out[0].from == S::Idle &&
+        out[0].input == I::ScanStart && out[0].to == S::Scanning &&
+        out[0].accepted);
+  CHECK(out[1].time_ms == 20 && out[1].to == S::Connecting);
+  CHECK(out[2].time_ms == 30 && out[2].input == I::RetryDue);
+
+  // a shorter copy keeps the most recent transitions
+  n = fsm.getTrace(out, 2);
+  CHECK(n == 2 && out[0].time_ms == 20 && out[1].time_ms == 30);
+
+  // the ring keeps the last TRACE_DEPTH transitions, oldest first
+  for (uint32_t t = 100; t < 100 + 2 * ConnectionFsm::TRACE_DEPTH; ++t)
+    fsm.dispatch(I::GotIP, t);
+  n = fsm.getTrace(out, ConnectionFsm::TRACE_DEPTH);
+  CHECK(n == ConnectionFsm::TRACE_DEPTH);
+  for (size_t k = 0; k < n; ++k)
+    CHECK(out[k].time_ms == 100 + ConnectionFsm::TRACE_DEPTH + k);
+}
+
+static void test_names() {
+  for (size_t s = 0; s < ConnectionFsm::STATES; ++s)
+    CHECK(ConnectionFsm::name((S)s)[0] != '?');
+  for (size_t i = 0; i < ConnectionFsm::INPUTS; ++i)
+    CHECK(ConnectionFsm::name((I)i)[0] != '?');
+}
+
+int main() {
+  test_table();
+  test_every_state_reaches_idle();
+  test_trace();
+  test_names();
+  if (failures == 0)
+    std::printf("fsm_test: OK\n");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+/**
+ * @file portal_bench.cpp
+ * @brief load benchmark of the provisioning portal: ED_wifi runs on the
+ * simulator until the AP fallback starts the portal, then requests are sent
+ * one after the other to the handlers it registered, as the httpd task would
+ * (sim::httpRequest), the views being rendered by the owner task. Reported
+ * per route in requests/s and latency (mean and max), against tracked lists
+ * from 1 credential to ED_WIFI_MAX_CREDENTIALS and a full list of networks
+ * in range.
+ *
+ *   portal_bench           measures, ~0.1 s per row
+ *   portal_bench --quick   one pass per row, fails on an unexpected status
+ *
+ * The latency is host time: the hop to the owner task is a switch between
+ * host threads of the simulator, not a FreeRTOS context switch, so the
+ * figures compare builds of ED_wifi rather than predict the ESP32.
+ */
+#include "ED_wifi.h"
+#include "esp_http_server.h"
+#include "sim.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+using ED_wifi::ConnectionFsm;
+using ED_wifi::WiFiService;
+using Manager = WiFiService::APCredentialManager;
+
+namespace {
+
+constexpr size_t CAPACITY = ED_WIFI_MAX_CREDENTIALS;
+// neighbours in range: more than the portal lists
+constexpr size_t NEIGHBOURS = ED_WIFI_PORTAL_SCAN_MAX + 4;
+
+bool quick = false;
+bool unexpected = false; // a route answered another status
+
+const char *methodName(int method) {
+  return method == HTTP_GET    ? "GET"
+         : method == HTTP_POST ? "POST"
+                               : "DELETE";
+}
+
+struct Result {
+  double rps;    // requests per second
+  double meanUs; // per request
+  double maxUs;
+};
+
+/**
+ * @brief sends the request until the time budget is spent, at least once,
+ * checking the status of every answer
+ */
+Result measure(const sim::HttpRequest &req, const char *status,
+               sim::HttpResponse &resp) {
+  using Clock = std::chrono::steady_clock;
+  const auto budget =
+      quick ? std::chrono::microseconds(0) : std::chrono::milliseconds(100);
+  size_t ops = 0;
+  double maxUs = 0;
+  auto start = Clock::now();
+  auto now = start;
+  do {
+    auto sent = now;
+    if (!sim::httpRequest(req, resp) ||
+        strncmp(resp.status.c_str(), status, strlen(status)) != 0) {
+      printf("%s %s: answered %s, expected %s\n", methodName(req.method),
+             req.uri.c_str(), resp.status.c_str(), status);
+      unexpected = true;
+      break;
+    }
+    ++ops;
+    now = Clock::now();
+    double us = std::chrono::duration<double, std::micro>(now - sent).count();
+    if (us > maxUs)
+      maxUs = us;
+  } while (now - start < budget);
+  double totalUs =
+      std::chrono::duration<double, std::micro>(now - start).count();
+  if (ops == 0)
+    return {0, 0, 0};
+  return {ops / totalUs * 1e6, totalUs / ops, maxUs};
+}
+
+void trackedName(char *out, size_t i) {
+  snprintf(out, 33, "tracked-%03zu", i);
+}
+
+/**
+ * @brief replaces the tracked list, firmware defaults included, with n
+ * credentials
+ */
+void track(size_t n) {
+  while (Manager::getConnCredentialsQty() > 0)
+    Manager::remove(Manager::getSSID(0));
+  char ssid[33];
+  for (size_t i = 0; i < n; ++i) {
+    trackedName(ssid, i);
+    if (!Manager::addOrUpdate(ssid, "benchmark-password", true)) {
+      fprintf(stderr, "could not track %zu credentials\n", n);
+      _exit(1);
+    }
+  }
+}
+
+// 1, doubling, up to the capacity
+template <typename F> void forTrackedSizes(F &&f) {
+  for (size_t n = 1; n < CAPACITY; n *= 2)
+    f(n);
+  f(CAPACITY);
+}
+
+bool portalUp() {
+  sim::HttpResponse resp;
+  return sim::httpRequest({HTTP_GET, "/api/scan", "", ""}, resp);
+}
+
+void benchNetworksBySize() {
+  printf("\nGET /api/networks: the JSON of the tracked list\n");
+  printf("%8s %8s %12s %10s %10s\n", "tracked", "bytes", "requests/s",
+         "mean us", "max us");
+  forTrackedSizes([](size_t tracked) {
+    track(tracked);
+    sim::HttpResponse resp;
+    Result r = measure({HTTP_GET, "/api/networks", "", ""}, "200", resp);
+    printf("%8zu %8zu %12.0f %10.1f %10.1f\n", tracked, resp.bytes, r.rps,
+           r.meanUs, r.maxUs);
+  });
+}
+
+void benchRoutes() {
+  track(CAPACITY);
+  // the networks in range, as listed after a survey
+  sim::HttpResponse resp;
+  sim::httpRequest({HTTP_POST, "/api/scan", "", ""}, resp);
+  sim::run_for(15000);
+  sim::httpRequest({HTTP_GET, "/", "", ""}, resp);
+  std::string etag = resp.header("ETag");
+
+  const char *form = "ssid=tracked-000&password=benchmark-password";
+  const char *json =
+      "{\"ssid\":\"tracked-000\",\"password\":\"benchmark-password\"}";
+  struct Route {
+    const char *name;
+    sim::HttpRequest req;
+    const char *status;
+  };
+  const Route routes[] = {
+      {"GET /", {HTTP_GET, "/", "", ""}, "200"},
+      {"GET / (cached)", {HTTP_GET, "/", "", etag}, "304"},
+      {"GET /api/networks", {HTTP_GET, "/api/networks", "", ""}, "200"},
+      {"GET /api/scan", {HTTP_GET, "/api/scan", "", ""}, "200"},
+      {"POST /api/networks", {HTTP_POST, "/api/networks", json, ""}, "200"},
+      {"POST /set_ap", {HTTP_POST, "/set_ap", form, ""}, "200"},
+      {"DELETE /api/networks",
+       {HTTP_DELETE, "/api/networks?ssid=unknown", "", ""},
+       "404"},
+      {"GET /generate_204", {HTTP_GET, "/generate_204", "", ""}, "302"},
+  };
+  printf("\nroutes: %zu credentials tracked, %zu networks in range\n",
+         CAPACITY, NEIGHBOURS);
+  printf("%-22s %6s %8s %12s %10s %10s\n", "route", "status", "bytes",
+         "requests/s", "mean us", "max us");
+  for (const Route &route : routes) {
+    Result r = measure(route.req, route.status, resp);
+    printf("%-22s %6.3s %8zu %12.0f %10.1f %10.1f\n", route.name,
+           resp.status.c_str(), resp.bytes, r.rps, r.meanUs, r.maxUs);
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  sim::start(1);
+  if (getenv("SIM_LOG") == nullptr)
+    sim::setLogLevel(ESP_LOG_NONE); // the fallback logs its failed attempts
+  // no known network in range: the AP fallback starts the portal
+  for (size_t i = 0; i < NEIGHBOURS; ++i) {
+    char ssid[33];
+    snprintf(ssid, sizeof(ssid), "neighbour-%02zu", i);
+    sim::addAP({ssid, {0x02, 0, 0, 0, 0x10, (uint8_t)i},
+                (uint8_t)(1 + i % 13), (int8_t)(-40 - (int)i),
+                WIFI_AUTH_WPA2_PSK, "unknown", true, 300});
+  }
+  WiFiService::launch();
+  if (!sim::run_until(
+          [] {
+            return WiFiService::getConnectionState() ==
+                   ConnectionFsm::State::APFallback;
+          },
+          600000) ||
+      !sim::run_until(portalUp, 1000)) {
+    printf("the portal did not start\n");
+    fflush(stdout);
+    _exit(1);
+  }
+  printf("portal, capacity %zu credentials\n", CAPACITY);
+  benchNetworksBySize();
+  benchRoutes();
+  if (unexpected)
+    printf("\na route answered an unexpected status\n");
+  fflush(stdout);
+  // the simulated tasks never end
+  _exit(unexpected ? 1 : 0);
+}
@@ -0,0 +1,2 @@
+#pragma once
+// host stand-in of the ED_sys PC wrapper: nothing to wrap on the host
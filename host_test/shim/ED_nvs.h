@@ -0,0 +1,16 @@
+#pragma once
+// host stand-in of the ED_nvs component: the namespace registration
+#include "esp_err.h"
+#include <stddef.h>
+
+struct StringLiteral {
+  const char *data;
+  size_t size;
+};
+constexpr StringLiteral make_literal(const char *s) {
+  size_t n = 0;
+  while (s[n] != '\0')
+    ++n;
+  return {s, n};
+}
+#define REGISTER_NVS_NAMESPACE(x)
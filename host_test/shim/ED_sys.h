@@ -0,0 +1,9 @@
+#pragma once
+// host stand-in of the ED_sys component: the device identity
+namespace ED_SYS {
+namespace ESP_std {
+struct Device {
+  static const char *netwName();
+};
+} // namespace ESP_std
+} // namespace ED_SYS
@@ -0,0 +1,5 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
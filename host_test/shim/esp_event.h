@@ -0,0 +1,11 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include "esp_err.h"
+#include "esp_event_base.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+esp_err_t esp_event_loop_create_default(void);
+esp_err_t esp_event_handler_register(esp_event_base_t, int32_t, esp_event_handler_t, void *);
+esp_err_t esp_event_handler_unregister(esp_event_base_t, int32_t, esp_event_handler_t);
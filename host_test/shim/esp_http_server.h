@@ -0,0 +1,35 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+typedef void *httpd_handle_t;
+typedef enum { HTTP_DELETE = 0, HTTP_GET = 1, HTTP_HEAD = 2, HTTP_POST = 3, HTTP_PUT = 4, HTTP_OPTIONS = 6 } httpd_method_t;
+typedef struct httpd_req { httpd_handle_t handle; int method; const char uri[513]; size_t content_len; void *aux; void *user_ctx; } httpd_req_t;
+typedef struct httpd_uri { const char *uri; httpd_method_t method; esp_err_t (*handler)(httpd_req_t *r); void *user_ctx; } httpd_uri_t;
+typedef bool (*httpd_uri_match_func_t)(const char *, const char *, size_t);
+typedef struct { unsigned task_priority; size_t stack_size; int core_id; uint16_t server_port; uint16_t ctrl_port; uint16_t max_open_sockets; uint16_t max_uri_handlers; uint16_t max_resp_headers; uint16_t backlog_conn; bool lru_purge_enable; uint16_t recv_wait_timeout; uint16_t send_wait_timeout; httpd_uri_match_func_t uri_match_fn; } httpd_config_t;
+#define HTTPD_DEFAULT_CONFIG() { 5, 4096, 0x7FFFFFFF, 80, 32768, 7, 8, 8, 5, false, 5, 5, nullptr }
+#define HTTPD_RESP_USE_STRLEN -1
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+#define ESP_ERR_HTTPD_RESULT_TRUNC (0xb000 + 3)
+typedef enum { HTTPD_404_NOT_FOUND = 4, HTTPD_400_BAD_REQUEST = 1, HTTPD_500_INTERNAL_SERVER_ERROR = 0 } httpd_err_code_t;
+typedef esp_err_t (*httpd_err_handler_func_t)(httpd_req_t *req, httpd_err_code_t error);
+esp_err_t httpd_start(httpd_handle_t *, const httpd_config_t *);
+esp_err_t httpd_stop(httpd_handle_t);
+esp_err_t httpd_register_uri_handler(httpd_handle_t, const httpd_uri_t *);
+esp_err_t httpd_register_err_handler(httpd_handle_t, httpd_err_code_t, httpd_err_handler_func_t);
+esp_err_t httpd_resp_send(httpd_req_t *, const char *, ssize_t);
+esp_err_t httpd_resp_send_chunk(httpd_req_t *, const char *, ssize_t);
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *, const char *);
+esp_err_t httpd_resp_set_status(httpd_req_t *, const char *);
+esp_err_t httpd_resp_set_type(httpd_req_t *, const char *);
+esp_err_t httpd_resp_set_hdr(httpd_req_t *, const char *, const char *);
+esp_err_t httpd_resp_send_err(httpd_req_t *, httpd_err_code_t, const char *);
+int httpd_req_recv(httpd_req_t *, char *, size_t);
+size_t httpd_req_get_hdr_value_len(httpd_req_t *, const char *);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *, const char *, char *, size_t);
+size_t httpd_req_get_url_query_len(httpd_req_t *);
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *, char *, size_t);
+esp_err_t httpd_query_key_value(const char *, const char *, char *, size_t);
+bool httpd_uri_match_wildcard(const char *, const char *, size_t);
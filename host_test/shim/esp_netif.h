@@ -0,0 +1,39 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_event.h"
+typedef struct esp_netif_obj esp_netif_t;
+typedef struct { uint32_t addr; } esp_ip4_addr_t;
+typedef struct { union { esp_ip4_addr_t ip4; } u_addr; uint8_t type; } esp_ip_addr_t;
+typedef struct { esp_ip4_addr_t ip; esp_ip4_addr_t netmask; esp_ip4_addr_t gw; } esp_netif_ip_info_t;
+typedef enum { ESP_NETIF_DNS_MAIN = 0, ESP_NETIF_DNS_BACKUP, ESP_NETIF_DNS_FALLBACK, ESP_NETIF_DNS_MAX } esp_netif_dns_type_t;
+typedef struct { esp_ip_addr_t ip; } esp_netif_dns_info_t;
+#define IPSTR "%d.%d.%d.%d"
+#define esp_ip4_addr1_16(ipaddr) ((uint16_t)((ipaddr)->addr & 0xff))
+#define esp_ip4_addr2_16(ipaddr) ((uint16_t)(((ipaddr)->addr >> 8) & 0xff))
+#define esp_ip4_addr3_16(ipaddr) ((uint16_t)(((ipaddr)->addr >> 16) & 0xff))
+#define esp_ip4_addr4_16(ipaddr) ((uint16_t)(((ipaddr)->addr >> 24) & 0xff))
+#define IP2STR(ipaddr) esp_ip4_addr1_16(ipaddr), esp_ip4_addr2_16(ipaddr), esp_ip4_addr3_16(ipaddr), esp_ip4_addr4_16(ipaddr)
+#define ESP_IPADDR_TYPE_V4 0
+extern const char *IP_EVENT;
+typedef enum { IP_EVENT_STA_GOT_IP, IP_EVENT_STA_LOST_IP, IP_EVENT_AP_STAIPASSIGNED } ip_event_t;
+typedef struct { esp_netif_t *esp_netif; esp_netif_ip_info_t ip_info; bool ip_changed; } ip_event_got_ip_t;
+esp_err_t esp_netif_init(void);
+esp_netif_t *esp_netif_create_default_wifi_sta(void);
+esp_netif_t *esp_netif_create_default_wifi_ap(void);
+void esp_netif_destroy(esp_netif_t *);
+esp_err_t esp_netif_set_hostname(esp_netif_t *, const char *);
+esp_err_t esp_netif_get_dns_info(esp_netif_t *, esp_netif_dns_type_t, esp_netif_dns_info_t *);
+esp_err_t esp_netif_set_dns_info(esp_netif_t *, esp_netif_dns_type_t, esp_netif_dns_info_t *);
+esp_err_t esp_netif_get_ip_info(esp_netif_t *, esp_netif_ip_info_t *);
+esp_err_t esp_netif_set_ip_info(esp_netif_t *, const esp_netif_ip_info_t *);
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *);
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *);
+esp_netif_t *esp_netif_get_handle_from_ifkey(const char *);
+typedef enum { ESP_NETIF_OP_START = 0, ESP_NETIF_OP_SET, ESP_NETIF_OP_GET } esp_netif_dhcp_option_mode_t;
+typedef enum { ESP_NETIF_IP_ADDRESS_LEASE_TIME = 52 } esp_netif_dhcp_option_id_t;
+esp_err_t esp_netif_dhcpc_option(esp_netif_t *, esp_netif_dhcp_option_mode_t, esp_netif_dhcp_option_id_t, void *, uint32_t);
+typedef esp_err_t (*esp_netif_callback_fn)(void *ctx);
+esp_err_t esp_netif_tcpip_exec(esp_netif_callback_fn fn, void *ctx);
+
@@ -0,0 +1,4 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include "esp_netif.h"
+void *esp_netif_get_netif_impl(esp_netif_t *);
@@ -0,0 +1,4 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include <stdint.h>
+uint32_t esp_random(void);
@@ -0,0 +1,4 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include <stdint.h>
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len);
@@ -0,0 +1,32 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_system.h"
+#include "esp_wifi_types.h"
+extern const char *WIFI_EVENT;
+typedef struct { int nvs_enable; int dummy; } wifi_init_config_t;
+#define WIFI_INIT_CONFIG_DEFAULT() { 1, 0 }
+esp_err_t esp_wifi_init(const wifi_init_config_t *);
+esp_err_t esp_wifi_deinit(void);
+esp_err_t esp_wifi_set_mode(wifi_mode_t);
+esp_err_t esp_wifi_get_mode(wifi_mode_t *);
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_stop(void);
+esp_err_t esp_wifi_connect(void);
+esp_err_t esp_wifi_disconnect(void);
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *, bool block);
+esp_err_t esp_wifi_scan_stop(void);
+esp_err_t esp_wifi_scan_get_ap_num(uint16_t *);
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t *, wifi_ap_record_t *);
+esp_err_t esp_wifi_scan_get_ap_record(wifi_ap_record_t *);
+esp_err_t esp_wifi_clear_ap_list(void);
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *);
+esp_err_t esp_wifi_set_config(wifi_interface_t, wifi_config_t *);
+esp_err_t esp_wifi_get_config(wifi_interface_t, wifi_config_t *);
+esp_err_t esp_wifi_get_mac(wifi_interface_t, uint8_t mac[6]);
+esp_err_t esp_wifi_set_storage(int);
+esp_err_t esp_wifi_sta_get_rssi(int *);
+#define WIFI_STORAGE_RAM 1
+#define WIFI_STORAGE_FLASH 0
@@ -0,0 +1,42 @@
+#pragma once
+// host stand-in of FreeRTOS as configured by ESP-IDF (1 ms tick). The kernel
+// behind it is the cooperative scheduler of the simulator, on virtual time.
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint8_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define errQUEUE_FULL 0
+#define portMAX_DELAY 0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(x) ((TickType_t)(x))
+#define pdTICKS_TO_MS(x) ((uint32_t)(x))
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define tskIDLE_PRIORITY 0
+#define configMINIMAL_STACK_SIZE 768
+#define BIT0 0x01
+#define BIT1 0x02
+#define BIT2 0x04
+
+typedef struct tskTaskControlBlock *TaskHandle_t;
+typedef struct QueueDefinition *QueueHandle_t;
+typedef struct QueueDefinition *SemaphoreHandle_t;
+typedef struct tmrTimerControl *TimerHandle_t;
+// buffers of the static allocation API, unused by the host kernel
+typedef struct {
+  uint8_t dummy[96];
+} StaticQueue_t;
+typedef struct {
+  uint8_t dummy[96];
+} StaticSemaphore_t;
+typedef struct {
+  uint8_t dummy[128];
+} StaticTask_t;
@@ -0,0 +1,6 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include "lwip/netif.h"
+#include <stdint.h>
+struct dhcp { uint32_t offered_t0_lease; };
+struct dhcp *netif_dhcp_data(struct netif *);
@@ -0,0 +1,9 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include "lwip/netif.h"
+typedef int8_t err_t;
+struct eth_addr { uint8_t addr[6]; };
+err_t etharp_request(struct netif *, const ip4_addr_t *);
+ssize_t etharp_find_addr(struct netif *, const ip4_addr_t *, struct eth_addr **, const ip4_addr_t **);
+struct pbuf;
+err_t etharp_query(struct netif *, const ip4_addr_t *, struct pbuf *);
@@ -0,0 +1,5 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include <stdint.h>
+typedef struct ip4_addr { uint32_t addr; } ip4_addr_t;
+#define ip4_addr_set_u32(d, v) ((d)->addr = (v))
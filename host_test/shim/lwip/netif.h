@@ -0,0 +1,4 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include "lwip/ip4_addr.h"
+struct netif { void *client_data[4]; };
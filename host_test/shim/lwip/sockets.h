@@ -0,0 +1,32 @@
+#pragma once
+// host stand-in of the lwIP socket API. As lwIP does with
+// LWIP_COMPAT_SOCKETS, the BSD names are mapped to lwip_* functions, which
+// the simulator implements: no host socket is ever opened.
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+int lwip_socket(int domain, int type, int protocol);
+int lwip_bind(int s, const struct sockaddr *name, socklen_t namelen);
+int lwip_setsockopt(int s, int level, int optname, const void *optval,
+                    socklen_t optlen);
+ssize_t lwip_recvfrom(int s, void *mem, size_t len, int flags,
+                      struct sockaddr *from, socklen_t *fromlen);
+ssize_t lwip_sendto(int s, const void *data, size_t size, int flags,
+                    const struct sockaddr *to, socklen_t tolen);
+int lwip_close(int s);
+
+#define socket(domain, type, protocol) lwip_socket(domain, type, protocol)
+#define bind(s, name, namelen) lwip_bind(s, name, namelen)
+#define setsockopt(s, level, optname, optval, optlen)                          \
+  lwip_setsockopt(s, level, optname, optval, optlen)
+#define recvfrom(s, mem, len, flags, from, fromlen)                            \
+  lwip_recvfrom(s, mem, len, flags, from, fromlen)
+#define sendto(s, data, size, flags, to, tolen)                                \
+  lwip_sendto(s, data, size, flags, to, tolen)
+#define close(s) lwip_close(s)
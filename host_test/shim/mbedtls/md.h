@@ -0,0 +1,10 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include <stddef.h>
+typedef enum { MBEDTLS_MD_NONE = 0, MBEDTLS_MD_SHA1 = 4 } mbedtls_md_type_t;
+typedef struct { void *p; } mbedtls_md_context_t;
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+void mbedtls_md_init(mbedtls_md_context_t *);
+void mbedtls_md_free(mbedtls_md_context_t *);
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t);
+int mbedtls_md_setup(mbedtls_md_context_t *, const mbedtls_md_info_t *, int);
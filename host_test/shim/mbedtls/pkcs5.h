@@ -0,0 +1,6 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include "mbedtls/md.h"
+#include <stdint.h>
+int mbedtls_pkcs5_pbkdf2_hmac_ext(mbedtls_md_type_t, const unsigned char *, size_t, const unsigned char *, size_t, unsigned int, uint32_t, unsigned char *);
+int mbedtls_pkcs5_pbkdf2_hmac(mbedtls_md_context_t *, const unsigned char *, size_t, const unsigned char *, size_t, unsigned int, uint32_t, unsigned char *);
@@ -0,0 +1,3 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#define MBEDTLS_VERSION_NUMBER 0x03060000
@@ -0,0 +1,23 @@
+#pragma once
+// host stand-in of the ESP-IDF header: the declarations ED_wifi uses
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+esp_err_t nvs_open(const char *, nvs_open_mode_t, nvs_handle_t *);
+void nvs_close(nvs_handle_t);
+esp_err_t nvs_get_str(nvs_handle_t, const char *, char *, size_t *);
+esp_err_t nvs_set_str(nvs_handle_t, const char *, const char *);
+esp_err_t nvs_get_blob(nvs_handle_t, const char *, void *, size_t *);
+esp_err_t nvs_set_blob(nvs_handle_t, const char *, const void *, size_t);
+esp_err_t nvs_erase_key(nvs_handle_t, const char *);
+esp_err_t nvs_commit(nvs_handle_t);
+typedef enum { NVS_TYPE_STR = 0x21, NVS_TYPE_BLOB = 0x42, NVS_TYPE_ANY = 0xff } nvs_type_t;
+typedef struct nvs_opaque_iterator_t *nvs_iterator_t;
+typedef struct { char namespace_name[16]; char key[16]; nvs_type_t type; } nvs_entry_info_t;
+#define NVS_DEFAULT_PART_NAME "nvs"
+esp_err_t nvs_entry_find(const char *, const char *, nvs_type_t, nvs_iterator_t *);
+esp_err_t nvs_entry_next(nvs_iterator_t *);
+esp_err_t nvs_entry_info(nvs_iterator_t, nvs_entry_info_t *);
+void nvs_release_iterator(nvs_iterator_t);
@@ -0,0 +1,6 @@
+#pragma once
+// firmware default credentials of the host build, the networks the
+// simulator scenarios are written against
+#define ED_WIFI_CREDENTIALS                                                    \
+  {"home", "home-pass-1", "C"}, {"office", "office-pass-2", "C"},             \
+      {"neighbour", "not-ours", "U"}
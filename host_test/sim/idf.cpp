@@ -0,0 +1,1035 @@
+/**
+ * @file idf.cpp
+ * @brief the ESP-IDF services of the simulator, on top of its kernel: the
+ * default event loop, the WiFi driver against the scripted radio
+ * environment, NVS in memory, an HTTP server run by sim::httpRequest(), and
+ * inert network interface, lwIP and mbedTLS stand-ins.
+ */
+#include "sim.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+#include <map>
+#include <strings.h>
+// after the standard headers: lwIP maps bind() and others to lwip_* macros
+#include "ED_sys.h"
+#include "esp_event.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_netif_net_stack.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/task.h"
+#include "lwip/dhcp.h"
+#include "lwip/etharp.h"
+#include "lwip/sockets.h"
+#include "mbedtls/pkcs5.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+const char *WIFI_EVENT = "WIFI_EVENT";
+const char *IP_EVENT = "IP_EVENT";
+
+namespace {
+
+esp_log_level_t logLevel = ESP_LOG_ERROR;
+uint32_t randomState = 1;
+
+// default event loop
+
+struct Event {
+  esp_event_base_t base;
+  int32_t id;
+  std::vector<uint8_t> data;
+};
+struct Handler {
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t fn;
+  void *arg;
+};
+std::vector<Handler> handlers;
+QueueHandle_t eventQueue = nullptr;
+
+void eventLoop(void *) {
+  Event *e;
+  while (true) {
+    if (xQueueReceive(eventQueue, &e, portMAX_DELAY) != pdTRUE)
+      continue;
+    // a copy: a handler may register or unregister
+    std::vector<Handler> now = handlers;
+    for (const Handler &h : now)
+      if (strcmp(h.base, e->base) == 0 &&
+          (h.id == ESP_EVENT_ANY_ID || h.id == e->id))
+        h.fn(h.arg, e->base, e->id, e->data.data());
+    delete e;
+  }
+}
+
+void post(esp_event_base_t base, int32_t id, const void *data, size_t size) {
+  if (eventQueue == nullptr)
+    return;
+  Event *e = new Event{base, id, {}};
+  e->data.assign((const uint8_t *)data, (const uint8_t *)data + size);
+  xQueueSend(eventQueue, &e, portMAX_DELAY);
+}
+
+// WiFi driver: the radio actions are run by the driver task at their
+// virtual time, in scheduling order among equals
+
+struct Action {
+  int64_t at_us;
+  uint64_t seq;
+  std::function<void()> fn;
+};
+std::vector<Action> agenda; // sorted by (at_us, seq)
+uint64_t actionSeq = 0;
+const char agendaChanged = 0;
+
+void schedule_at(int64_t at_us, std::function<void()> fn) {
+  Action a = {at_us, actionSeq++, std::move(fn)};
+  size_t i = agenda.size();
+  while (i > 0 && agenda[i - 1].at_us > at_us)
+    --i;
+  agenda.insert(agenda.begin() + i, std::move(a));
+  sim::detail::wake(&agendaChanged);
+}
+
+void schedule(uint32_t delay_ms, std::function<void()> fn) {
+  schedule_at(sim::now_us() + (int64_t)delay_ms * 1000, std::move(fn));
+}
+
+void radioTask(void *) {
+  while (true) {
+    if (agenda.empty()) {
+      sim::detail::waitOn(&agendaChanged, -1);
+      continue;
+    }
+    if (agenda.front().at_us > sim::now_us()) {
+      sim::detail::waitOn(&agendaChanged, agenda.front().at_us);
+      continue;
+    }
+    Action a = std::move(agenda.front());
+    agenda.erase(agenda.begin());
+    a.fn();
+  }
+}
+
+std::vector<sim::AP> world;
+std::vector<sim::ScanRecord> scanLog;
+std::vector<sim::ConnectRecord> connectLog;
+
+// typical durations of the driver, in ms
+constexpr uint32_t START_MS = 5;
+constexpr uint32_t CHANNEL_DWELL_MS = 120; // active scan, default dwell
+constexpr uint32_t CHANNELS = 13;
+constexpr uint32_t ASSOC_MS = 80;           // auth + assoc + 4-way handshake
+constexpr uint32_t NO_AP_MS = 2000;         // connect scan finding nothing
+constexpr uint32_t HANDSHAKE_FAIL_MS = 1000; // wrong key
+constexpr uint32_t BEACON_TIMEOUT_MS = 3000;
+
+enum class Link { Idle, Connecting, Associated, GotIP };
+struct Driver {
+  bool init = false;
+  bool started = false;
+  wifi_mode_t mode = WIFI_MODE_NULL;
+  wifi_config_t sta = {};
+  wifi_config_t ap = {};
+  bool scanning = false;
+  std::vector<wifi_ap_record_t> results;
+  Link link = Link::Idle;
+  int linkedAP = -1;
+  uint32_t session = 0; // bumped to cancel the pending connection actions
+  bool apStarted = false;
+} drv;
+
+} // namespace
+
+struct esp_netif_obj {
+  esp_netif_ip_info_t ip;
+  struct netif lwip;
+};
+
+namespace {
+
+esp_netif_obj staNetif = {};
+esp_netif_obj apNetif = {};
+
+uint32_t ip4(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  return (uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) |
+         ((uint32_t)d << 24);
+}
+
+/**
+ * @brief stand-in of the WPA2 PMK of a passphrase: any deterministic
+ * function of passphrase and SSID does, the driver checks against the same
+ */
+void fakePMK(const char *password, size_t pwdLen, const char *ssid,
+             size_t ssidLen, uint8_t *out, size_t outLen) {
+  uint64_t h = 1469598103934665603ULL; // FNV-1a
+  auto mix = [&h](const char *p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      h ^= (uint8_t)p[i];
+      h *= 1099511628211ULL;
+    }
+  };
+  mix(password, pwdLen);
+  mix("|", 1);
+  mix(ssid, ssidLen);
+  for (size_t i = 0; i < outLen; ++i) {
+    h ^= i;
+    h *= 1099511628211ULL;
+    out[i] = (uint8_t)(h >> 56);
+  }
+}
+
+bool keyMatches(const sim::AP &ap, const std::string &key) {
+  if (ap.auth == WIFI_AUTH_OPEN)
+    return true;
+  if (key.size() != 64)
+    return ap.password == key;
+  uint8_t pmk[32];
+  fakePMK(ap.password.data(), ap.password.size(), ap.ssid.data(),
+          ap.ssid.size(), pmk, sizeof(pmk));
+  char hex[65];
+  for (size_t i = 0; i < 32; ++i)
+    snprintf(&hex[2 * i], 3, "%02x", pmk[i]);
+  return strcasecmp(hex, key.c_str()) == 0;
+}
+
+// the SSID and key fields of the configuration are not terminated when full
+std::string staSSID() {
+  const char *ssid = (const char *)drv.sta.sta.ssid;
+  return std::string(ssid, strnlen(ssid, sizeof(drv.sta.sta.ssid)));
+}
+
+std::string staKey() {
+  const char *key = (const char *)drv.sta.sta.password;
+  return std::string(key, strnlen(key, sizeof(drv.sta.sta.password)));
+}
+
+bool staEnabled() {
+  return drv.mode == WIFI_MODE_STA || drv.mode == WIFI_MODE_APSTA;
+}
+
+void postDisconnected(const sim::AP *ap, uint8_t reason) {
+  wifi_event_sta_disconnected_t e = {};
+  std::string ssid = ap != nullptr ? ap->ssid : staSSID();
+  size_t len = std::min(ssid.size(), sizeof(e.ssid));
+  memcpy(e.ssid, ssid.data(), len);
+  e.ssid_len = len;
+  if (ap != nullptr) {
+    memcpy(e.bssid, ap->bssid, 6);
+    e.rssi = ap->rssi;
+  }
+  e.reason = reason;
+  post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &e, sizeof(e));
+}
+
+/**
+ * @brief drops the link: the station is told why after delay_ms, at once if
+ * 0
+ */
+void dropLink(uint8_t reason, uint32_t delay_ms) {
+  if (drv.link == Link::Idle)
+    return;
+  int index = drv.linkedAP;
+  drv.link = Link::Idle;
+  drv.linkedAP = -1;
+  staNetif.ip = {};
+  uint32_t session = ++drv.session;
+  if (delay_ms == 0) {
+    postDisconnected(index >= 0 ? &world[index] : nullptr, reason);
+    return;
+  }
+  schedule(delay_ms, [index, reason, session] {
+    if (session == drv.session)
+      postDisconnected(index >= 0 ? &world[index] : nullptr, reason);
+  });
+}
+
+/**
+ * @brief the AP the driver associates to for the STA configuration: the
+ * strongest one in range matching SSID, and BSSID and channel when set
+ */
+int selectAP() {
+  int best = -1;
+  for (size_t i = 0; i < world.size(); ++i) {
+    const sim::AP &ap = world[i];
+    if (!ap.up || ap.ssid != staSSID())
+      continue;
+    if (drv.sta.sta.bssid_set && memcmp(ap.bssid, drv.sta.sta.bssid, 6) != 0)
+      continue;
+    if (drv.sta.sta.channel != 0 && drv.sta.sta.channel != ap.channel)
+      continue;
+    if (best < 0 || ap.rssi > world[best].rssi)
+      best = (int)i;
+  }
+  return best;
+}
+
+void connectNow(uint32_t session) {
+  if (session != drv.session || !drv.started)
+    return;
+  int index = selectAP();
+  if (index < 0) {
+    schedule(NO_AP_MS, [session] {
+      if (session != drv.session)
+        return;
+      drv.link = Link::Idle;
+      postDisconnected(nullptr, WIFI_REASON_NO_AP_FOUND);
+    });
+    return;
+  }
+  const sim::AP &ap = world[index];
+  if (!keyMatches(ap, staKey())) {
+    schedule(HANDSHAKE_FAIL_MS, [session, index] {
+      if (session != drv.session)
+        return;
+      drv.link = Link::Idle;
+      postDisconnected(&world[index], WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT);
+    });
+    return;
+  }
+  drv.link = Link::Associated;
+  drv.linkedAP = index;
+  wifi_event_sta_connected_t e = {};
+  memcpy(e.ssid, ap.ssid.data(), std::min(ap.ssid.size(), sizeof(e.ssid)));
+  e.ssid_len = ap.ssid.size();
+  memcpy(e.bssid, ap.bssid, 6);
+  e.channel = ap.channel;
+  e.authmode = ap.auth;
+  post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &e, sizeof(e));
+  schedule(ap.dhcp_ms, [session, index] {
+    if (session != drv.session || drv.link != Link::Associated)
+      return;
+    drv.link = Link::GotIP;
+    staNetif.ip.ip.addr = ip4(192, 168, 1, 100 + index);
+    staNetif.ip.netmask.addr = ip4(255, 255, 255, 0);
+    staNetif.ip.gw.addr = ip4(192, 168, 1, 1);
+    ip_event_got_ip_t got = {};
+    got.esp_netif = &staNetif;
+    got.ip_info = staNetif.ip;
+    got.ip_changed = true;
+    post(IP_EVENT, IP_EVENT_STA_GOT_IP, &got, sizeof(got));
+  });
+}
+
+// NVS
+
+struct NvsEntry {
+  nvs_type_t type;
+  std::vector<uint8_t> bytes;
+};
+std::map<std::string, std::map<std::string, NvsEntry>> nvsData;
+std::vector<std::string> nvsHandles; // namespace of each handle, from 1
+
+std::map<std::string, NvsEntry> *nvsSpace(nvs_handle_t handle) {
+  if (handle == 0 || handle > nvsHandles.size())
+    return nullptr;
+  return &nvsData[nvsHandles[handle - 1]];
+}
+
+esp_err_t nvsGet(nvs_handle_t handle, const char *key, nvs_type_t type,
+                 void *out, size_t *length) {
+  auto *space = nvsSpace(handle);
+  if (space == nullptr)
+    return ESP_ERR_INVALID_ARG;
+  auto it = space->find(key);
+  if (it == space->end() || it->second.type != type)
+    return ESP_ERR_NVS_NOT_FOUND;
+  const std::vector<uint8_t> &bytes = it->second.bytes;
+  if (out == nullptr) {
+    *length = bytes.size();
+    return ESP_OK;
+  }
+  if (*length < bytes.size())
+    return ESP_ERR_NVS_INVALID_LENGTH;
+  memcpy(out, bytes.data(), bytes.size());
+  *length = bytes.size();
+  return ESP_OK;
+}
+
+struct SocketState {
+  uint32_t timeout_ms = 0;
+};
+std::map<int, SocketState> sockets;
+int nextSocket = 54;
+
+} // namespace
+
+struct nvs_opaque_iterator_t {
+  std::vector<std::pair<std::string, nvs_type_t>> keys;
+  std::string space;
+  size_t pos;
+};
+
+// simulator control
+
+namespace sim {
+
+void start(uint32_t seed) {
+  randomState = seed != 0 ? seed : 1;
+  if (const char *level = getenv("SIM_LOG")) {
+    const char *levels = "NEWIDV";
+    const char *p = strchr(levels, level[0]);
+    if (p != nullptr && level[0] != '\0')
+      logLevel = (esp_log_level_t)(p - levels);
+  }
+  detail::startKernel();
+  xTaskCreate(radioTask, "wifi", 4096, nullptr, 23, nullptr);
+}
+
+void setLogLevel(esp_log_level_t level) { logLevel = level; }
+
+int addAP(const AP &ap) {
+  world.push_back(ap);
+  return (int)world.size() - 1;
+}
+
+AP &ap(int index) { return world[index]; }
+
+void setUp(int index, bool up) {
+  world[index].up = up;
+  if (!up && drv.linkedAP == index)
+    dropLink(WIFI_REASON_BEACON_TIMEOUT, BEACON_TIMEOUT_MS);
+}
+
+void at(uint32_t t_ms, std::function<void()> action) {
+  schedule_at((int64_t)t_ms * 1000, std::move(action));
+}
+
+const std::vector<ScanRecord> &scans() { return scanLog; }
+const std::vector<ConnectRecord> &connects() { return connectLog; }
+
+std::string linkedSSID() {
+  return drv.link == Link::GotIP ? world[drv.linkedAP].ssid : std::string();
+}
+
+bool apStarted() { return drv.apStarted; }
+
+} // namespace sim
+
+// logging, system
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+  if (level > logLevel)
+    return;
+  int64_t t = sim::now_us();
+  printf("[%6u.%03u] %c %s: ", (unsigned)(t / 1000000),
+         (unsigned)(t / 1000 % 1000), "NEWIDV"[level], tag);
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  putchar('\n');
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NVS_NOT_FOUND:
+    return "ESP_ERR_NVS_NOT_FOUND";
+  case ESP_ERR_WIFI_NOT_STARTED:
+    return "ESP_ERR_WIFI_NOT_STARTED";
+  case ESP_ERR_WIFI_STATE:
+    return "ESP_ERR_WIFI_STATE";
+  default:
+    return "ERROR";
+  }
+}
+
+int64_t esp_timer_get_time(void) { return sim::now_us(); }
+
+uint32_t esp_random(void) {
+  // xorshift32: the draws of a scenario depend on its seed only
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+uint32_t esp_get_free_heap_size(void) { return 180000; }
+uint32_t esp_get_minimum_free_heap_size(void) { return 150000; }
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(void) {
+  return ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len) {
+  crc = ~crc;
+  for (uint32_t i = 0; i < len; ++i) {
+    crc ^= buf[i];
+    for (int k = 0; k < 8; ++k)
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+  }
+  return ~crc;
+}
+
+const char *ED_SYS::ESP_std::Device::netwName() { return "ed-sim"; }
+
+// the gzip-compressed portal page, embedded by the component build: empty
+asm(".section .rodata\n"
+    ".global _binary_portal_html_gz_start\n"
+    ".global _binary_portal_html_gz_end\n"
+    "_binary_portal_html_gz_start:\n"
+    "_binary_portal_html_gz_end:\n"
+    ".previous\n");
+
+// event loop
+
+esp_err_t esp_event_loop_create_default(void) {
+  if (eventQueue != nullptr)
+    return ESP_ERR_INVALID_STATE;
+  eventQueue = xQueueCreate(32, sizeof(Event *));
+  xTaskCreate(eventLoop, "sys_evt", 2304, nullptr, 20, nullptr);
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id,
+                                     esp_event_handler_t fn, void *arg) {
+  handlers.push_back({base, id, fn, arg});
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_unregister(esp_event_base_t base, int32_t id,
+                                       esp_event_handler_t fn) {
+  for (size_t i = 0; i < handlers.size(); ++i)
+    if (strcmp(handlers[i].base, base) == 0 && handlers[i].id == id &&
+        handlers[i].fn == fn) {
+      handlers.erase(handlers.begin() + i);
+      return ESP_OK;
+    }
+  return ESP_ERR_INVALID_STATE;
+}
+
+// WiFi driver
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *) {
+  drv.init = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_deinit(void) {
+  if (drv.started)
+    return ESP_ERR_WIFI_NOT_INIT; // as the driver: stop first
+  drv.init = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+  drv.mode = mode;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mode(wifi_mode_t *mode) {
+  *mode = drv.mode;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+  if (!drv.init)
+    return ESP_ERR_WIFI_NOT_INIT;
+  if (drv.started)
+    return ESP_OK;
+  drv.started = true;
+  bool sta = staEnabled();
+  bool ap = drv.mode == WIFI_MODE_AP || drv.mode == WIFI_MODE_APSTA;
+  schedule(START_MS, [sta, ap] {
+    if (sta)
+      post(WIFI_EVENT, WIFI_EVENT_STA_START, nullptr, 0);
+    if (ap) {
+      drv.apStarted = true;
+      post(WIFI_EVENT, WIFI_EVENT_AP_START, nullptr, 0);
+    }
+  });
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void) {
+  if (!drv.started)
+    return ESP_OK;
+  dropLink(WIFI_REASON_ASSOC_LEAVE, 0);
+  drv.session++; // cancels a connection in progress
+  drv.link = Link::Idle;
+  drv.started = false;
+  drv.scanning = false;
+  drv.apStarted = false;
+  post(WIFI_EVENT, WIFI_EVENT_STA_STOP, nullptr, 0);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void) {
+  if (!drv.started || !staEnabled())
+    return ESP_ERR_WIFI_NOT_STARTED;
+  uint32_t session = ++drv.session;
+  drv.link = Link::Connecting;
+  connectLog.push_back({sim::now_ms(), staSSID(), drv.sta.sta.bssid_set});
+  schedule(ASSOC_MS, [session] { connectNow(session); });
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void) {
+  if (!drv.started)
+    return ESP_ERR_WIFI_NOT_STARTED;
+  if (drv.link == Link::Connecting) {
+    drv.session++;
+    drv.link = Link::Idle;
+    return ESP_OK;
+  }
+  dropLink(WIFI_REASON_ASSOC_LEAVE, 10);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *config, bool block) {
+  if (!drv.started || !staEnabled())
+    return ESP_ERR_WIFI_NOT_STARTED;
+  if (drv.scanning)
+    return ESP_ERR_WIFI_STATE;
+  drv.scanning = true;
+  uint8_t channel = config != nullptr ? config->channel : 0;
+  std::string ssid = config != nullptr && config->ssid != nullptr
+                         ? (const char *)config->ssid
+                         : "";
+  uint32_t dwell = config != nullptr && config->scan_time.active.max != 0
+                       ? config->scan_time.active.max
+                       : CHANNEL_DWELL_MS;
+  uint32_t duration = dwell * (channel != 0 ? 1 : CHANNELS);
+  size_t record = scanLog.size();
+  scanLog.push_back({sim::now_ms(), channel, ssid, 0});
+  schedule(duration, [channel, ssid, record] {
+    if (!drv.scanning)
+      return; // stopped meanwhile
+    drv.scanning = false;
+    drv.results.clear();
+    for (const sim::AP &ap : world) {
+      if (!ap.up || (channel != 0 && ap.channel != channel) ||
+          (!ssid.empty() && ap.ssid != ssid))
+        continue;
+      wifi_ap_record_t r = {};
+      memcpy(r.bssid, ap.bssid, 6);
+      memcpy(r.ssid, ap.ssid.data(), std::min(ap.ssid.size(), sizeof(r.ssid) - 1));
+      r.primary = ap.channel;
+      r.rssi = ap.rssi;
+      r.authmode = ap.auth;
+      drv.results.push_back(r);
+    }
+    // as the driver, strongest first
+    std::stable_sort(drv.results.begin(), drv.results.end(),
+                     [](const wifi_ap_record_t &a, const wifi_ap_record_t &b) {
+                       return a.rssi > b.rssi;
+                     });
+    scanLog[record].found = drv.results.size();
+    wifi_event_sta_scan_done_t e = {};
+    e.status = 0;
+    e.number = drv.results.size();
+    post(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &e, sizeof(e));
+  });
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_record(wifi_ap_record_t *record) {
+  if (drv.results.empty())
+    return ESP_FAIL;
+  *record = drv.results.front();
+  drv.results.erase(drv.results.begin());
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_clear_ap_list(void) {
+  drv.results.clear();
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *info) {
+  if (drv.link != Link::Associated && drv.link != Link::GotIP)
+    return ESP_ERR_WIFI_NOT_CONNECT;
+  const sim::AP &ap = world[drv.linkedAP];
+  *info = {};
+  memcpy(info->bssid, ap.bssid, 6);
+  memcpy(info->ssid, ap.ssid.data(), std::min(ap.ssid.size(), sizeof(info->ssid) - 1));
+  info->primary = ap.channel;
+  info->rssi = ap.rssi;
+  info->authmode = ap.auth;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf) {
+  if (interface == WIFI_IF_STA)
+    drv.sta = *conf;
+  else
+    drv.ap = *conf;
+  return ESP_OK;
+}
+
+// network interfaces: addresses only, no stack behind
+
+esp_err_t esp_netif_init(void) { return ESP_OK; }
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void) { return &staNetif; }
+
+esp_netif_t *esp_netif_create_default_wifi_ap(void) {
+  apNetif.ip.ip.addr = ip4(192, 168, 4, 1);
+  apNetif.ip.netmask.addr = ip4(255, 255, 255, 0);
+  apNetif.ip.gw.addr = ip4(192, 168, 4, 1);
+  return &apNetif;
+}
+
+void esp_netif_destroy(esp_netif_t *) {}
+
+esp_err_t esp_netif_set_hostname(esp_netif_t *, const char *) { return ESP_OK; }
+
+esp_err_t esp_netif_get_dns_info(esp_netif_t *, esp_netif_dns_type_t,
+                                 esp_netif_dns_info_t *dns) {
+  *dns = {};
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_set_dns_info(esp_netif_t *, esp_netif_dns_type_t,
+                                 esp_netif_dns_info_t *) {
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *netif, esp_netif_ip_info_t *ip) {
+  *ip = netif->ip;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_set_ip_info(esp_netif_t *netif,
+                                const esp_netif_ip_info_t *ip) {
+  netif->ip = *ip;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *) { return ESP_OK; }
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *) { return ESP_OK; }
+
+esp_err_t esp_netif_tcpip_exec(esp_netif_callback_fn fn, void *ctx) {
+  return fn(ctx);
+}
+
+void *esp_netif_get_netif_impl(esp_netif_t *netif) { return &netif->lwip; }
+
+// lwIP: no DHCP client nor ARP table, the lease reuse falls back to DHCP
+
+struct dhcp *netif_dhcp_data(struct netif *) { return nullptr; }
+
+err_t etharp_query(struct netif *, const ip4_addr_t *, struct pbuf *) {
+  return -1;
+}
+
+ssize_t etharp_find_addr(struct netif *, const ip4_addr_t *,
+                         struct eth_addr **, const ip4_addr_t **) {
+  return -1;
+}
+
+// sockets: nobody queries the captive DNS, a receive times out
+
+int lwip_socket(int, int, int) {
+  int s = nextSocket++;
+  sockets[s] = {};
+  return s;
+}
+
+int lwip_bind(int, const struct sockaddr *, socklen_t) { return 0; }
+
+int lwip_setsockopt(int s, int level, int optname, const void *optval,
+                    socklen_t) {
+  if (level == SOL_SOCKET && optname == SO_RCVTIMEO) {
+    const struct timeval *tv = (const struct timeval *)optval;
+    sockets[s].timeout_ms = tv->tv_sec * 1000 + tv->tv_usec / 1000;
+  }
+  return 0;
+}
+
+ssize_t lwip_recvfrom(int s, void *, size_t, int, struct sockaddr *,
+                      socklen_t *) {
+  uint32_t timeout = sockets[s].timeout_ms;
+  vTaskDelay(pdMS_TO_TICKS(timeout != 0 ? timeout : 1000));
+  errno = EAGAIN;
+  return -1;
+}
+
+ssize_t lwip_sendto(int, const void *, size_t size, int,
+                    const struct sockaddr *, socklen_t) {
+  return size;
+}
+
+int lwip_close(int s) {
+  sockets.erase(s);
+  return 0;
+}
+
+// mbedTLS: the PBKDF2 of a PMK, with its CPU time on the ESP32
+
+int mbedtls_pkcs5_pbkdf2_hmac_ext(mbedtls_md_type_t, const unsigned char *pwd,
+                                  size_t pwdLen, const unsigned char *salt,
+                                  size_t saltLen, unsigned int,
+                                  uint32_t keyLen, unsigned char *out) {
+  sim::cpu(600000);
+  fakePMK((const char *)pwd, pwdLen, (const char *)salt, saltLen, out, keyLen);
+  return 0;
+}
+
+// HTTP server: the handlers registered, run by sim::httpRequest()
+
+namespace {
+
+bool serverRunning = false;
+std::vector<httpd_uri_t> uriHandlers;
+httpd_err_handler_func_t notFoundHandler = nullptr;
+
+// the request in progress, behind httpd_req_t::aux
+struct Exchange {
+  const sim::HttpRequest *req;
+  sim::HttpResponse *resp;
+  size_t received; // bytes of the body read by the handler
+};
+
+Exchange &exchange(httpd_req_t *r) { return *(Exchange *)r->aux; }
+
+} // namespace
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *) {
+  static int server;
+  *handle = &server;
+  serverRunning = true;
+  uriHandlers.clear();
+  notFoundHandler = nullptr;
+  return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t) {
+  serverRunning = false;
+  return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t, const httpd_uri_t *uri) {
+  uriHandlers.push_back(*uri);
+  return ESP_OK;
+}
+
+esp_err_t httpd_register_err_handler(httpd_handle_t, httpd_err_code_t code,
+                                     httpd_err_handler_func_t handler) {
+  if (code == HTTPD_404_NOT_FOUND)
+    notFoundHandler = handler;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t len) {
+  exchange(r).resp->bytes =
+      len == HTTPD_RESP_USE_STRLEN ? strlen(buf) : (size_t)len;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+  exchange(r).resp->status = status;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+  return httpd_resp_set_hdr(r, "Content-Type", type);
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field,
+                             const char *value) {
+  exchange(r).resp->headers.emplace_back(field, value);
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *r, httpd_err_code_t code,
+                              const char *msg) {
+  exchange(r).resp->status = code == HTTPD_400_BAD_REQUEST ? "400 Bad Request"
+                             : code == HTTPD_404_NOT_FOUND
+                                 ? "404 Not Found"
+                                 : "500 Internal Server Error";
+  return httpd_resp_send(r, msg, HTTPD_RESP_USE_STRLEN);
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t len) {
+  Exchange &x = exchange(r);
+  size_t n = std::min(len, x.req->body.size() - x.received);
+  memcpy(buf, x.req->body.data() + x.received, n);
+  x.received += n;
+  return (int)n;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field,
+                                      char *val, size_t len) {
+  const std::string &v = exchange(r).req->ifNoneMatch;
+  if (strcasecmp(field, "If-None-Match") != 0 || v.empty())
+    return ESP_ERR_NOT_FOUND;
+  if (v.size() >= len)
+    return ESP_ERR_HTTPD_RESULT_TRUNC;
+  memcpy(val, v.c_str(), v.size() + 1);
+  return ESP_OK;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t len) {
+  const std::string &uri = exchange(r).req->uri;
+  size_t q = uri.find('?');
+  if (q == std::string::npos)
+    return ESP_ERR_NOT_FOUND;
+  if (uri.size() - q - 1 >= len)
+    return ESP_ERR_HTTPD_RESULT_TRUNC;
+  memcpy(buf, uri.c_str() + q + 1, uri.size() - q);
+  return ESP_OK;
+}
+
+esp_err_t httpd_query_key_value(const char *query, const char *key, char *val,
+                                size_t len) {
+  size_t keyLen = strlen(key);
+  for (const char *p = query; *p != '\0';) {
+    const char *end = strchr(p, '&');
+    if (end == nullptr)
+      end = p + strlen(p);
+    if (strncmp(p, key, keyLen) == 0 && p[keyLen] == '=') {
+      const char *v = p + keyLen + 1;
+      size_t n = end - v;
+      if (n >= len)
+        return ESP_ERR_HTTPD_RESULT_TRUNC;
+      memcpy(val, v, n);
+      val[n] = '\0';
+      return ESP_OK;
+    }
+    p = *end == '&' ? end + 1 : end;
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+namespace sim {
+
+std::string HttpResponse::header(const char *name) const {
+  for (const auto &h : headers)
+    if (strcasecmp(h.first.c_str(), name) == 0)
+      return h.second;
+  return std::string();
+}
+
+bool httpRequest(const HttpRequest &req, HttpResponse &resp) {
+  if (!serverRunning)
+    return false;
+  resp = HttpResponse();
+  Exchange x = {&req, &resp, 0};
+  httpd_req_t r = {};
+  strncpy(const_cast<char *>(r.uri), req.uri.c_str(), sizeof(r.uri) - 1);
+  r.method = req.method;
+  r.content_len = req.body.size();
+  r.aux = &x;
+  std::string path = req.uri.substr(0, req.uri.find('?'));
+  for (const httpd_uri_t &u : uriHandlers)
+    if ((int)u.method == req.method && path == u.uri) {
+      u.handler(&r);
+      return true;
+    }
+  if (notFoundHandler != nullptr)
+    notFoundHandler(&r, HTTPD_404_NOT_FOUND);
+  else
+    resp.status = "404 Not Found";
+  return true;
+}
+
+} // namespace sim
+
+// NVS, in memory, empty at start
+
+esp_err_t nvs_flash_init(void) { return ESP_OK; }
+
+esp_err_t nvs_flash_erase(void) {
+  nvsData.clear();
+  return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *space, nvs_open_mode_t mode,
+                   nvs_handle_t *handle) {
+  if (mode == NVS_READONLY && nvsData.find(space) == nvsData.end())
+    return ESP_ERR_NVS_NOT_FOUND; // as NVS, for a namespace never written
+  nvsHandles.push_back(space);
+  *handle = nvsHandles.size();
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t) {}
+
+esp_err_t nvs_commit(nvs_handle_t) { return ESP_OK; }
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out,
+                      size_t *length) {
+  return nvsGet(handle, key, NVS_TYPE_STR, out, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out,
+                       size_t *length) {
+  return nvsGet(handle, key, NVS_TYPE_BLOB, out, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *data,
+                       size_t length) {
+  auto *space = nvsSpace(handle);
+  if (space == nullptr)
+    return ESP_ERR_INVALID_ARG;
+  const uint8_t *bytes = (const uint8_t *)data;
+  (*space)[key] = {NVS_TYPE_BLOB, {bytes, bytes + length}};
+  return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  auto *space = nvsSpace(handle);
+  if (space == nullptr)
+    return ESP_ERR_INVALID_ARG;
+  return space->erase(key) > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_entry_find(const char *, const char *space, nvs_type_t type,
+                         nvs_iterator_t *out) {
+  *out = nullptr;
+  auto it = nvsData.find(space);
+  if (it == nvsData.end())
+    return ESP_ERR_NVS_NOT_FOUND;
+  auto *iter = new nvs_opaque_iterator_t{{}, space, 0};
+  for (const auto &entry : it->second)
+    if (type == NVS_TYPE_ANY || entry.second.type == type)
+      iter->keys.push_back({entry.first, entry.second.type});
+  if (iter->keys.empty()) {
+    delete iter;
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  *out = iter;
+  return ESP_OK;
+}
+
+esp_err_t nvs_entry_next(nvs_iterator_t *iter) {
+  if (++(*iter)->pos < (*iter)->keys.size())
+    return ESP_OK;
+  delete *iter;
+  *iter = nullptr;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_entry_info(nvs_iterator_t iter, nvs_entry_info_t *info) {
+  *info = {};
+  snprintf(info->namespace_name, sizeof(info->namespace_name), "%s",
+           iter->space.c_str());
+  snprintf(info->key, sizeof(info->key), "%s",
+           iter->keys[iter->pos].first.c_str());
+  info->type = iter->keys[iter->pos].second;
+  return ESP_OK;
+}
+
+void nvs_release_iterator(nvs_iterator_t iter) { delete iter; }
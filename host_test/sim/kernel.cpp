@@ -0,0 +1,526 @@
+/**
+ * @file kernel.cpp
+ * @brief the FreeRTOS API of the simulator: tasks, queues, semaphores, task
+ * notifications and software timers on a virtual clock.
+ *
+ * Every task is a host thread, but a single one runs at a time: the running
+ * task keeps the CPU until it blocks, then the highest priority ready task
+ * (the oldest one among equals) gets it. When none is ready, the clock jumps
+ * to the earliest timeout. There is no preemption and no real time involved,
+ * so that a scenario replays identically.
+ */
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "sim.h"
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct tskTaskControlBlock {
+  std::string name;
+  UBaseType_t priority;
+  TaskFunction_t fn;
+  void *arg;
+  std::condition_variable cv;
+  bool ready = true;
+  bool dead = false;
+  bool timedOut = false;
+  const void *waitingOn = nullptr;
+  int64_t wakeAt_us = -1; // -1: no timeout
+  uint32_t notified = 0;
+};
+
+struct QueueDefinition {
+  enum class Kind { Queue, Binary, Mutex } kind;
+  // queue
+  size_t itemSize = 0;
+  size_t length = 0;
+  std::deque<std::vector<uint8_t>> items;
+  // binary semaphore
+  bool given = false;
+  // (recursive) mutex
+  TaskHandle_t holder = nullptr;
+  UBaseType_t depth = 0;
+};
+
+struct tmrTimerControl {
+  std::string name;
+  TickType_t period;
+  bool autoReload;
+  void *id;
+  TimerCallbackFunction_t callback;
+  bool active = false;
+  int64_t expiry_us = 0;
+};
+
+namespace {
+
+std::mutex kernel;
+std::vector<TaskHandle_t> tasks; // in creation order
+TaskHandle_t running = nullptr;
+int64_t clock_us = 0;
+
+std::vector<TimerHandle_t> timers;
+struct Pended {
+  PendedFunction_t fn;
+  void *arg1;
+  uint32_t arg2;
+};
+std::deque<Pended> pended;
+const char timerCommand = 0; // wait object of the timer service
+std::vector<sim::TimerArm> arms;
+
+int64_t deadline(TickType_t ticks) {
+  return ticks == portMAX_DELAY ? -1 : clock_us + (int64_t)ticks * 1000;
+}
+
+/**
+ * @brief the next task to run, advancing the clock if all of them wait
+ */
+TaskHandle_t pick() {
+  while (true) {
+    TaskHandle_t best = nullptr;
+    for (TaskHandle_t t : tasks)
+      if (t->ready && (best == nullptr || t->priority > best->priority))
+        best = t;
+    if (best != nullptr)
+      return best;
+    int64_t next = -1;
+    for (TaskHandle_t t : tasks)
+      if (!t->dead && t->wakeAt_us >= 0 && (next < 0 || t->wakeAt_us < next))
+        next = t->wakeAt_us;
+    if (next < 0) {
+      fprintf(stderr, "sim: every task waits forever\n");
+      fflush(nullptr);
+      _exit(3);
+    }
+    if (next > clock_us)
+      clock_us = next;
+    for (TaskHandle_t t : tasks)
+      if (!t->dead && t->wakeAt_us >= 0 && t->wakeAt_us <= clock_us) {
+        t->ready = true;
+        t->timedOut = true;
+        t->waitingOn = nullptr;
+        t->wakeAt_us = -1;
+      }
+  }
+}
+
+/**
+ * @brief hands the CPU to the next task, the running one being no longer
+ * ready, and waits to get it back
+ */
+void reschedule(std::unique_lock<std::mutex> &lock) {
+  TaskHandle_t self = running;
+  TaskHandle_t next = pick();
+  if (next == self)
+    return;
+  running = next;
+  next->cv.notify_one();
+  if (!self->dead)
+    self->cv.wait(lock, [self] { return running == self; });
+}
+
+bool block(std::unique_lock<std::mutex> &lock, const void *obj,
+           int64_t deadline_us) {
+  if (running == nullptr) {
+    fprintf(stderr, "sim: blocking call before sim::start()\n");
+    _exit(3);
+  }
+  if (deadline_us >= 0 && deadline_us <= clock_us)
+    return false;
+  TaskHandle_t self = running;
+  self->ready = false;
+  self->timedOut = false;
+  self->waitingOn = obj;
+  self->wakeAt_us = deadline_us;
+  reschedule(lock);
+  return !self->timedOut;
+}
+
+void wakeAll(const void *obj) {
+  for (TaskHandle_t t : tasks)
+    if (!t->ready && !t->dead && t->waitingOn == obj) {
+      t->ready = true;
+      t->waitingOn = nullptr;
+      t->wakeAt_us = -1;
+    }
+}
+
+void taskEntry(TaskHandle_t t) {
+  std::unique_lock<std::mutex> lock(kernel);
+  t->cv.wait(lock, [t] { return running == t; });
+  lock.unlock();
+  t->fn(t->arg);
+  lock.lock();
+  t->dead = true;
+  t->ready = false;
+  reschedule(lock);
+}
+
+TaskHandle_t createTask(TaskFunction_t fn, const char *name, void *arg,
+                        UBaseType_t priority) {
+  std::lock_guard<std::mutex> lock(kernel);
+  TaskHandle_t t = new tskTaskControlBlock;
+  t->name = name;
+  t->priority = priority;
+  t->fn = fn;
+  t->arg = arg;
+  tasks.push_back(t);
+  std::thread(taskEntry, t).detach();
+  return t;
+}
+
+void armTimer(TimerHandle_t timer) {
+  timer->active = true;
+  timer->expiry_us = clock_us + (int64_t)timer->period * 1000;
+  arms.push_back({(uint32_t)(clock_us / 1000), timer->name, timer->period});
+  wakeAll(&timerCommand);
+}
+
+/**
+ * @brief the timer service task: pended function calls first, then the
+ * timers in expiry order (creation order among equals)
+ */
+void timerService(void *) {
+  std::unique_lock<std::mutex> lock(kernel);
+  while (true) {
+    if (!pended.empty()) {
+      Pended p = pended.front();
+      pended.pop_front();
+      lock.unlock();
+      p.fn(p.arg1, p.arg2);
+      lock.lock();
+      continue;
+    }
+    TimerHandle_t due = nullptr;
+    for (TimerHandle_t t : timers)
+      if (t->active && (due == nullptr || t->expiry_us < due->expiry_us))
+        due = t;
+    if (due != nullptr && due->expiry_us <= clock_us) {
+      if (due->autoReload)
+        due->expiry_us += (int64_t)due->period * 1000;
+      else
+        due->active = false;
+      lock.unlock();
+      due->callback(due);
+      lock.lock();
+      continue;
+    }
+    block(lock, &timerCommand, due != nullptr ? due->expiry_us : -1);
+  }
+}
+
+} // namespace
+
+namespace sim {
+
+int64_t now_us() { return clock_us; }
+
+void run_for(uint32_t ms) { vTaskDelay(pdMS_TO_TICKS(ms)); }
+
+bool run_until(const std::function<bool()> &cond, uint32_t timeout_ms,
+               uint32_t step_ms) {
+  int64_t end = clock_us + (int64_t)timeout_ms * 1000;
+  while (!cond()) {
+    if (clock_us >= end)
+      return false;
+    run_for(step_ms);
+  }
+  return true;
+}
+
+void cpu(uint32_t us) {
+  std::lock_guard<std::mutex> lock(kernel);
+  clock_us += us;
+}
+
+const std::vector<TimerArm> &timerArms() { return arms; }
+
+namespace detail {
+
+void startKernel() {
+  {
+    std::lock_guard<std::mutex> lock(kernel);
+    TaskHandle_t main = new tskTaskControlBlock;
+    main->name = "main";
+    main->priority = 1;
+    main->fn = nullptr;
+    main->arg = nullptr;
+    tasks.push_back(main);
+    running = main;
+  }
+  createTask(timerService, "Tmr Svc", nullptr, 1);
+}
+
+bool waitOn(const void *obj, int64_t deadline_us) {
+  std::unique_lock<std::mutex> lock(kernel);
+  return block(lock, obj, deadline_us);
+}
+
+void wake(const void *obj) {
+  std::lock_guard<std::mutex> lock(kernel);
+  wakeAll(obj);
+}
+
+} // namespace detail
+} // namespace sim
+
+// tasks
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *out) {
+  TaskHandle_t t = createTask(fn, name, arg, priority);
+  if (out != nullptr)
+    *out = t;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+                                   uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *out,
+                                   BaseType_t core) {
+  return xTaskCreate(fn, name, stack, arg, priority, out);
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name,
+                               uint32_t stack, void *arg, UBaseType_t priority,
+                               StackType_t *stackBuf, StaticTask_t *taskBuf) {
+  return createTask(fn, name, arg, priority);
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name,
+                                           uint32_t stack, void *arg,
+                                           UBaseType_t priority,
+                                           StackType_t *stackBuf,
+                                           StaticTask_t *taskBuf,
+                                           BaseType_t core) {
+  return createTask(fn, name, arg, priority);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  std::unique_lock<std::mutex> lock(kernel);
+  TaskHandle_t t = task != nullptr ? task : running;
+  t->dead = true;
+  t->ready = false;
+  if (t == running) {
+    reschedule(lock);
+    lock.unlock();
+    // the thread of a deleted task never runs again
+    std::condition_variable never;
+    std::unique_lock<std::mutex> parked(kernel);
+    never.wait(parked, [] { return false; });
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  if (ticks == 0)
+    return;
+  std::unique_lock<std::mutex> lock(kernel);
+  block(lock, nullptr, deadline(ticks));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return running; }
+
+TickType_t xTaskGetTickCount(void) { return (TickType_t)(clock_us / 1000); }
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t wait) {
+  std::unique_lock<std::mutex> lock(kernel);
+  TaskHandle_t self = running;
+  int64_t dl = deadline(wait);
+  while (self->notified == 0)
+    if (wait == 0 || !block(lock, self, dl))
+      return 0;
+  uint32_t value = self->notified;
+  self->notified = clearOnExit ? 0 : value - 1;
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> lock(kernel);
+  task->notified++;
+  wakeAll(task);
+  return pdPASS;
+}
+
+// queues
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  QueueHandle_t q = new QueueDefinition;
+  q->kind = QueueDefinition::Kind::Queue;
+  q->length = length;
+  q->itemSize = itemSize;
+  return q;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t itemSize,
+                                 uint8_t *storage, StaticQueue_t *queueBuf) {
+  return xQueueCreate(length, itemSize);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait) {
+  std::unique_lock<std::mutex> lock(kernel);
+  int64_t dl = deadline(wait);
+  while (q->items.size() >= q->length)
+    if (wait == 0 || !block(lock, q, dl))
+      return errQUEUE_FULL;
+  const uint8_t *bytes = (const uint8_t *)item;
+  q->items.emplace_back(bytes, bytes + q->itemSize);
+  wakeAll(q);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait) {
+  std::unique_lock<std::mutex> lock(kernel);
+  int64_t dl = deadline(wait);
+  while (q->items.empty())
+    if (wait == 0 || !block(lock, q, dl))
+      return pdFALSE;
+  memcpy(item, q->items.front().data(), q->itemSize);
+  q->items.pop_front();
+  wakeAll(q);
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  std::lock_guard<std::mutex> lock(kernel);
+  return q->items.size();
+}
+
+// semaphores
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf) {
+  SemaphoreHandle_t s = new QueueDefinition;
+  s->kind = QueueDefinition::Kind::Binary;
+  return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf) {
+  SemaphoreHandle_t s = new QueueDefinition;
+  s->kind = QueueDefinition::Kind::Mutex;
+  return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t *buf) {
+  return xSemaphoreCreateMutexStatic(buf);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait) {
+  std::unique_lock<std::mutex> lock(kernel);
+  int64_t dl = deadline(wait);
+  if (s->kind == QueueDefinition::Kind::Binary) {
+    while (!s->given)
+      if (wait == 0 || !block(lock, s, dl))
+        return pdFALSE;
+    s->given = false;
+    return pdTRUE;
+  }
+  while (s->holder != nullptr && s->holder != running)
+    if (wait == 0 || !block(lock, s, dl))
+      return pdFALSE;
+  s->holder = running;
+  s->depth++;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+  std::lock_guard<std::mutex> lock(kernel);
+  if (s->kind == QueueDefinition::Kind::Binary) {
+    if (s->given)
+      return pdFALSE;
+    s->given = true;
+  } else {
+    if (s->holder != running)
+      return pdFALSE;
+    if (--s->depth == 0)
+      s->holder = nullptr;
+  }
+  wakeAll(s);
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t s, TickType_t wait) {
+  return xSemaphoreTake(s, wait);
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t s) {
+  return xSemaphoreGive(s);
+}
+
+// software timers, run by the timer service task
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+                           UBaseType_t autoReload, void *id,
+                           TimerCallbackFunction_t callback) {
+  std::lock_guard<std::mutex> lock(kernel);
+  TimerHandle_t t = new tmrTimerControl;
+  t->name = name;
+  t->period = period;
+  t->autoReload = autoReload != pdFALSE;
+  t->id = id;
+  t->callback = callback;
+  timers.push_back(t);
+  return t;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait) {
+  std::lock_guard<std::mutex> lock(kernel);
+  armTimer(timer);
+  return pdPASS;
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t wait) {
+  return xTimerStart(timer, wait);
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait) {
+  std::lock_guard<std::mutex> lock(kernel);
+  timer->active = false;
+  wakeAll(&timerCommand);
+  return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period,
+                              TickType_t wait) {
+  // as FreeRTOS, also starts a dormant timer
+  std::lock_guard<std::mutex> lock(kernel);
+  timer->period = period;
+  armTimer(timer);
+  return pdPASS;
+}
+
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t wait) {
+  std::lock_guard<std::mutex> lock(kernel);
+  // the control block is kept: a callback may still be running
+  timer->active = false;
+  for (size_t i = 0; i < timers.size(); ++i)
+    if (timers[i] == timer) {
+      timers.erase(timers.begin() + i);
+      break;
+    }
+  wakeAll(&timerCommand);
+  return pdPASS;
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) {
+  std::lock_guard<std::mutex> lock(kernel);
+  return timer->active ? pdTRUE : pdFALSE;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer) { return timer->id; }
+
+BaseType_t xTimerPendFunctionCall(PendedFunction_t fn, void *arg1,
+                                  uint32_t arg2, TickType_t wait) {
+  std::lock_guard<std::mutex> lock(kernel);
+  pended.push_back({fn, arg1, arg2});
+  wakeAll(&timerCommand);
+  return pdPASS;
+}
@@ -0,0 +1,147 @@
+#pragma once
+/**
+ * @file sim.h
+ * @brief deterministic host simulator of the ESP-IDF environment of ED_wifi.
+ *
+ * The FreeRTOS tasks are host threads scheduled cooperatively, one at a time,
+ * by priority, on a virtual clock: when every task waits, the clock jumps to
+ * the next timeout. Timers, the default event loop, NVS and the WiFi driver
+ * are simulated on top of it, the driver against a scripted radio
+ * environment (APs with RSSI, channel and password, beacon loss, DHCP
+ * delay). A scenario runs in the main task and replays identically for a
+ * given seed, in a fraction of its virtual duration.
+ */
+#include "esp_log.h"
+#include "esp_wifi_types.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+/**
+ * @brief starts the kernel: the calling thread becomes the main task
+ * (priority 1, as app_main), then the timer service and the WiFi driver
+ * tasks are created
+ * @param seed of esp_random()
+ */
+void start(uint32_t seed);
+/**
+ * @brief virtual time since start(), the value of esp_timer_get_time()
+ */
+int64_t now_us();
+inline uint32_t now_ms() { return (uint32_t)(now_us() / 1000); }
+/**
+ * @brief lets the other tasks run for ms of virtual time
+ */
+void run_for(uint32_t ms);
+/**
+ * @brief lets the other tasks run until cond() holds, checked every step_ms
+ * @return false if timeout_ms elapsed first
+ */
+bool run_until(const std::function<bool()> &cond, uint32_t timeout_ms,
+               uint32_t step_ms = 10);
+/**
+ * @brief advances the clock by the CPU time of a computation of the running
+ * task, which keeps the CPU meanwhile
+ */
+void cpu(uint32_t us);
+void setLogLevel(esp_log_level_t level);
+
+/**
+ * @brief an access point of the radio environment
+ */
+struct AP {
+  std::string ssid;
+  uint8_t bssid[6];
+  uint8_t channel;
+  int8_t rssi;
+  wifi_auth_mode_t auth;
+  std::string password;
+  bool up;
+  uint32_t dhcp_ms; // from the association to the IP
+};
+/**
+ * @brief adds an AP to the environment
+ * @return its index
+ */
+int addAP(const AP &ap);
+AP &ap(int index);
+/**
+ * @brief switches an AP on or off: a station associated to it loses its
+ * beacons and is disconnected
+ */
+void setUp(int index, bool up);
+/**
+ * @brief runs an action on the radio environment at t_ms of virtual time,
+ * e.g. sim::at(60000, [] { sim::setUp(0, false); })
+ */
+void at(uint32_t t_ms, std::function<void()> action);
+
+/**
+ * @brief what the driver was asked to do, for the checks of a scenario
+ */
+struct ScanRecord {
+  uint32_t start_ms;
+  uint8_t channel;  // 0 for all channels
+  std::string ssid; // empty for any SSID
+  uint16_t found;
+};
+struct ConnectRecord {
+  uint32_t at_ms;
+  std::string ssid;
+  bool bssidSet;
+};
+struct TimerArm {
+  uint32_t at_ms;
+  std::string name;
+  uint32_t period_ms;
+};
+const std::vector<ScanRecord> &scans();
+const std::vector<ConnectRecord> &connects();
+/**
+ * @brief timers (re)started, with their period
+ */
+const std::vector<TimerArm> &timerArms();
+/**
+ * @brief SSID the station holds an IP on, empty if none
+ */
+std::string linkedSSID();
+bool apStarted();
+
+/**
+ * @brief a request to the HTTP server, run on the calling task as the httpd
+ * task would: the handler registered for the method and path, else the 404
+ * error handler
+ */
+struct HttpRequest {
+  int method;              // httpd_method_t
+  std::string uri;         // path and query
+  std::string body;
+  std::string ifNoneMatch; // header, empty if none
+};
+struct HttpResponse {
+  std::string status = "200 OK";
+  std::vector<std::pair<std::string, std::string>> headers;
+  size_t bytes = 0; // body sent
+  std::string header(const char *name) const;
+};
+/**
+ * @return false if the server is not running
+ */
+bool httpRequest(const HttpRequest &req, HttpResponse &resp);
+
+namespace detail {
+// kernel services for the simulated components
+void startKernel();
+/**
+ * @brief blocks the running task until wake(obj) or the virtual deadline
+ * @param deadline_us absolute, -1 for none
+ * @return false on timeout
+ */
+bool waitOn(const void *obj, int64_t deadline_us);
+void wake(const void *obj);
+} // namespace detail
+
+} // namespace sim
@@ -0,0 +1,368 @@
+/**
+ * @file sim_main.cpp
+ * @brief connection scenarios of ED_wifi, replayed by the simulator in
+ * virtual time: launch(), scanning, retries with backoff, AP fallback and
+ * its probe, against scripted radio environments.
+ *
+ *   wifi_sim              runs every scenario and reports its time-to-IP
+ *   wifi_sim <scenario>   runs one, exit status 0 if its checks pass
+ *   wifi_sim --replay <scenario>  runs it twice, checks both runs match
+ *
+ * Each scenario runs in its own process: the WiFiService state is static.
+ * SIM_LOG=W (or N, I, D, V) sets the level of the ED_wifi log, E by
+ * default, stamped in virtual time.
+ */
+#include "ED_wifi.h"
+#include "sim.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using ED_wifi::ConnectionFsm;
+using ED_wifi::WiFiService;
+using State = ConnectionFsm::State;
+
+namespace {
+
+bool failed = false;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("  %s:%d: CHECK(%s) failed at %u ms\n", __FILE__, __LINE__,      \
+             #cond, sim::now_ms());                                            \
+      failed = true;                                                           \
+    }                                                                          \
+  } while (0)
+
+// the networks of secrets.h, and one not known by the device
+constexpr uint8_t HOME_CH = 6, OFFICE_CH = 11, CAFE_CH = 1;
+
+int addHome(int8_t rssi, uint32_t dhcp_ms = 300) {
+  return sim::addAP({"home", {0x02, 0, 0, 0, 0x01, 0x01}, HOME_CH, rssi,
+                     WIFI_AUTH_WPA2_PSK, "home-pass-1", true, dhcp_ms});
+}
+
+int addOffice(int8_t rssi) {
+  return sim::addAP({"office", {0x02, 0, 0, 0, 0x02, 0x01}, OFFICE_CH, rssi,
+                     WIFI_AUTH_WPA2_PSK, "office-pass-2", true, 300});
+}
+
+int addCafe(int8_t rssi) {
+  return sim::addAP({"cafe", {0x02, 0, 0, 0, 0x03, 0x01}, CAFE_CH, rssi,
+                     WIFI_AUTH_WPA2_PSK, "espresso", true, 300});
+}
+
+bool hasIP() { return !sim::linkedSSID().empty(); }
+
+bool waitIP(uint32_t timeout_ms) { return sim::run_until(hasIP, timeout_ms); }
+
+uint32_t timeToIP_ms() {
+  WiFiService::ConnTimeline t = WiFiService::getLastTimeline();
+  return t.gotIP_us > t.start_us ? (uint32_t)((t.gotIP_us - t.start_us) / 1000)
+                                 : 0;
+}
+
+/**
+ * @brief whether the last transitions of the state machine entered s
+ */
+bool entered(State s) {
+  ConnectionFsm::Transition trace[ConnectionFsm::TRACE_DEPTH];
+  size_t n = WiFiService::getStateTrace(trace, ConnectionFsm::TRACE_DEPTH);
+  for (size_t k = 0; k < n; ++k)
+    if (trace[k].accepted && trace[k].to == s && trace[k].from != s)
+      return true;
+  return false;
+}
+
+struct Report {
+  uint32_t timeToIP_ms = 0; // of the last connection
+  std::string note;
+};
+
+// strongest known network first, on a cold boot without NVS history: one
+// full sweep, then the direct path to the IP
+void cold_boot(Report &r) {
+  addHome(-55);
+  addOffice(-70);
+  addCafe(-40); // strongest, but unknown
+  WiFiService::launch();
+  CHECK(waitIP(30000));
+  CHECK(sim::linkedSSID() == "home");
+  CHECK(WiFiService::getConnectionState() == State::Connected);
+  CHECK(sim::scans().size() == 1 && sim::scans()[0].channel == 0);
+  CHECK(sim::connects().size() == 1);
+  r.timeToIP_ms = timeToIP_ms();
+}
+
+// slow DHCP server: the timeline puts the delay in the DHCP phase
+void slow_dhcp(Report &r) {
+  addHome(-55, 4000);
+  WiFiService::launch();
+  CHECK(waitIP(30000));
+  WiFiService::ConnTimeline t = WiFiService::getLastTimeline();
+  uint32_t dhcp_ms = (uint32_t)((t.gotIP_us - t.connected_us) / 1000);
+  CHECK(dhcp_ms >= 4000 && dhcp_ms < 4100);
+  r.timeToIP_ms = timeToIP_ms();
+  r.note = "DHCP " + std::to_string(dhcp_ms) + " ms";
+}
+
+// the password of the strongest network changed: retries on the same AP
+// with an exponential backoff, then the next network
+void wrong_password(Report &r) {
+  int home = addHome(-50);
+  sim::ap(home).password = "changed-by-the-owner";
+  addOffice(-65);
+  WiFiService::launch();
+  CHECK(sim::run_until([] { return sim::linkedSSID() == "office"; }, 120000));
+  CHECK(WiFiService::getConnectionState() == State::Connected);
+  // the retry delays follow the backoff: within [d/2, d), d doubling from
+  // 1 s up to 8 s
+  uint32_t d = 1000;
+  size_t retries = 0;
+  for (const sim::TimerArm &arm : sim::timerArms()) {
+    if (arm.name != "ReconnectTimer")
+      continue;
+    CHECK(arm.period_ms >= d / 2 && arm.period_ms < d);
+    d = d < 8000 ? d * 2 : 8000;
+    ++retries;
+  }
+  CHECK(retries > 0);
+  size_t onHome = 0;
+  for (const sim::ConnectRecord &c : sim::connects())
+    onHome += c.ssid == "home";
+  CHECK(onHome == retries + 1);
+  r.timeToIP_ms = timeToIP_ms();
+  r.note = std::to_string(retries) + " retries on home";
+}
+
+// beacon loss: the AP of the connection disappears, the station retries it
+// then moves to the other known network
+void beacon_loss(Report &r) {
+  int home = addHome(-50);
+  addOffice(-68);
+  WiFiService::launch();
+  CHECK(waitIP(30000));
+  CHECK(sim::linkedSSID() == "home");
+  uint32_t lost_ms = sim::now_ms() + 60000;
+  sim::at(lost_ms, [home] { sim::setUp(home, false); });
+  CHECK(sim::run_until([] { return sim::linkedSSID() == "office"; }, 180000));
+  CHECK(entered(State::Connected));
+  r.timeToIP_ms = timeToIP_ms();
+  r.note = "back online " + std::to_string(sim::now_ms() - lost_ms) +
+           " ms after the loss";
+}
+
+// the only known network disappears: retries, a rescan, then the AP
+// fallback with the portal. The quick probe, directed on the channel where
+// the network was seen, detects its return well before the fallback backoff
+void ap_fallback_probe(Report &r) {
+  int home = addHome(-60);
+  addCafe(-45);
+  WiFiService::launch();
+  CHECK(waitIP(30000));
+  sim::setUp(home, false);
+  CHECK(sim::run_until(
+      [] { return WiFiService::getConnectionState() == State::APFallback; },
+      180000));
+  sim::run_for(100); // the AP interface starts
+  CHECK(sim::apStarted());
+  size_t probesFrom = sim::scans().size();
+  uint32_t back_ms = sim::now_ms() + 5000;
+  sim::at(back_ms, [home] { sim::setUp(home, true); });
+  CHECK(waitIP(60000));
+  CHECK(sim::linkedSSID() == "home");
+  CHECK(!sim::apStarted());
+  uint32_t recovery_ms = sim::now_ms() - back_ms;
+  // detected by a probe (every 10 s), not by the STA retry timer (30 s)
+  CHECK(recovery_ms < 20000);
+  CHECK(sim::scans().size() > probesFrom);
+  for (size_t i = probesFrom; i < sim::scans().size(); ++i)
+    CHECK(sim::scans()[i].channel == HOME_CH); // no sweep off the AP channel
+  r.timeToIP_ms = timeToIP_ms();
+  r.note = "recovered " + std::to_string(recovery_ms) + " ms after return";
+}
+
+// reconnection with history: the fast connect to the lost AP fails, then
+// the scan planner probes the channels where the known networks were seen
+// instead of sweeping all of them
+void directed_rescan(Report &r) {
+  int home = addHome(-55);
+  addOffice(-60);
+  WiFiService::launch();
+  CHECK(waitIP(30000));
+  uint32_t coldToIP = timeToIP_ms();
+  size_t firstScan = sim::scans().size();
+  sim::run_for(5000);
+  sim::setUp(home, false);
+  WiFiService::forceReconnect();
+  CHECK(sim::run_until([] { return !hasIP(); }, 1000));
+  CHECK(waitIP(30000));
+  CHECK(sim::linkedSSID() == "office");
+  CHECK(sim::scans().size() > firstScan);
+  for (size_t i = firstScan; i < sim::scans().size(); ++i) {
+    const sim::ScanRecord &s = sim::scans()[i];
+    CHECK(s.channel == HOME_CH || s.channel == OFFICE_CH); // no full sweep
+  }
+  r.timeToIP_ms = timeToIP_ms();
+  CHECK(r.timeToIP_ms < coldToIP);
+  r.note = "cold boot " + std::to_string(coldToIP) + " ms";
+}
+
+// an extender of the home network, stronger than the router, fails the
+// handshake: the retries learn it, the station moves to the router radio,
+// which then ranks above the extender despite its weaker signal
+void broken_extender(Report &r) {
+  addHome(-62);
+  int ext = sim::addAP({"home", {0x02, 0, 0, 0, 0x01, 0x02}, 1, -55,
+                        WIFI_AUTH_WPA2_PSK, "extender-lost-its-config", true,
+                        300});
+  WiFiService::launch();
+  CHECK(waitIP(120000));
+  CHECK(sim::linkedSSID() == "home");
+  const WiFiService::APCredential *home = nullptr;
+  for (size_t i = 0; WiFiService::APCredentialManager::getCredential(i); ++i)
+    if (WiFiService::APCredentialManager::getCredential(i)->matches("home"))
+      home = WiFiService::APCredentialManager::getCredential(i);
+  CHECK(home != nullptr);
+  if (home == nullptr)
+    return;
+  const WiFiService::APCredential::Radio *router = nullptr, *extender = nullptr;
+  for (const WiFiService::APCredential::Radio &radio : home->radios) {
+    if (radio.lastSeen == 0)
+      continue;
+    if (memcmp(radio.bssid, sim::ap(ext).bssid, 6) == 0)
+      extender = &radio;
+    else
+      router = &radio;
+  }
+  CHECK(router != nullptr && extender != nullptr);
+  if (router == nullptr || extender == nullptr)
+    return;
+  CHECK(extender->attempts > 1 && extender->successes == 0);
+  CHECK(router->attempts == 1 && router->successes == 1);
+  uint32_t now = sim::now_ms() / 1000;
+  CHECK(home->radioScore(*router, now) > home->radioScore(*extender, now));
+  r.timeToIP_ms = timeToIP_ms();
+  r.note = std::to_string(extender->attempts) + " attempts on the extender";
+}
+
+struct Scenario {
+  const char *name;
+  void (*run)(Report &r);
+};
+constexpr Scenario scenarios[] = {
+    {"cold_boot", cold_boot},
+    {"slow_dhcp", slow_dhcp},
+    {"wrong_password", wrong_password},
+    {"beacon_loss", beacon_loss},
+    {"ap_fallback_probe", ap_fallback_probe},
+    {"directed_rescan", directed_rescan},
+    {"broken_extender", broken_extender},
+};
+
+const Scenario *find(const char *name) {
+  for (const Scenario &s : scenarios)
+    if (strcmp(s.name, name) == 0)
+      return &s;
+  return nullptr;
+}
+
+/**
+ * @brief runs a scenario in this process, which it ends
+ */
+[[noreturn]] void runScenario(const Scenario &s, uint32_t seed) {
+  auto start = std::chrono::steady_clock::now();
+  sim::start(seed);
+  Report r;
+  s.run(r);
+  auto real_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  // what a replay must reproduce
+  uint64_t digest = 1469598103934665603ULL;
+  auto mix = [&digest](uint64_t v) {
+    digest ^= v;
+    digest *= 1099511628211ULL;
+  };
+  for (const sim::ScanRecord &scan : sim::scans())
+    mix(scan.start_ms), mix(scan.channel), mix(scan.found);
+  for (const sim::ConnectRecord &c : sim::connects())
+    mix(c.at_ms), mix(c.ssid.size());
+  for (const sim::TimerArm &arm : sim::timerArms())
+    mix(arm.at_ms), mix(arm.period_ms);
+  printf("%-18s %-4s time-to-IP %6u ms  (%7.1f s virtual, %4lld ms real)"
+         "  %s\n",
+         s.name, failed ? "FAIL" : "ok", r.timeToIP_ms, sim::now_ms() / 1000.0,
+         (long long)real_ms, r.note.c_str());
+  printf("digest %016llx\n", (unsigned long long)digest);
+  fflush(stdout);
+  _exit(failed ? 1 : 0);
+}
+
+/**
+ * @brief runs a scenario in a child process
+ * @param out its output, if not nullptr
+ * @return its exit status
+ */
+int spawn(const Scenario &s, uint32_t seed, std::string *out) {
+  int fds[2];
+  if (out != nullptr && pipe(fds) != 0)
+    return -1;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (out != nullptr) {
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+    }
+    runScenario(s, seed);
+  }
+  if (out != nullptr) {
+    close(fds[1]);
+    char buf[512];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+      out->append(buf, n);
+    close(fds[0]);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  constexpr uint32_t SEED = 0x5EED;
+  if (argc == 3 && strcmp(argv[1], "--replay") == 0) {
+    const Scenario *s = find(argv[2]);
+    if (s == nullptr)
+      return 2;
+    std::string first, second;
+    int a = spawn(*s, SEED, &first);
+    int b = spawn(*s, SEED, &second);
+    std::string digest1 = first.substr(first.rfind("digest"));
+    std::string digest2 = second.substr(second.rfind("digest"));
+    bool same = a == 0 && b == 0 && digest1 == digest2;
+    printf("%s%s", first.c_str(), same ? "replay: identical\n"
+                                       : "replay: runs differ\n");
+    return same ? 0 : 1;
+  }
+  if (argc == 2) {
+    const Scenario *s = find(argv[1]);
+    if (s == nullptr) {
+      fprintf(stderr, "unknown scenario %s\n", argv[1]);
+      return 2;
+    }
+    runScenario(*s, SEED);
+  }
+  int failures = 0;
+  for (const Scenario &s : scenarios)
+    failures += spawn(s, SEED, nullptr) != 0;
+  return failures == 0 ? 0 : 1;
+}